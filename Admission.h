@@ -0,0 +1,196 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <glib.h>
+#include <json-glib/json-glib.h>
+#include <math.h>
+
+// Admission control for new viewers.
+//
+// A new websocket is admitted when there is room for it: a free viewer slot, an encoder that
+// still keeps up with its frame rate (frames in against frames out over the last few seconds,
+// from the encoder telemetry) and enough egress left for one more stream at the current bitrate.
+// Joins are also limited per client IP by a token bucket: --join-burst joins at once, refilled
+// at --join-rate per second, so a page reload or a few viewers behind one NAT get in right away
+// while a client reconnecting in a loop does not.
+//
+// A rejected client gets a status message with the reason and how many seconds to wait before
+// retrying: until its bucket has a token again when rate limited, ADMISSION_RETRY_SECONDS
+// otherwise.
+//
+// Main loop only.
+
+#define ADMISSION_DEFAULT_JOIN_RATE 0.2  // joins per second and IP once the burst is used up
+#define ADMISSION_DEFAULT_JOIN_BURST 4
+#define ADMISSION_DEFAULT_ENCODER_LOAD 110 // input over output frame rate, percent
+#define ADMISSION_RETRY_SECONDS 5
+
+typedef enum
+{
+  ADMISSION_OK = 0,
+  ADMISSION_RATE_LIMITED,
+  ADMISSION_NO_SLOT,
+  ADMISSION_ENCODER_LOAD,
+  ADMISSION_EGRESS,
+  ADMISSION_RESULTS
+} AdmissionResult;
+
+static const gchar *admission_reasons[ADMISSION_RESULTS] = {"ok", "rate_limited", "slots", "encoder_load",
+                                                            "egress"};
+
+// What the server is doing right now, filled in by the application for each check.
+typedef struct
+{
+  gint viewers;          // connected, or being set up
+  gint max_viewers;
+  const gchar *limit_reason; // what max_viewers comes from
+  const gchar *limit_detail;
+  gdouble encoder_load;  // < 0 if unknown
+  gint egress_kbps;      // all viewers plus the UDP client
+  gint viewer_kbps;      // what one more viewer would add
+} AdmissionLoad;
+
+typedef struct
+{
+  gdouble tokens;
+  gint64 updated_us;
+} AdmissionBucket;
+
+typedef struct
+{
+  gdouble join_rate;
+  gint join_burst;
+  gint max_encoder_load;  // percent, 100 keeps up, 0 off
+  gint egress_limit_kbps; // 0 unlimited
+
+  GHashTable *buckets;    // client IP -> AdmissionBucket
+  guint64 admitted;
+  guint64 rejected[ADMISSION_RESULTS];
+} AdmissionController;
+
+static AdmissionController *
+admission_controller_new(gdouble join_rate, gint join_burst, gint max_encoder_load, gint egress_limit_kbps)
+{
+  AdmissionController *controller = g_new0(AdmissionController, 1);
+  controller->join_rate = join_rate;
+  controller->join_burst = join_burst;
+  controller->max_encoder_load = max_encoder_load;
+  controller->egress_limit_kbps = egress_limit_kbps;
+  controller->buckets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  return controller;
+}
+
+static void
+admission_bucket_refill(AdmissionController *controller, AdmissionBucket *bucket, gint64 now)
+{
+  bucket->tokens = MIN(bucket->tokens + (now - bucket->updated_us) / (gdouble)G_USEC_PER_SEC * controller->join_rate,
+                       (gdouble)controller->join_burst);
+  bucket->updated_us = now;
+}
+
+// Full buckets are the same as none; drop them so the table doesn't grow with every IP ever seen.
+static void
+admission_forget_full_buckets(AdmissionController *controller, gint64 now)
+{
+  GHashTableIter iter;
+  gpointer value;
+
+  g_hash_table_iter_init(&iter, controller->buckets);
+  while (g_hash_table_iter_next(&iter, NULL, &value))
+  {
+    AdmissionBucket *bucket = (AdmissionBucket *)value;
+    admission_bucket_refill(controller, bucket, now);
+    if (bucket->tokens >= controller->join_burst)
+      g_hash_table_iter_remove(&iter);
+  }
+}
+
+// Takes a token from ip's bucket. Returns 0, or the seconds until one is available.
+static gint
+admission_take_token(AdmissionController *controller, const gchar *ip, gint64 now)
+{
+  AdmissionBucket *bucket = (AdmissionBucket *)g_hash_table_lookup(controller->buckets, ip);
+  if (bucket == NULL)
+  {
+    bucket = g_new0(AdmissionBucket, 1);
+    bucket->tokens = controller->join_burst;
+    bucket->updated_us = now;
+    g_hash_table_insert(controller->buckets, g_strdup(ip), bucket);
+  }
+
+  if (bucket->tokens < 1.0)
+    return MAX((gint)ceil((1.0 - bucket->tokens) / controller->join_rate), 1);
+  bucket->tokens -= 1.0;
+  return 0;
+}
+
+// Decides on a new viewer from ip. Capacity is checked before the bucket, so a client turned
+// away for lack of room keeps its tokens. On rejection *retry_after is set in seconds.
+static AdmissionResult
+admission_check(AdmissionController *controller, const gchar *ip, const AdmissionLoad *load, gint *retry_after)
+{
+  gint64 now = g_get_monotonic_time();
+  AdmissionResult result = ADMISSION_OK;
+
+  admission_forget_full_buckets(controller, now);
+  *retry_after = ADMISSION_RETRY_SECONDS;
+
+  if (load->viewers >= load->max_viewers)
+    result = ADMISSION_NO_SLOT;
+  else if (controller->max_encoder_load > 0 && load->encoder_load * 100.0 > controller->max_encoder_load)
+    result = ADMISSION_ENCODER_LOAD;
+  else if (controller->egress_limit_kbps > 0 && load->egress_kbps + load->viewer_kbps > controller->egress_limit_kbps)
+    result = ADMISSION_EGRESS;
+  else if ((*retry_after = admission_take_token(controller, ip, now)) > 0)
+    result = ADMISSION_RATE_LIMITED;
+
+  if (result == ADMISSION_OK)
+    controller->admitted++;
+  else
+    controller->rejected[result]++;
+  return result;
+}
+
+// Human-readable for the status message; the reason string is for clients to act on.
+static gchar *
+admission_describe(AdmissionResult result, const AdmissionLoad *load, gint egress_limit_kbps)
+{
+  switch (result)
+  {
+  case ADMISSION_RATE_LIMITED:
+    return g_strdup("Too many connection attempts. Please try again later.");
+  case ADMISSION_NO_SLOT:
+    return g_strdup_printf("Server busy: %d/%d viewers, limited by %s (%s). Please try again later.", load->viewers,
+                           load->max_viewers, load->limit_reason, load->limit_detail);
+  case ADMISSION_ENCODER_LOAD:
+    return g_strdup_printf("Server busy: encoder keeps up with only %.0f%% of its frame rate. Please try again later.",
+                           100.0 / load->encoder_load);
+  case ADMISSION_EGRESS:
+    return g_strdup_printf("Server busy: sending %d of %d kbps, a viewer needs %d. Please try again later.",
+                           load->egress_kbps, egress_limit_kbps, load->viewer_kbps);
+  default:
+    return g_strdup("Accepted");
+  }
+}
+
+static void
+admission_add_member(JsonBuilder *builder, AdmissionController *controller)
+{
+  json_builder_set_member_name(builder, "admission");
+  json_builder_begin_object(builder);
+  json_builder_set_member_name(builder, "admitted");
+  json_builder_add_int_value(builder, controller->admitted);
+  json_builder_set_member_name(builder, "rejected");
+  json_builder_begin_object(builder);
+  for (guint i = ADMISSION_OK + 1; i < ADMISSION_RESULTS; i++)
+  {
+    json_builder_set_member_name(builder, admission_reasons[i]);
+    json_builder_add_int_value(builder, controller->rejected[i]);
+  }
+  json_builder_end_object(builder);
+  json_builder_set_member_name(builder, "tracked_ips");
+  json_builder_add_int_value(builder, g_hash_table_size(controller->buckets));
+  json_builder_end_object(builder);
+}
+
+#endif // ADMISSION_H
@@ -0,0 +1,361 @@
+#ifndef BANDWIDTH_ESTIMATOR_H
+#define BANDWIDTH_ESTIMATOR_H
+
+#include <glib.h>
+#include <gst/gst.h>
+
+#ifndef GST_USE_UNSTABLE_API
+#define GST_USE_UNSTABLE_API
+#endif
+#include <gst/webrtc/webrtc.h>
+
+#include <vector>
+#include <math.h>
+#include <string.h>
+
+// Send-side bandwidth estimation for the shared encoder.
+//
+// Every viewer keeps a loss/RTT based estimate fed from its webrtcbin "get-stats"
+// (remote-inbound-rtp: fraction-lost, round-trip-time; outbound-rtp: bytes-sent, video streams
+// only) and, when transport-wide-cc is negotiated, from rtpsession's twcc-stats. A growing queue
+// shows as RTT above the lowest of the last BWE_MIN_RTT_WINDOW reports, so a route change to a
+// longer path is taken as the new baseline once the window has passed. The AbrController folds the
+// viewer estimates into one encoder bitrate (min-of-viewers or weighted) and only moves the
+// encoder when the change is large enough: decreases apply at once, increases wait until the
+// link has been clean for a while.
+
+#define BWE_INCREASE_FACTOR 1.08      // per report with < BWE_LOSS_LOW loss
+#define BWE_LOSS_LOW 0.02             // below: probe upwards
+#define BWE_LOSS_HIGH 0.10            // above: back off proportionally to loss
+#define BWE_RTT_QUEUE_MS 100.0        // RTT above the viewer's minimum that means a queue is building
+#define BWE_RTT_BACKOFF 0.85
+#define BWE_MIN_RTT_WINDOW 30         // reports (seconds) the baseline RTT is the minimum of
+#define ABR_HYSTERESIS 0.10           // ignore target changes smaller than 10 %
+#define ABR_INCREASE_HOLD_US (3 * G_USEC_PER_SEC) // no increase within 3 s of a decrease
+
+typedef enum
+{
+  ABR_POLICY_OFF = 0,  // fixed --bitrate, as before
+  ABR_POLICY_MIN,      // follow the weakest viewer
+  ABR_POLICY_WEIGHTED  // harmonic mean: weak viewers pull harder, one bad link cannot floor everyone
+} AbrPolicy;
+
+typedef struct
+{
+  gdouble estimate_kbps;
+  gdouble fraction_lost; // 0..1 from the last receiver report
+  gdouble rtt_ms;
+  gdouble min_rtt_ms;    // over the last BWE_MIN_RTT_WINDOW reports with an RTT
+  gdouble rtt_window[BWE_MIN_RTT_WINDOW];
+  guint rtt_samples;
+  gdouble send_kbps;     // measured from outbound-rtp bytes-sent
+  gdouble twcc_recv_kbps; // 0 if transport-wide-cc is not negotiated
+  gdouble twcc_loss_pct;
+  guint64 last_bytes_sent;
+  gint64 last_stats_us;
+  gboolean has_report;   // a receiver report has arrived, estimate is meaningful
+} ViewerBwe;
+
+typedef struct
+{
+  AbrPolicy policy;
+  gint min_kbps;
+  gint ceiling_kbps;   // --bitrate, or the last live /control change; never exceeded
+  gint current_kbps;   // what the encoder is set to
+  gint64 last_decrease_us;
+} AbrController;
+
+static gboolean
+abr_policy_from_string(const gchar *name, AbrPolicy *policy)
+{
+  if (name == NULL || g_ascii_strcasecmp(name, "min") == 0)
+    *policy = ABR_POLICY_MIN;
+  else if (g_ascii_strcasecmp(name, "weighted") == 0)
+    *policy = ABR_POLICY_WEIGHTED;
+  else if (g_ascii_strcasecmp(name, "off") == 0)
+    *policy = ABR_POLICY_OFF;
+  else
+    return FALSE;
+  return TRUE;
+}
+
+static void
+viewer_bwe_init(ViewerBwe *bwe, gint start_kbps)
+{
+  memset(bwe, 0, sizeof(ViewerBwe));
+  bwe->estimate_kbps = start_kbps;
+}
+
+// Adds one RTT sample to the window and takes the minimum over it.
+static void
+viewer_bwe_add_rtt(ViewerBwe *bwe, gdouble rtt_ms)
+{
+  bwe->rtt_window[bwe->rtt_samples++ % BWE_MIN_RTT_WINDOW] = rtt_ms;
+  guint count = MIN(bwe->rtt_samples, (guint)BWE_MIN_RTT_WINDOW);
+  bwe->min_rtt_ms = bwe->rtt_window[0];
+  for (guint i = 1; i < count; i++)
+    bwe->min_rtt_ms = MIN(bwe->min_rtt_ms, bwe->rtt_window[i]);
+}
+
+typedef struct
+{
+  const GstStructure *stats; // the whole reply, to look up codecs
+  gboolean found_remote;
+  gdouble fraction_lost;
+  gdouble rtt_s;
+  guint64 bytes_sent;
+} BweStatsScan;
+
+// Whether an RTP stream's stats are about video: by its kind where webrtcbin reports one, else by
+// the mime type of its codec. A stream that tells neither counts, as with video only.
+static gboolean
+bwe_stat_is_video(const GstStructure *stats, const GstStructure *stat)
+{
+  const gchar *kind = gst_structure_get_string(stat, "kind");
+  if (kind != NULL)
+    return g_strcmp0(kind, "video") == 0;
+
+  const gchar *codec_id = gst_structure_get_string(stat, "codec-id");
+  GstStructure *codec = NULL;
+  if (codec_id == NULL || !gst_structure_get(stats, codec_id, GST_TYPE_STRUCTURE, &codec, NULL))
+    return TRUE;
+
+  const gchar *mime_type = gst_structure_get_string(codec, "mime-type");
+  gboolean video = mime_type == NULL || g_str_has_prefix(mime_type, "video/");
+  gst_structure_free(codec);
+  return video;
+}
+
+static gboolean
+bwe_scan_stats_field(G_GNUC_UNUSED GQuark field_id, const GValue *value, gpointer user_data)
+{
+  BweStatsScan *scan = (BweStatsScan *)user_data;
+  GstWebRTCStatsType type;
+
+  if (!GST_VALUE_HOLDS_STRUCTURE(value))
+    return TRUE;
+
+  const GstStructure *stat = gst_value_get_structure(value);
+  if (!gst_structure_get(stat, "type", GST_TYPE_WEBRTC_STATS_TYPE, &type, NULL))
+    return TRUE;
+
+  // Only video matters for the encoder; audio shares the transport but not the budget.
+  if ((type == GST_WEBRTC_STATS_REMOTE_INBOUND_RTP || type == GST_WEBRTC_STATS_OUTBOUND_RTP) &&
+      !bwe_stat_is_video(scan->stats, stat))
+    return TRUE;
+
+  if (type == GST_WEBRTC_STATS_REMOTE_INBOUND_RTP)
+  {
+    gdouble fraction_lost = 0, rtt = 0;
+    gst_structure_get_double(stat, "fraction-lost", &fraction_lost);
+    gst_structure_get_double(stat, "round-trip-time", &rtt);
+    scan->fraction_lost = MAX(scan->fraction_lost, fraction_lost);
+    scan->rtt_s = MAX(scan->rtt_s, rtt);
+    scan->found_remote = TRUE;
+  }
+  else if (type == GST_WEBRTC_STATS_OUTBOUND_RTP)
+  {
+    guint64 bytes = 0;
+    gst_structure_get_uint64(stat, "bytes-sent", &bytes);
+    scan->bytes_sent += bytes;
+  }
+  return TRUE;
+}
+
+// TWCC loss is per packet and more current than the RR's fraction-lost; prefer it when present.
+static gdouble
+viewer_bwe_loss(const ViewerBwe *bwe)
+{
+  return bwe->twcc_recv_kbps > 0 ? bwe->twcc_loss_pct / 100.0 : bwe->fraction_lost;
+}
+
+// Feeds one get-stats reply (and optional twcc-stats) into the viewer's estimate.
+static void
+viewer_bwe_update(ViewerBwe *bwe, const GstStructure *stats, const GstStructure *twcc_stats,
+                  gint min_kbps, gint max_kbps)
+{
+  BweStatsScan scan = {};
+  gint64 now = g_get_monotonic_time();
+
+  scan.stats = stats;
+  gst_structure_foreach(stats, bwe_scan_stats_field, &scan);
+
+  if (bwe->last_stats_us > 0 && scan.bytes_sent >= bwe->last_bytes_sent)
+  {
+    gdouble seconds = (now - bwe->last_stats_us) / (gdouble)G_USEC_PER_SEC;
+    if (seconds > 0)
+      bwe->send_kbps = (scan.bytes_sent - bwe->last_bytes_sent) * 8 / 1000.0 / seconds;
+  }
+  bwe->last_bytes_sent = scan.bytes_sent;
+  bwe->last_stats_us = now;
+
+  if (twcc_stats != NULL)
+  {
+    guint bitrate_recv = 0;
+    gdouble loss_pct = 0;
+    if (gst_structure_get_uint(twcc_stats, "bitrate-recv", &bitrate_recv))
+      bwe->twcc_recv_kbps = bitrate_recv / 1000.0;
+    if (gst_structure_get_double(twcc_stats, "packet-loss-pct", &loss_pct))
+      bwe->twcc_loss_pct = loss_pct;
+  }
+
+  if (!scan.found_remote)
+    return; // no receiver report yet, keep the start value
+
+  bwe->has_report = TRUE;
+  bwe->fraction_lost = scan.fraction_lost;
+  bwe->rtt_ms = scan.rtt_s * 1000.0;
+  if (bwe->rtt_ms > 0)
+    viewer_bwe_add_rtt(bwe, bwe->rtt_ms);
+
+  gdouble loss = viewer_bwe_loss(bwe);
+  gdouble estimate = bwe->estimate_kbps;
+
+  if (loss > BWE_LOSS_HIGH)
+  {
+    estimate *= (1.0 - 0.5 * loss);
+  }
+  else if (bwe->rtt_samples > 0 && bwe->rtt_ms > bwe->min_rtt_ms + BWE_RTT_QUEUE_MS)
+  {
+    // Delay growing without loss yet: a bottleneck queue is filling, get out before it drops.
+    estimate *= BWE_RTT_BACKOFF;
+  }
+  else if (loss < BWE_LOSS_LOW)
+  {
+    estimate *= BWE_INCREASE_FACTOR;
+    // Don't run away from what the link demonstrably delivers.
+    if (bwe->twcc_recv_kbps > 0)
+      estimate = MIN(estimate, bwe->twcc_recv_kbps * 1.5);
+    else if (bwe->send_kbps > 0)
+      estimate = MIN(estimate, MAX(bwe->send_kbps, (gdouble)min_kbps) * 1.5);
+  }
+
+  bwe->estimate_kbps = CLAMP(estimate, (gdouble)min_kbps, (gdouble)max_kbps);
+}
+
+// Returns the bitrate the encoder should move to, or -1 to leave it where it is.
+static gint
+abr_controller_decide(AbrController *abr, const std::vector<gdouble> &estimates, gint max_kbps)
+{
+  if (abr->policy == ABR_POLICY_OFF)
+    return -1;
+
+  // --bitrate was changed live: the encoder is already there, continue from it.
+  if (abr->ceiling_kbps != max_kbps)
+  {
+    abr->ceiling_kbps = max_kbps;
+    abr->current_kbps = max_kbps;
+    return -1;
+  }
+
+  // No feedback (no viewers, or none has reported yet): go back to the configured bitrate.
+  gdouble target = max_kbps;
+  if (!estimates.empty() && abr->policy == ABR_POLICY_MIN)
+  {
+    target = G_MAXDOUBLE;
+    for (gdouble estimate : estimates)
+      target = MIN(target, estimate);
+  }
+  else if (!estimates.empty())
+  {
+    gdouble inverse_sum = 0;
+    for (gdouble estimate : estimates)
+      inverse_sum += 1.0 / MAX(estimate, 1.0);
+    target = estimates.size() / inverse_sum;
+  }
+
+  gint target_kbps = CLAMP((gint)target, abr->min_kbps, max_kbps);
+  gint64 now = g_get_monotonic_time();
+  gdouble change = fabs(target_kbps - abr->current_kbps) / (gdouble)MAX(abr->current_kbps, 1);
+
+  if (change < ABR_HYSTERESIS && target_kbps != max_kbps)
+    return -1;
+  if (target_kbps == abr->current_kbps)
+    return -1;
+
+  if (target_kbps < abr->current_kbps)
+  {
+    abr->last_decrease_us = now;
+  }
+  else if (now - abr->last_decrease_us < ABR_INCREASE_HOLD_US)
+  {
+    return -1;
+  }
+
+  abr->current_kbps = target_kbps;
+  return target_kbps;
+}
+
+// ----------------------------------------------------------------------------------------------
+// Per-viewer quality ladder (simulcast renditions, temporal layers). Step 0 is the best one.
+// A viewer steps down as soon as its estimate can't carry the current step, and up one step
+// after the link has been clean for up_hold_us. Stepping down shortly after a step up doubles
+// the hold, so a viewer at the edge doesn't flap.
+
+#define LADDER_DOWN_RATIO 0.85
+#define LADDER_UP_HOLD_US (5 * G_USEC_PER_SEC)
+#define LADDER_MAX_UP_HOLD_US (60 * G_USEC_PER_SEC)
+
+typedef struct
+{
+  gint64 last_switch_us;
+  gboolean last_switch_up;
+  gint64 clean_since_us;
+  gint64 up_hold_us;
+} ViewerLadder;
+
+static void
+viewer_ladder_init(ViewerLadder *ladder)
+{
+  ladder->last_switch_us = 0;
+  ladder->last_switch_up = FALSE;
+  ladder->clean_since_us = 0;
+  ladder->up_hold_us = LADDER_UP_HOLD_US;
+}
+
+// step_kbps[i] is the bitrate the viewer needs on step i, best first. Returns the step to move
+// to, or current to stay.
+static guint
+viewer_ladder_select(ViewerLadder *ladder, ViewerBwe *bwe, guint current, const gint *step_kbps, guint count)
+{
+  gint64 now = g_get_monotonic_time();
+  gboolean clean = bwe->fraction_lost < BWE_LOSS_LOW && bwe->estimate_kbps >= step_kbps[current];
+
+  if (!clean)
+    ladder->clean_since_us = 0;
+  else if (ladder->clean_since_us == 0)
+    ladder->clean_since_us = now;
+
+  if (bwe->estimate_kbps < step_kbps[current] * LADDER_DOWN_RATIO && current + 1 < count)
+  {
+    guint target = current + 1;
+    while (target + 1 < count && step_kbps[target] > bwe->estimate_kbps)
+      target++;
+
+    // Only an up-switch reversed soon after means the step above doesn't hold; the link getting
+    // worse step by step does not
+    if (ladder->last_switch_up && now - ladder->last_switch_us < 2 * ladder->up_hold_us)
+      ladder->up_hold_us = MIN(ladder->up_hold_us * 2, (gint64)LADDER_MAX_UP_HOLD_US);
+    ladder->last_switch_us = now;
+    ladder->last_switch_up = FALSE;
+    ladder->clean_since_us = 0;
+    return target;
+  }
+
+  if (current > 0 && ladder->clean_since_us != 0 &&
+      now - ladder->clean_since_us >= ladder->up_hold_us &&
+      now - ladder->last_switch_us >= ladder->up_hold_us)
+  {
+    // The estimate is capped by what the viewer receives now; give it the next step's bitrate
+    // to start from, loss on the new step brings it back down.
+    bwe->estimate_kbps = MAX(bwe->estimate_kbps, (gdouble)step_kbps[current - 1]);
+    ladder->last_switch_us = now;
+    ladder->last_switch_up = TRUE;
+    ladder->clean_since_us = 0;
+    return current - 1;
+  }
+
+  return current;
+}
+
+#endif // BANDWIDTH_ESTIMATOR_H
@@ -0,0 +1,670 @@
+#ifndef ENCODER_BACKEND_H
+#define ENCODER_BACKEND_H
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <deque>
+#include <utility>
+
+#include "RtpHeaderExtensions.h"
+
+// Video encoder backends, shared by StreamingProgram.cpp and retran.cpp.
+//
+// Each backend knows its element, parser, payloader and how its bitrate property is scaled,
+// and carries three tuned presets. --codec and --bitrate mean the same thing on the board
+// (omx) and on x86 test machines (x264/x265/openh264/vp8); --encoder picks a specific backend
+// and --preset the tuning. All presets keep B-frames off, WebRTC receivers expect none.
+
+#define VIDEO_ENCODER_NAME "venc"
+#define VIDEO_PAYLOADER_NAME "vpay"
+#define VIDEO_RATE_NAME "vrate"
+#define VIDEO_RTP_MTU 1400        // default RTP packet size, --mtu
+#define VIDEO_RTP_MTU_MIN 576
+#define VIDEO_RTP_MTU_MAX 8960    // jumbo frames
+#define RTP_HEADER_SIZE 12
+#define RTP_TRANSPORT_OVERHEAD 38 // IPv4 20 + UDP 8 + SRTP auth tag 10
+#define ENCODER_MAX_SLICES 32
+
+typedef enum
+{
+  ENCODER_PRESET_ULTRA_LOW_LATENCY = 0,
+  ENCODER_PRESET_BALANCED,
+  ENCODER_PRESET_QUALITY,
+  ENCODER_PRESET_COUNT
+} EncoderPreset;
+
+typedef struct
+{
+  const gchar *name;             // --encoder value
+  const gchar *codec;            // --codec value this backend produces
+  const gchar *factory;          // GStreamer element factory
+  const gchar *parser;           // parser between encoder and payloader, NULL if none
+  const gchar *payloader;        // RTP payloader factory
+  const gchar *encoding_name;    // RTP encoding-name for caps and SDP
+  const gchar *bitrate_property; // property taking the target bitrate
+  guint bitrate_scale;           // property units per kbps (1 = kbps, 1000 = bps)
+  gboolean needs_convert;        // encoder does not take NV12, insert videoconvert
+  const gchar *gop_properties;   // space separated properties taking the keyframe interval in frames
+  const gchar *temporal_layers;  // 3-layer hierarchical-P, layer ids 0,2,1,2 (see TemporalLayers.h);
+                                 // takes the cumulative per-layer bitrates, NULL if unsupported
+  const gchar *slices;           // takes the number of slices per frame, NULL if unsupported
+  gboolean subframe_output;      // pushes each slice as soon as it is encoded (alignment=nal)
+  const gchar *intra_refresh;    // gradual decoder refresh instead of periodic IDRs, takes the direction
+                                 // if the encoder has a choice; NULL if unsupported
+  const gchar *refresh_period_property; // takes the number of frames one refresh cycle spans
+  const gchar *presets[ENCODER_PRESET_COUNT];
+} EncoderBackend;
+
+typedef enum
+{
+  INTRA_REFRESH_OFF = 0,
+  INTRA_REFRESH_VERTICAL,   // a column of intra blocks sweeps left to right
+  INTRA_REFRESH_HORIZONTAL, // a row of intra blocks sweeps top to bottom
+  INTRA_REFRESH_COUNT
+} IntraRefreshMode;
+
+// Stream-wide encoder settings from the command line, on top of backend, preset and bitrate.
+typedef struct
+{
+  gint gop_frames;                // periodic keyframe interval
+  gboolean temporal_layers;       // hierarchical-P, see TemporalLayers.h
+  gint slices;                    // slices per frame, 1 = whole frames
+  IntraRefreshMode intra_refresh; // spread the refresh over refresh_frames instead of one IDR
+  gint refresh_frames;            // length of one refresh cycle
+  gint rtp_mtu;                   // largest RTP packet the payloader builds
+} EncoderOptions;
+
+static const gchar *encoder_preset_names[ENCODER_PRESET_COUNT] = {"ultra-low-latency", "balanced", "quality"};
+static const gchar *intra_refresh_names[INTRA_REFRESH_COUNT] = {"off", "vertical", "horizontal"};
+
+// Registry order is the "auto" preference order: hardware first, then software fallbacks.
+static const EncoderBackend encoder_backends[] = {
+    {"omx", "h264", "omxh264enc", "h264parse", "rtph264pay", "H264", "target-bitrate", 1, FALSE, "periodicity-idr gop-length", NULL,
+     "num-slices=%d", TRUE, "gop-mode=low-delay-p gdr-mode=%s", "gop-length",
+     {
+         // ultra-low-latency: the original board settings
+         "control-rate=constant qp-mode=auto prefetch-buffer=true "
+         "cpb-size=200 initial-delay=200 "
+         "filler-data=false",
+         // balanced
+         "control-rate=constant qp-mode=auto prefetch-buffer=true "
+         "cpb-size=500 initial-delay=250 b-frames=0 "
+         "filler-data=false",
+         // quality
+         "control-rate=variable qp-mode=auto prefetch-buffer=true "
+         "cpb-size=1000 initial-delay=500 b-frames=0 "
+         "filler-data=false",
+     }},
+    {"omx", "h265", "omxh265enc", "h265parse", "rtph265pay", "H265", "target-bitrate", 1, FALSE, "periodicity-idr gop-length", NULL,
+     "num-slices=%d", TRUE, "gop-mode=low-delay-p gdr-mode=%s", "gop-length",
+     {
+         "control-rate=constant qp-mode=auto prefetch-buffer=true "
+         "cpb-size=200 initial-delay=200 "
+         "filler-data=false",
+         "control-rate=constant qp-mode=auto prefetch-buffer=true "
+         "cpb-size=500 initial-delay=250 b-frames=0 "
+         "filler-data=false",
+         "control-rate=variable qp-mode=auto prefetch-buffer=true "
+         "cpb-size=1000 initial-delay=500 b-frames=0 "
+         "filler-data=false",
+     }},
+    {"x264", "h264", "x264enc", "h264parse", "rtph264pay", "H264", "bitrate", 1, FALSE, "key-int-max", NULL,
+     "option-string=\"slices=%d\"", FALSE, "intra-refresh=true", "key-int-max", // columns only
+     {
+         "tune=zerolatency speed-preset=ultrafast sliced-threads=true rc-lookahead=0 "
+         "bframes=0 vbv-buf-capacity=200",
+         "tune=zerolatency speed-preset=veryfast "
+         "bframes=0 vbv-buf-capacity=500",
+         "speed-preset=medium rc-lookahead=10 "
+         "bframes=0 vbv-buf-capacity=1000",
+     }},
+    {"openh264", "h264", "openh264enc", "h264parse", "rtph264pay", "H264", "bitrate", 1000, TRUE, "gop-size", NULL,
+     "slice-mode=n-slices num-slices=%d", FALSE, NULL, NULL,
+     {
+         "usage-type=camera rate-control=bitrate complexity=low enable-frame-skip=true",
+         "usage-type=camera rate-control=bitrate complexity=medium enable-frame-skip=true",
+         "usage-type=camera rate-control=bitrate complexity=high enable-frame-skip=false",
+     }},
+    {"x265", "h265", "x265enc", "h265parse", "rtph265pay", "H265", "bitrate", 1, TRUE, "key-int-max", NULL,
+     NULL, FALSE, NULL, NULL, // option-string is taken by the quality preset
+     {
+         "tune=zerolatency speed-preset=ultrafast",
+         "tune=zerolatency speed-preset=veryfast",
+         "speed-preset=medium option-string=\"bframes=0:rc-lookahead=10\"",
+     }},
+    {"vp8", "vp8", "vp8enc", NULL, "rtpvp8pay", "VP8", "target-bitrate", 1000, TRUE, "keyframe-max-dist",
+     // TL0 references and updates only LAST, TL1 references LAST and updates GOLDEN, TL2 updates
+     // nothing, so dropping TL1/TL2 never takes away a reference a lower layer uses. Error
+     // resilience keeps the entropy context from depending on the dropped frames.
+     "temporal-scalability-number-layers=3 temporal-scalability-periodicity=4 "
+     "temporal-scalability-layer-id=\"<0,2,1,2>\" temporal-scalability-rate-decimator=\"<4,2,1>\" "
+     "temporal-scalability-layer-flags=\"<no-ref-golden+no-ref-alt+no-upd-golden+no-upd-alt,"
+     "no-ref-golden+no-ref-alt+no-upd-last+no-upd-golden+no-upd-alt+no-upd-entropy,"
+     "no-ref-golden+no-ref-alt+no-upd-last+no-upd-alt+no-upd-entropy,"
+     "no-ref-alt+no-upd-last+no-upd-golden+no-upd-alt+no-upd-entropy>\" "
+     "temporal-scalability-layer-sync-flags=\"<false,true,true,false>\" error-resilient=default "
+     "temporal-scalability-target-bitrate=\"<%u,%u,%u>\"",
+     NULL, FALSE, NULL, NULL,
+     {
+         "deadline=1 cpu-used=16 end-usage=cbr lag-in-frames=0 "
+         "buffer-size=200 buffer-initial-size=100 buffer-optimal-size=150 threads=4",
+         "deadline=1 cpu-used=8 end-usage=cbr lag-in-frames=0 "
+         "buffer-size=500 buffer-initial-size=250 buffer-optimal-size=400 threads=4",
+         "deadline=33000 cpu-used=4 end-usage=vbr lag-in-frames=0 threads=4",
+     }},
+};
+
+static gboolean
+encoder_preset_from_string(const gchar *name, EncoderPreset *preset)
+{
+  if (name == NULL || name[0] == '\0')
+  {
+    *preset = ENCODER_PRESET_ULTRA_LOW_LATENCY;
+    return TRUE;
+  }
+
+  for (guint i = 0; i < ENCODER_PRESET_COUNT; i++)
+  {
+    if (g_ascii_strcasecmp(name, encoder_preset_names[i]) == 0)
+    {
+      *preset = (EncoderPreset)i;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+static gboolean
+intra_refresh_from_string(const gchar *name, IntraRefreshMode *mode)
+{
+  if (name == NULL || name[0] == '\0')
+  {
+    *mode = INTRA_REFRESH_OFF;
+    return TRUE;
+  }
+
+  for (guint i = 0; i < INTRA_REFRESH_COUNT; i++)
+  {
+    if (g_ascii_strcasecmp(name, intra_refresh_names[i]) == 0)
+    {
+      *mode = (IntraRefreshMode)i;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+static gboolean
+encoder_backend_available(const EncoderBackend *backend)
+{
+  GstElementFactory *factory = gst_element_factory_find(backend->factory);
+  if (factory == NULL)
+    return FALSE;
+  gst_object_unref(factory);
+
+  GstElementFactory *payloader = gst_element_factory_find(backend->payloader);
+  if (payloader == NULL)
+    return FALSE;
+  gst_object_unref(payloader);
+
+  return TRUE;
+}
+
+// Picks the backend for codec (NULL = h264). encoder is a backend name or NULL/"auto" for the
+// first available one in registry order. Returns NULL if nothing usable is installed.
+static const EncoderBackend *
+select_encoder_backend(const gchar *codec, const gchar *encoder)
+{
+  const gchar *wanted_codec = codec ? codec : "h264";
+  gboolean any = (encoder == NULL || g_ascii_strcasecmp(encoder, "auto") == 0);
+
+  for (guint i = 0; i < G_N_ELEMENTS(encoder_backends); i++)
+  {
+    const EncoderBackend *backend = &encoder_backends[i];
+
+    if (g_ascii_strcasecmp(backend->codec, wanted_codec) != 0)
+      continue;
+    if (!any && g_ascii_strcasecmp(backend->name, encoder) != 0)
+      continue;
+
+    if (encoder_backend_available(backend))
+      return backend;
+
+    g_print("⚠ Encoder backend %s (%s) not found in GStreamer registry\n", backend->name, backend->factory);
+  }
+  return NULL;
+}
+
+static void
+print_encoder_backends()
+{
+  g_print("Encoder backends:\n");
+  for (guint i = 0; i < G_N_ELEMENTS(encoder_backends); i++)
+  {
+    const EncoderBackend *backend = &encoder_backends[i];
+    g_print("  %s %-9s codec=%-4s element=%-12s %s\n",
+            encoder_backend_available(backend) ? "✓" : "✗",
+            backend->name, backend->codec, backend->factory,
+            encoder_backend_available(backend) ? "available" : "not installed");
+  }
+  g_print("Presets: ");
+  for (guint i = 0; i < ENCODER_PRESET_COUNT; i++)
+    g_print("%s%s", encoder_preset_names[i], i + 1 < ENCODER_PRESET_COUNT ? ", " : "\n");
+}
+
+// Builds "encoder ! parser" producing the encoded elementary stream. options->gop_frames is the
+// periodic keyframe interval; on-demand keyframes come from KeyframeControl.h. The parser repeats
+// the parameter sets in front of every IDR, so a viewer that starts (or switches renditions) at
+// any forced IDR can decode it.
+//
+// With intra refresh the encoder refreshes a sweeping column or row of blocks each frame, one
+// full refresh per options->refresh_frames, so there is no whole-frame intra burst to overflow
+// the CPB. x264 then sends no periodic IDRs at all (key-int-max becomes the refresh period), omx
+// keeps the --gop IDR. Viewers joining or asking with PLI/FIR still get a forced IDR.
+//
+// With several slices on an encoder with sub-frame output, encoder and parser are pinned to
+// alignment=nal: each slice goes to the payloader as soon as it is encoded instead of waiting for
+// the whole frame. Free with g_free().
+static gchar *
+build_encoder_string(const EncoderBackend *backend, EncoderPreset preset, int bitrate_kbps,
+                     const EncoderOptions *options, const gchar *encoder_name)
+{
+  GString *gop = g_string_new(NULL);
+  gchar **gop_properties = g_strsplit(backend->gop_properties, " ", -1);
+  gboolean refresh = options->intra_refresh != INTRA_REFRESH_OFF && backend->intra_refresh != NULL;
+  for (gchar **property = gop_properties; *property != NULL; property++)
+    g_string_append_printf(gop, "%s=%d ", *property,
+                           refresh && g_strcmp0(*property, backend->refresh_period_property) == 0
+                               ? options->refresh_frames
+                               : options->gop_frames);
+  g_strfreev(gop_properties);
+
+  if (refresh)
+  {
+    g_string_append_printf(gop, backend->intra_refresh, intra_refresh_names[options->intra_refresh]);
+    g_string_append_c(gop, ' ');
+  }
+
+  // Base layer 15 fps at 40 % of the bitrate, +30 fps at 60 %, all 60 fps at 100 %
+  if (options->temporal_layers && backend->temporal_layers != NULL)
+  {
+    guint bps = (guint)bitrate_kbps * 1000;
+    g_string_append_printf(gop, backend->temporal_layers, bps * 2 / 5, bps * 3 / 5, bps);
+    g_string_append_c(gop, ' ');
+  }
+
+  if (backend->slices != NULL)
+  {
+    g_string_append_printf(gop, backend->slices, options->slices);
+    g_string_append_c(gop, ' ');
+  }
+
+  gchar *nal_caps = options->slices > 1 && backend->subframe_output
+                        ? g_strdup_printf(" ! video/x-%s,alignment=nal", backend->codec)
+                        : g_strdup("");
+  gchar *parser = backend->parser ? g_strdup_printf("%s ! %s config-interval=-1%s", nal_caps, backend->parser, nal_caps)
+                                  : g_strdup("");
+  gchar *encoder = g_strdup_printf("%s%s name=%s %s=%u %s%s%s",
+                                   backend->needs_convert ? "videoconvert ! " : "",
+                                   backend->factory, encoder_name, backend->bitrate_property,
+                                   (guint)bitrate_kbps * backend->bitrate_scale,
+                                   gop->str, backend->presets[preset], parser);
+  g_free(parser);
+  g_free(nal_caps);
+  g_string_free(gop, TRUE);
+  return encoder;
+}
+
+// The video RTP caps, with the header extensions to negotiate. Free with g_free().
+static gchar *
+build_video_rtp_caps_string(const EncoderBackend *backend)
+{
+  return g_strdup_printf("application/x-rtp,media=video,encoding-name=%s,payload=96" RTP_HDREXT_CAPS_FIELDS,
+                         backend->encoding_name);
+}
+
+// Builds "payloader ! rtp caps". Free with g_free().
+static gchar *
+build_payloader_string(const EncoderBackend *backend, const gchar *payloader_name, gint rtp_mtu)
+{
+  gchar *caps = build_video_rtp_caps_string(backend);
+  gchar *payloader = g_strdup_printf("%s name=%s mtu=%d ! %s", backend->payloader, payloader_name, rtp_mtu, caps);
+  g_free(caps);
+  return payloader;
+}
+
+// Bytes every video packet carries besides the payload: IP, UDP and SRTP tag, RTP header and the
+// payload format header of a fragment (H.264 FU-A, H.265 FU, VP8 descriptor with picture ID).
+static guint
+rtp_packet_overhead(const EncoderBackend *backend)
+{
+  guint payload_header = 2;
+  if (g_ascii_strcasecmp(backend->encoding_name, "H265") == 0)
+    payload_header = 3;
+  else if (g_ascii_strcasecmp(backend->encoding_name, "VP8") == 0)
+    payload_header = 4;
+  return RTP_TRANSPORT_OVERHEAD + RTP_HEADER_SIZE + payload_header;
+}
+
+// Builds "encoder ! parser ! payloader ! rtp caps" for the video branch. Free with g_free().
+static gchar *
+build_encoding_string(const EncoderBackend *backend, EncoderPreset preset, int bitrate_kbps,
+                      const EncoderOptions *options)
+{
+  gchar *encoder = build_encoder_string(backend, preset, bitrate_kbps, options, VIDEO_ENCODER_NAME);
+  gchar *payloader = build_payloader_string(backend, VIDEO_PAYLOADER_NAME, options->rtp_mtu);
+  gchar *encoding = g_strdup_printf("%s ! %s", encoder, payloader);
+  g_free(encoder);
+  g_free(payloader);
+  return encoding;
+}
+
+// Changes the target bitrate of the running encoder. Returns FALSE if the backend's bitrate
+// property cannot be changed in PLAYING.
+static gboolean
+set_encoder_bitrate(GstElement *pipeline, const EncoderBackend *backend, int bitrate_kbps)
+{
+  GstElement *encoder = gst_bin_get_by_name(GST_BIN(pipeline), VIDEO_ENCODER_NAME);
+  if (encoder == NULL)
+    return FALSE;
+
+  GParamSpec *pspec = g_object_class_find_property(G_OBJECT_GET_CLASS(encoder), backend->bitrate_property);
+  if (pspec == NULL || !(pspec->flags & GST_PARAM_MUTABLE_PLAYING))
+  {
+    g_print("⚠ %s.%s cannot be changed while playing\n", backend->factory, backend->bitrate_property);
+    gst_object_unref(encoder);
+    return FALSE;
+  }
+
+  g_object_set(encoder, backend->bitrate_property, (guint)bitrate_kbps * backend->bitrate_scale, NULL);
+  gst_object_unref(encoder);
+  return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+// Latency between two elements: time from a raw frame entering the first to the first buffer
+// with the same PTS leaving the second. Printed every ENCODE_LATENCY_REPORT_SECONDS so backends
+// and presets can be compared on the same source. Used for capture to first RTP packet, from the
+// captured frame reaching videorate to the payloader sending the first packet of it; with
+// sub-frame slice output that is when the first slice is out, not the whole frame. Encode
+// latency alone is part of the encoder telemetry (EncoderTelemetry.h).
+
+#define ENCODE_LATENCY_REPORT_SECONDS 10
+#define ENCODE_LATENCY_MAX_PENDING 128
+
+typedef struct
+{
+  GMutex lock;
+  std::deque<std::pair<GstClockTime, gint64>> *pending; // (PTS, monotonic us at encoder input)
+  gint64 sum_us;
+  gint64 max_us;
+  guint64 frames;
+  gint64 last_report_us;
+  const gchar *title;
+  gchar *label;
+  GstPad *sink_pad;     // where frames are timed in, main loop only
+  gulong sink_probe_id;
+} EncodeLatencyProbe;
+
+static GstPadProbeReturn
+encode_latency_sink_probe_cb(G_GNUC_UNUSED GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  EncodeLatencyProbe *probe = (EncodeLatencyProbe *)user_data;
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+  if (!GST_BUFFER_PTS_IS_VALID(buffer))
+    return GST_PAD_PROBE_OK;
+
+  g_mutex_lock(&probe->lock);
+  probe->pending->emplace_back(GST_BUFFER_PTS(buffer), g_get_monotonic_time());
+  // Frames the encoder skips never come out; don't let them pile up.
+  while (probe->pending->size() > ENCODE_LATENCY_MAX_PENDING)
+    probe->pending->pop_front();
+  g_mutex_unlock(&probe->lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+encode_latency_src_probe_cb(G_GNUC_UNUSED GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  EncodeLatencyProbe *probe = (EncodeLatencyProbe *)user_data;
+  gint64 now = g_get_monotonic_time();
+
+  // Payloaders push the fragments of a large NAL as one buffer list
+  GstBuffer *buffer = (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+                          ? gst_buffer_list_get(GST_PAD_PROBE_INFO_BUFFER_LIST(info), 0)
+                          : GST_PAD_PROBE_INFO_BUFFER(info);
+  if (buffer == NULL || !GST_BUFFER_PTS_IS_VALID(buffer))
+    return GST_PAD_PROBE_OK;
+
+  g_mutex_lock(&probe->lock);
+  while (!probe->pending->empty() && probe->pending->front().first <= GST_BUFFER_PTS(buffer))
+  {
+    std::pair<GstClockTime, gint64> entry = probe->pending->front();
+    probe->pending->pop_front();
+
+    if (entry.first == GST_BUFFER_PTS(buffer))
+    {
+      gint64 latency = now - entry.second;
+      probe->sum_us += latency;
+      probe->max_us = MAX(probe->max_us, latency);
+      probe->frames++;
+    }
+  }
+
+  if (now - probe->last_report_us >= ENCODE_LATENCY_REPORT_SECONDS * G_USEC_PER_SEC && probe->frames > 0)
+  {
+    g_print("⏱ %s [%s]: avg %.2f ms, max %.2f ms over %" G_GUINT64_FORMAT " frames\n",
+            probe->title, probe->label, probe->sum_us / 1000.0 / probe->frames, probe->max_us / 1000.0, probe->frames);
+    probe->sum_us = 0;
+    probe->max_us = 0;
+    probe->frames = 0;
+    probe->last_report_us = now;
+  }
+  g_mutex_unlock(&probe->lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+// Moves the input side to from_element, e.g. the videorate a live profile switch built. The output
+// side stays where it is. Main loop only.
+static void
+encode_latency_probe_retarget(EncodeLatencyProbe *probe, GstElement *from_element)
+{
+  if (probe->sink_pad != NULL)
+  {
+    gst_pad_remove_probe(probe->sink_pad, probe->sink_probe_id);
+    gst_object_unref(probe->sink_pad);
+  }
+  g_mutex_lock(&probe->lock);
+  probe->pending->clear();
+  g_mutex_unlock(&probe->lock);
+
+  probe->sink_pad = gst_element_get_static_pad(from_element, "sink");
+  probe->sink_probe_id = gst_pad_add_probe(probe->sink_pad, GST_PAD_PROBE_TYPE_BUFFER, encode_latency_sink_probe_cb,
+                                           probe, NULL);
+}
+
+// Measures from the sink pad of the element named from to the src pad of the element named to.
+// The probe lives as long as the pipeline, which lives until exit. Takes label. NULL if either
+// element is missing.
+static EncodeLatencyProbe *
+attach_latency_probe(GstElement *pipeline, const gchar *from, const gchar *to, const gchar *title, gchar *label)
+{
+  GstElement *from_element = gst_bin_get_by_name(GST_BIN(pipeline), from);
+  GstElement *to_element = gst_bin_get_by_name(GST_BIN(pipeline), to);
+  if (from_element == NULL || to_element == NULL)
+  {
+    g_print("⚠ %s not measured, %s not found\n", title, from_element == NULL ? from : to);
+    if (from_element)
+      gst_object_unref(from_element);
+    if (to_element)
+      gst_object_unref(to_element);
+    g_free(label);
+    return NULL;
+  }
+
+  EncodeLatencyProbe *probe = g_new0(EncodeLatencyProbe, 1);
+  g_mutex_init(&probe->lock);
+  probe->pending = new std::deque<std::pair<GstClockTime, gint64>>();
+  probe->last_report_us = g_get_monotonic_time();
+  probe->title = title;
+  probe->label = label;
+
+  encode_latency_probe_retarget(probe, from_element);
+  GstPad *src_pad = gst_element_get_static_pad(to_element, "src");
+  gst_pad_add_probe(src_pad, (GstPadProbeType)(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                    encode_latency_src_probe_cb, probe, NULL);
+  gst_object_unref(src_pad);
+  gst_object_unref(from_element);
+  gst_object_unref(to_element);
+  return probe;
+}
+
+// Compare runs with --slices=1 and e.g. --slices=8 at 1080p60 to see what slice output saves.
+static EncodeLatencyProbe *
+attach_first_packet_latency_probe(GstElement *pipeline, const EncoderBackend *backend, EncoderPreset preset,
+                                  gint slices)
+{
+  return attach_latency_probe(pipeline, VIDEO_RATE_NAME, VIDEO_PAYLOADER_NAME, "Capture to first packet",
+                       g_strdup_printf("%s/%s, %d slice%s%s", backend->factory, encoder_preset_names[preset],
+                                       slices, slices == 1 ? "" : "s",
+                                       slices > 1 && !backend->subframe_output ? ", whole-frame output" : ""));
+}
+
+// A live profile switch replaced the capture branch: time frames from the videorate in front of
+// encoder, which sits in the same bin.
+static void
+first_packet_latency_probe_retarget(EncodeLatencyProbe *probe, GstElement *encoder)
+{
+  if (probe == NULL)
+    return;
+
+  GstObject *branch = gst_object_get_parent(GST_OBJECT(encoder));
+  GstElement *videorate = branch != NULL ? gst_bin_get_by_name(GST_BIN(branch), VIDEO_RATE_NAME) : NULL;
+  if (videorate != NULL)
+  {
+    encode_latency_probe_retarget(probe, videorate);
+    gst_object_unref(videorate);
+  }
+  if (branch)
+    gst_object_unref(branch);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+// Packet rate: RTP packets and bytes leaving the payloader, counted in PACKET_RATE_BUCKET_MS
+// buckets. The report puts the busiest bucket against the mean over the report period; an IDR
+// shows up as a peak many times the mean, intra refresh should bring it close to 1. It also
+// shows the average packet size and how much of what goes on the wire is per-packet overhead
+// (see rtp_packet_overhead()), to compare --mtu settings.
+
+#define PACKET_RATE_BUCKET_MS 10
+#define PACKET_RATE_REPORT_SECONDS 10
+
+typedef struct
+{
+  gint64 bucket_start_us;
+  guint bucket_packets;
+  guint64 bucket_bytes;
+  guint peak_packets; // busiest bucket of the report period
+  guint64 peak_bytes;
+  guint64 packets; // whole report period
+  guint64 bytes;
+  gint64 last_report_us;
+  guint overhead; // per-packet bytes besides the payload, on the wire
+  gchar *label;
+} PacketRateProbe;
+
+static void
+packet_rate_close_bucket(PacketRateProbe *probe)
+{
+  probe->peak_packets = MAX(probe->peak_packets, probe->bucket_packets);
+  probe->peak_bytes = MAX(probe->peak_bytes, probe->bucket_bytes);
+  probe->bucket_packets = 0;
+  probe->bucket_bytes = 0;
+}
+
+// Only the payloader's streaming thread runs this, no locking needed.
+static GstPadProbeReturn
+packet_rate_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  PacketRateProbe *probe = (PacketRateProbe *)user_data;
+  gint64 now = g_get_monotonic_time();
+  guint packets = 1;
+  gsize bytes;
+
+  if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+  {
+    GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+    packets = gst_buffer_list_length(list);
+    bytes = gst_buffer_list_calculate_size(list);
+  }
+  else
+    bytes = gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info));
+
+  if (now - probe->bucket_start_us >= PACKET_RATE_BUCKET_MS * 1000)
+  {
+    packet_rate_close_bucket(probe);
+    probe->bucket_start_us = now;
+  }
+  probe->bucket_packets += packets;
+  probe->bucket_bytes += bytes;
+  probe->packets += packets;
+  probe->bytes += bytes;
+
+  gint64 elapsed = now - probe->last_report_us;
+  if (elapsed >= PACKET_RATE_REPORT_SECONDS * G_USEC_PER_SEC)
+  {
+    packet_rate_close_bucket(probe);
+    gdouble mean_pps = probe->packets * (gdouble)G_USEC_PER_SEC / elapsed;
+    gdouble peak_pps = probe->peak_packets * 1000.0 / PACKET_RATE_BUCKET_MS;
+    gdouble mean_bps = probe->bytes * 8.0 * G_USEC_PER_SEC / elapsed;
+    gdouble peak_bps = probe->peak_bytes * 8.0 * 1000.0 / PACKET_RATE_BUCKET_MS;
+    // bytes are RTP packets; IP, UDP and SRTP come on top on the wire
+    gdouble wire_bytes = probe->bytes + (gdouble)(RTP_TRANSPORT_OVERHEAD * probe->packets);
+    guint mtu = 0;
+    g_object_get(GST_PAD_PARENT(pad), "mtu", &mtu, NULL);
+    g_print("📦 Packet rate [%s, mtu %u]: mean %.0f pkt/s, peak %.0f pkt/s (%d ms), peak/mean %.1f, "
+            "bitrate peak/mean %.1f (%.2f / %.2f Mbps), avg %.0f B/pkt, %.1f%% overhead\n",
+            probe->label, mtu, mean_pps, peak_pps, PACKET_RATE_BUCKET_MS,
+            mean_pps > 0 ? peak_pps / mean_pps : 0.0, mean_bps > 0 ? peak_bps / mean_bps : 0.0,
+            peak_bps / 1e6, mean_bps / 1e6, probe->packets ? (gdouble)probe->bytes / probe->packets : 0.0,
+            wire_bytes > 0 ? 100.0 * probe->overhead * probe->packets / wire_bytes : 0.0);
+    probe->peak_packets = 0;
+    probe->peak_bytes = 0;
+    probe->packets = 0;
+    probe->bytes = 0;
+    probe->last_report_us = now;
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+// Counts on the src pad of the payloader, which survives live resolution switches.
+static void
+attach_packet_rate_probe(GstElement *pipeline, const EncoderBackend *backend, const EncoderOptions *options)
+{
+  GstElement *payloader = gst_bin_get_by_name(GST_BIN(pipeline), VIDEO_PAYLOADER_NAME);
+  if (payloader == NULL)
+  {
+    g_print("⚠ Packet rate not measured, " VIDEO_PAYLOADER_NAME " not found\n");
+    return;
+  }
+
+  PacketRateProbe *probe = g_new0(PacketRateProbe, 1);
+  probe->bucket_start_us = probe->last_report_us = g_get_monotonic_time();
+  probe->overhead = rtp_packet_overhead(backend);
+  probe->label = options->intra_refresh != INTRA_REFRESH_OFF && backend->intra_refresh != NULL
+                     ? g_strdup_printf("%s, %s intra refresh over %d frames", backend->factory,
+                                       intra_refresh_names[options->intra_refresh], options->refresh_frames)
+                     : g_strdup_printf("%s, IDR", backend->factory);
+
+  GstPad *src_pad = gst_element_get_static_pad(payloader, "src");
+  gst_pad_add_probe(src_pad, (GstPadProbeType)(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                    packet_rate_probe_cb, probe, NULL);
+  gst_object_unref(src_pad);
+  gst_object_unref(payloader);
+}
+
+#endif // ENCODER_BACKEND_H
@@ -0,0 +1,681 @@
+#ifndef ENCODER_TELEMETRY_H
+#define ENCODER_TELEMETRY_H
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <gst/codecparsers/gsth264parser.h>
+#include <gst/codecparsers/gsth265parser.h>
+#include <gst/codecparsers/gstvp8parser.h>
+#include <libsoup/soup.h>
+#include <json-glib/json-glib.h>
+#include <string.h>
+#include <atomic>
+
+#include "EncoderBackend.h"
+
+// Per-frame encoder telemetry.
+//
+// Probes on the encoder's sink and src pads record, for every encoded frame, the encode latency
+// (raw frame in to encoded frame with the same PTS out), the encoded size, whether it is a
+// keyframe and its QP. QP is read back from the bitstream: slice_qp of the slice headers for
+// H.264/H.265 (averaged over the slices of a frame), the base quantizer index for VP8.
+//
+// The streaming threads only do relaxed atomic adds into fixed histograms, nothing takes a lock.
+// The main loop reads them for the periodic report and for GET /encoder-stats (loopback only),
+// which also compares the actual output bitrate over the last 1 s and 10 s against the target
+// the encoder is currently set to.
+
+#define TELEMETRY_HISTOGRAM_BUCKETS 40 // log2 buckets, bucket i holds [2^(i-1), 2^i)
+#define TELEMETRY_QP_VALUES 128        // H.264/H.265 QP 0-51, VP8 quantizer index 0-127
+#define TELEMETRY_PENDING 128          // raw frames waiting for their encoded counterpart
+#define TELEMETRY_WINDOW_SECONDS 10
+#define TELEMETRY_REPORT_SECONDS 10
+#define TELEMETRY_LOAD_SECONDS 3       // window for the output frame rate admission compares
+#define TELEMETRY_MAX_LOAD 10.0        // what a stalled encoder reports
+#define ENCODER_STATS_PATH "/encoder-stats"
+
+typedef struct
+{
+  std::atomic<guint64> buckets[TELEMETRY_HISTOGRAM_BUCKETS];
+  std::atomic<guint64> count;
+  std::atomic<guint64> sum;
+  std::atomic<guint64> max;
+} TelemetryHistogram;
+
+typedef enum
+{
+  TELEMETRY_CODEC_H264,
+  TELEMETRY_CODEC_H265,
+  TELEMETRY_CODEC_VP8
+} TelemetryCodec;
+
+typedef struct
+{
+  const EncoderBackend *backend;
+  GstElement *encoder; // current encoder, main loop only (replaced by live profile switches)
+
+  // Single producer (encoder sink thread), single consumer (encoder src thread)
+  struct
+  {
+    std::atomic<GstClockTime> pts;
+    std::atomic<gint64> us;
+  } pending[TELEMETRY_PENDING];
+  std::atomic<guint64> pending_head;
+  guint64 pending_tail; // src thread only
+
+  TelemetryHistogram latency_us;
+  TelemetryHistogram frame_bytes;
+  TelemetryHistogram keyframe_bytes;
+  std::atomic<guint64> qp[TELEMETRY_QP_VALUES];
+  std::atomic<guint64> qp_frames;
+  std::atomic<guint64> qp_sum;
+  std::atomic<guint64> keyframes;
+  std::atomic<gint64> first_output_us;
+
+  // Output bytes and frames per wall-clock second, slot = second % (window + 1), the extra slot
+  // is the second being filled
+  std::atomic<gint64> second_stamp[TELEMETRY_WINDOW_SECONDS + 1];
+  std::atomic<guint64> second_bytes[TELEMETRY_WINDOW_SECONDS + 1];
+  std::atomic<guint64> second_frames[TELEMETRY_WINDOW_SECONDS + 1];
+
+  // Bitstream parsing state, src thread only
+  TelemetryCodec codec;
+  std::atomic<guint> nal_length_size; // 0 = byte-stream
+  GstH264NalParser *h264;
+  GstH265Parser *h265;
+  GstVp8Parser vp8;
+
+  // Frame being collected, with sub-frame output it arrives as one buffer per slice. src thread only
+  GstClockTime frame_pts;
+  guint64 frame_size;
+  gboolean frame_keyframe;
+  gint64 frame_latency_us;
+  gint frame_qp_sum;
+  gint frame_qp_slices;
+} EncoderTelemetry;
+
+static void
+telemetry_histogram_add(TelemetryHistogram *histogram, guint64 value)
+{
+  guint bucket = MIN(g_bit_storage(value), TELEMETRY_HISTOGRAM_BUCKETS - 1);
+  histogram->buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  histogram->count.fetch_add(1, std::memory_order_relaxed);
+  histogram->sum.fetch_add(value, std::memory_order_relaxed);
+
+  guint64 max = histogram->max.load(std::memory_order_relaxed);
+  while (value > max && !histogram->max.compare_exchange_weak(max, value, std::memory_order_relaxed))
+    ;
+}
+
+// Upper bound of the bucket holding the given percentile (0-100), 0 if nothing was recorded.
+static guint64
+telemetry_histogram_percentile(const TelemetryHistogram *histogram, gdouble percentile)
+{
+  guint64 count = histogram->count.load(std::memory_order_relaxed);
+  if (count == 0)
+    return 0;
+
+  guint64 wanted = (guint64)(count * percentile / 100.0 + 0.5);
+  guint64 seen = 0;
+  for (guint i = 0; i < TELEMETRY_HISTOGRAM_BUCKETS; i++)
+  {
+    seen += histogram->buckets[i].load(std::memory_order_relaxed);
+    if (seen >= MAX(wanted, 1))
+      return MIN(i == 0 ? 0 : (G_GUINT64_CONSTANT(1) << i) - 1, histogram->max.load(std::memory_order_relaxed));
+  }
+  return histogram->max.load(std::memory_order_relaxed);
+}
+
+static gdouble
+telemetry_histogram_mean(const TelemetryHistogram *histogram)
+{
+  guint64 count = histogram->count.load(std::memory_order_relaxed);
+  return count > 0 ? histogram->sum.load(std::memory_order_relaxed) / (gdouble)count : 0.0;
+}
+
+static guint64
+telemetry_qp_percentile(const EncoderTelemetry *telemetry, gdouble percentile)
+{
+  guint64 count = telemetry->qp_frames.load(std::memory_order_relaxed);
+  guint64 wanted = MAX((guint64)(count * percentile / 100.0 + 0.5), 1);
+  guint64 seen = 0;
+  for (guint i = 0; i < TELEMETRY_QP_VALUES; i++)
+  {
+    seen += telemetry->qp[i].load(std::memory_order_relaxed);
+    if (seen >= wanted)
+      return i;
+  }
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+// QP from the bitstream
+
+// Feeds the NAL unit at offset to the parser and sets next to where it ends. Parameter sets are
+// kept, slices return their QP; -1 for other NAL units, -2 if there is none.
+static gint
+telemetry_nal_qp(EncoderTelemetry *telemetry, const guint8 *data, gsize size, guint offset, guint *next)
+{
+  guint length_size = telemetry->nal_length_size.load(std::memory_order_relaxed);
+
+  if (telemetry->codec == TELEMETRY_CODEC_H264)
+  {
+    GstH264NalUnit nalu;
+    GstH264ParserResult result =
+        length_size ? gst_h264_parser_identify_nalu_avc(telemetry->h264, data, offset, size, length_size, &nalu)
+                    : gst_h264_parser_identify_nalu(telemetry->h264, data, offset, size, &nalu);
+    if (result != GST_H264_PARSER_OK && result != GST_H264_PARSER_NO_NAL_END)
+      return -2;
+    *next = nalu.offset + nalu.size;
+
+    if (nalu.type == GST_H264_NAL_SLICE || nalu.type == GST_H264_NAL_SLICE_IDR)
+    {
+      GstH264SliceHdr slice;
+      if (gst_h264_parser_parse_slice_hdr(telemetry->h264, &nalu, &slice, FALSE, FALSE) == GST_H264_PARSER_OK)
+        return 26 + slice.pps->pic_init_qp_minus26 + slice.slice_qp_delta;
+    }
+    else
+      gst_h264_parser_parse_nal(telemetry->h264, &nalu);
+    return -1;
+  }
+
+  GstH265NalUnit nalu;
+  GstH265ParserResult result =
+      length_size ? gst_h265_parser_identify_nalu_hevc(telemetry->h265, data, offset, size, length_size, &nalu)
+                  : gst_h265_parser_identify_nalu(telemetry->h265, data, offset, size, &nalu);
+  if (result != GST_H265_PARSER_OK && result != GST_H265_PARSER_NO_NAL_END)
+    return -2;
+  *next = nalu.offset + nalu.size;
+
+  if (nalu.type <= GST_H265_NAL_SLICE_CRA_NUT)
+  {
+    GstH265SliceHdr slice;
+    gint qp = -1;
+    if (gst_h265_parser_parse_slice_hdr(telemetry->h265, &nalu, &slice) == GST_H265_PARSER_OK)
+    {
+      qp = 26 + slice.pps->init_qp_minus26 + slice.qp_delta;
+      gst_h265_slice_hdr_free(&slice);
+    }
+    return qp;
+  }
+  gst_h265_parser_parse_nal(telemetry->h265, &nalu);
+  return -1;
+}
+
+// Adds the QP of every slice in one encoded buffer to the frame being collected.
+static void
+telemetry_collect_qp(EncoderTelemetry *telemetry, const guint8 *data, gsize size)
+{
+  if (telemetry->codec == TELEMETRY_CODEC_VP8)
+  {
+    GstVp8FrameHdr header;
+    if (gst_vp8_parser_parse_frame_header(&telemetry->vp8, &header, data, size) == GST_VP8_PARSER_OK)
+    {
+      telemetry->frame_qp_sum += header.quant_indices.y_ac_qi;
+      telemetry->frame_qp_slices++;
+    }
+    return;
+  }
+
+  guint offset = 0;
+  while (offset < size)
+  {
+    guint next = offset;
+    gint qp = telemetry_nal_qp(telemetry, data, size, offset, &next);
+    if (qp == -2 || next <= offset)
+      break;
+    if (qp >= 0)
+    {
+      telemetry->frame_qp_sum += qp;
+      telemetry->frame_qp_slices++;
+    }
+    offset = next;
+  }
+}
+
+// Stream format from the encoder's src caps; avcC codec_data carries the parameter sets.
+static void
+telemetry_set_caps(EncoderTelemetry *telemetry, GstCaps *caps)
+{
+  if (caps == NULL || gst_caps_is_empty(caps) || telemetry->codec == TELEMETRY_CODEC_VP8)
+    return;
+
+  GstStructure *structure = gst_caps_get_structure(caps, 0);
+  const gchar *format = gst_structure_get_string(structure, "stream-format");
+  gboolean length_prefixed = format && (g_str_has_prefix(format, "avc") || g_str_has_prefix(format, "hvc"));
+  const GValue *codec_data = gst_structure_get_value(structure, "codec_data");
+
+  guint length_size = length_prefixed ? 4 : 0;
+  if (length_prefixed && codec_data != NULL && telemetry->codec == TELEMETRY_CODEC_H264)
+  {
+    GstMapInfo mapped;
+    GstBuffer *buffer = gst_value_get_buffer(codec_data);
+    if (gst_buffer_map(buffer, &mapped, GST_MAP_READ))
+    {
+      if (mapped.size >= 7)
+      {
+        length_size = (mapped.data[4] & 0x03) + 1;
+        guint offset = 5;
+        // SPS count in the low 5 bits, then one byte of PPS count after the SPS list
+        for (guint list = 0; list < 2 && offset < mapped.size; list++)
+        {
+          guint count = list == 0 ? mapped.data[offset] & 0x1f : mapped.data[offset];
+          offset++;
+          for (guint i = 0; i < count; i++)
+          {
+            GstH264NalUnit nalu;
+            if (gst_h264_parser_identify_nalu_avc(telemetry->h264, mapped.data, offset, mapped.size, 2, &nalu) !=
+                GST_H264_PARSER_OK)
+              break;
+            gst_h264_parser_parse_nal(telemetry->h264, &nalu);
+            offset = nalu.offset + nalu.size;
+          }
+        }
+      }
+      gst_buffer_unmap(buffer, &mapped);
+    }
+  }
+  telemetry->nal_length_size.store(length_size, std::memory_order_relaxed);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+// Probes
+
+static GstPadProbeReturn
+telemetry_sink_probe_cb(G_GNUC_UNUSED GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  EncoderTelemetry *telemetry = (EncoderTelemetry *)user_data;
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+  if (!GST_BUFFER_PTS_IS_VALID(buffer))
+    return GST_PAD_PROBE_OK;
+
+  guint64 head = telemetry->pending_head.load(std::memory_order_relaxed);
+  auto &slot = telemetry->pending[head % TELEMETRY_PENDING];
+  slot.us.store(g_get_monotonic_time(), std::memory_order_relaxed);
+  slot.pts.store(GST_BUFFER_PTS(buffer), std::memory_order_relaxed);
+  telemetry->pending_head.store(head + 1, std::memory_order_release);
+
+  return GST_PAD_PROBE_OK;
+}
+
+// Encode latency of the frame with this PTS, -1 if its input was not seen (or skipped over).
+static gint64
+telemetry_take_latency(EncoderTelemetry *telemetry, GstClockTime pts, gint64 now)
+{
+  guint64 head = telemetry->pending_head.load(std::memory_order_acquire);
+  // Frames the encoder skips never come out; don't let them pile up.
+  if (head - telemetry->pending_tail > TELEMETRY_PENDING)
+    telemetry->pending_tail = head - TELEMETRY_PENDING;
+
+  while (telemetry->pending_tail < head)
+  {
+    auto &slot = telemetry->pending[telemetry->pending_tail % TELEMETRY_PENDING];
+    GstClockTime slot_pts = slot.pts.load(std::memory_order_relaxed);
+    if (slot_pts > pts)
+      break;
+    telemetry->pending_tail++;
+    if (slot_pts == pts)
+      return now - slot.us.load(std::memory_order_relaxed);
+  }
+  return -1;
+}
+
+// Records the collected frame once the next one starts.
+static void
+telemetry_finish_frame(EncoderTelemetry *telemetry)
+{
+  if (telemetry->frame_size == 0)
+    return;
+
+  if (telemetry->frame_latency_us >= 0)
+    telemetry_histogram_add(&telemetry->latency_us, telemetry->frame_latency_us);
+  telemetry_histogram_add(telemetry->frame_keyframe ? &telemetry->keyframe_bytes : &telemetry->frame_bytes,
+                          telemetry->frame_size);
+  if (telemetry->frame_keyframe)
+    telemetry->keyframes.fetch_add(1, std::memory_order_relaxed);
+
+  if (telemetry->frame_qp_slices > 0)
+  {
+    gint qp = (telemetry->frame_qp_sum + telemetry->frame_qp_slices / 2) / telemetry->frame_qp_slices;
+    telemetry->qp[CLAMP(qp, 0, TELEMETRY_QP_VALUES - 1)].fetch_add(1, std::memory_order_relaxed);
+    telemetry->qp_frames.fetch_add(1, std::memory_order_relaxed);
+    telemetry->qp_sum.fetch_add(qp, std::memory_order_relaxed);
+  }
+
+  telemetry->frame_size = 0;
+  telemetry->frame_keyframe = FALSE;
+  telemetry->frame_latency_us = -1;
+  telemetry->frame_qp_sum = 0;
+  telemetry->frame_qp_slices = 0;
+}
+
+static GstPadProbeReturn
+telemetry_src_probe_cb(G_GNUC_UNUSED GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  EncoderTelemetry *telemetry = (EncoderTelemetry *)user_data;
+
+  if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM)
+  {
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+    if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS)
+    {
+      GstCaps *caps;
+      gst_event_parse_caps(event, &caps);
+      telemetry_set_caps(telemetry, caps);
+    }
+    return GST_PAD_PROBE_OK;
+  }
+
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+  gint64 now = g_get_monotonic_time();
+  gsize size = gst_buffer_get_size(buffer);
+  gint64 second = now / G_USEC_PER_SEC;
+  guint slot = second % (TELEMETRY_WINDOW_SECONDS + 1);
+  if (telemetry->second_stamp[slot].load(std::memory_order_relaxed) != second)
+  {
+    telemetry->second_bytes[slot].store(0, std::memory_order_relaxed);
+    telemetry->second_frames[slot].store(0, std::memory_order_relaxed);
+    telemetry->second_stamp[slot].store(second, std::memory_order_release);
+  }
+  telemetry->second_bytes[slot].fetch_add(size, std::memory_order_relaxed);
+
+  if (!GST_BUFFER_PTS_IS_VALID(buffer) || GST_BUFFER_PTS(buffer) != telemetry->frame_pts)
+  {
+    telemetry_finish_frame(telemetry);
+    telemetry->second_frames[slot].fetch_add(1, std::memory_order_relaxed);
+    if (telemetry->first_output_us.load(std::memory_order_relaxed) == 0)
+      telemetry->first_output_us.store(now, std::memory_order_relaxed);
+    telemetry->frame_pts = GST_BUFFER_PTS(buffer);
+    // Latency is up to the first slice of the frame leaving the encoder
+    if (GST_BUFFER_PTS_IS_VALID(buffer))
+      telemetry->frame_latency_us = telemetry_take_latency(telemetry, GST_BUFFER_PTS(buffer), now);
+  }
+  telemetry->frame_size += size;
+  telemetry->frame_keyframe |= !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+
+  GstMapInfo mapped;
+  if (gst_buffer_map(buffer, &mapped, GST_MAP_READ))
+  {
+    telemetry_collect_qp(telemetry, mapped.data, mapped.size);
+    gst_buffer_unmap(buffer, &mapped);
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+// Reporting (main loop)
+
+// Output bitrate in kbps over the last seconds complete seconds.
+static gdouble
+telemetry_output_kbps(const EncoderTelemetry *telemetry, guint seconds)
+{
+  gint64 current = g_get_monotonic_time() / G_USEC_PER_SEC;
+  guint64 bytes = 0;
+  for (gint64 second = current - seconds; second < current; second++)
+  {
+    guint slot = second % (TELEMETRY_WINDOW_SECONDS + 1);
+    if (telemetry->second_stamp[slot].load(std::memory_order_acquire) == second)
+      bytes += telemetry->second_bytes[slot].load(std::memory_order_relaxed);
+  }
+  return bytes * 8.0 / 1000.0 / seconds;
+}
+
+// Frames out over the last seconds complete seconds.
+static guint64
+telemetry_output_frames(const EncoderTelemetry *telemetry, guint seconds)
+{
+  gint64 current = g_get_monotonic_time() / G_USEC_PER_SEC;
+  guint64 frames = 0;
+  for (gint64 second = current - seconds; second < current; second++)
+  {
+    guint slot = second % (TELEMETRY_WINDOW_SECONDS + 1);
+    if (telemetry->second_stamp[slot].load(std::memory_order_acquire) == second)
+      frames += telemetry->second_frames[slot].load(std::memory_order_relaxed);
+  }
+  return frames;
+}
+
+// Throughput, not latency: the frame rate the encoder is fed over the one it puts out. A pipelined
+// or hardware encoder may hold a frame longer than the frame interval and still keep up; one that
+// doesn't falls behind, and the capture in front of it drops frames. 1 while it keeps up, more when
+// it doesn't, < 0 before there is enough output to tell. The input rate is the framerate of the
+// encoder's sink caps (videorate caps it to --fps), fps when those don't say.
+static gdouble
+telemetry_encoder_load(const EncoderTelemetry *telemetry, gint fps)
+{
+  gint64 first_output_us = telemetry->first_output_us.load(std::memory_order_relaxed);
+  if (first_output_us == 0 ||
+      g_get_monotonic_time() - first_output_us < (TELEMETRY_LOAD_SECONDS + 1) * G_USEC_PER_SEC)
+    return -1.0;
+
+  gdouble input_fps = MAX(fps, 1);
+  GstPad *sink_pad = gst_element_get_static_pad(telemetry->encoder, "sink");
+  GstCaps *caps = gst_pad_get_current_caps(sink_pad);
+  gint fps_n = 0, fps_d = 1;
+  if (caps != NULL && gst_structure_get_fraction(gst_caps_get_structure(caps, 0), "framerate", &fps_n, &fps_d) &&
+      fps_n > 0 && fps_d > 0)
+    input_fps = (gdouble)fps_n / fps_d;
+  if (caps)
+    gst_caps_unref(caps);
+  gst_object_unref(sink_pad);
+
+  guint64 frames = telemetry_output_frames(telemetry, TELEMETRY_LOAD_SECONDS);
+  if (frames == 0)
+    return TELEMETRY_MAX_LOAD;
+  return MIN(input_fps * TELEMETRY_LOAD_SECONDS / frames, TELEMETRY_MAX_LOAD);
+}
+
+// What the encoder's bitrate property is set to right now, in kbps.
+static gint
+telemetry_target_kbps(const EncoderTelemetry *telemetry)
+{
+  GValue value = G_VALUE_INIT;
+  g_value_init(&value, G_TYPE_UINT64);
+  g_object_get_property(G_OBJECT(telemetry->encoder), telemetry->backend->bitrate_property, &value);
+  gint kbps = (gint)(g_value_get_uint64(&value) / telemetry->backend->bitrate_scale);
+  g_value_unset(&value);
+  return kbps;
+}
+
+static gboolean
+telemetry_report_cb(gpointer user_data)
+{
+  EncoderTelemetry *telemetry = (EncoderTelemetry *)user_data;
+  if (telemetry->latency_us.count.load(std::memory_order_relaxed) == 0)
+    return G_SOURCE_CONTINUE;
+
+  gint target = telemetry_target_kbps(telemetry);
+  gdouble last_second = telemetry_output_kbps(telemetry, 1);
+  gdouble last_window = telemetry_output_kbps(telemetry, TELEMETRY_WINDOW_SECONDS);
+  guint64 qp_frames = telemetry->qp_frames.load(std::memory_order_relaxed);
+
+  g_print("📊 Encoder [%s]: latency p50 %.2f / p99 %.2f ms, frame p50 %" G_GUINT64_FORMAT " B, "
+          "keyframe max %" G_GUINT64_FORMAT " B (%" G_GUINT64_FORMAT " keyframes), ",
+          telemetry->backend->factory,
+          telemetry_histogram_percentile(&telemetry->latency_us, 50) / 1000.0,
+          telemetry_histogram_percentile(&telemetry->latency_us, 99) / 1000.0,
+          telemetry_histogram_percentile(&telemetry->frame_bytes, 50),
+          telemetry->keyframe_bytes.max.load(std::memory_order_relaxed),
+          telemetry->keyframes.load(std::memory_order_relaxed));
+  if (qp_frames > 0)
+    g_print("QP avg %.1f, ", telemetry->qp_sum.load(std::memory_order_relaxed) / (gdouble)qp_frames);
+  g_print("bitrate %.0f kbps (1 s) / %.0f kbps (%d s) vs target %d (%.0f%%)\n",
+          last_second, last_window, TELEMETRY_WINDOW_SECONDS, target,
+          target > 0 ? 100.0 * last_window / target : 0.0);
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+telemetry_add_histogram_member(JsonBuilder *builder, const gchar *name, const TelemetryHistogram *histogram)
+{
+  json_builder_set_member_name(builder, name);
+  json_builder_begin_object(builder);
+  json_builder_set_member_name(builder, "count");
+  json_builder_add_int_value(builder, histogram->count.load(std::memory_order_relaxed));
+  json_builder_set_member_name(builder, "mean");
+  json_builder_add_double_value(builder, telemetry_histogram_mean(histogram));
+  json_builder_set_member_name(builder, "p50");
+  json_builder_add_int_value(builder, telemetry_histogram_percentile(histogram, 50));
+  json_builder_set_member_name(builder, "p95");
+  json_builder_add_int_value(builder, telemetry_histogram_percentile(histogram, 95));
+  json_builder_set_member_name(builder, "p99");
+  json_builder_add_int_value(builder, telemetry_histogram_percentile(histogram, 99));
+  json_builder_set_member_name(builder, "max");
+  json_builder_add_int_value(builder, histogram->max.load(std::memory_order_relaxed));
+  json_builder_set_member_name(builder, "buckets"); // upper bounds 2^i - 1
+  json_builder_begin_array(builder);
+  for (guint i = 0; i < TELEMETRY_HISTOGRAM_BUCKETS; i++)
+    json_builder_add_int_value(builder, histogram->buckets[i].load(std::memory_order_relaxed));
+  json_builder_end_array(builder);
+  json_builder_end_object(builder);
+}
+
+// GET /encoder-stats: everything since start, bitrate over the last 1 s and 10 s.
+static void
+encoder_stats_handler(G_GNUC_UNUSED SoupServer *server, SoupMessage *message, G_GNUC_UNUSED const char *path,
+                      G_GNUC_UNUSED GHashTable *query, SoupClientContext *client_context, gpointer user_data)
+{
+  EncoderTelemetry *telemetry = (EncoderTelemetry *)user_data;
+
+  if (message->method != SOUP_METHOD_GET)
+  {
+    soup_message_set_status(message, SOUP_STATUS_METHOD_NOT_ALLOWED);
+    return;
+  }
+
+  GSocketAddress *remote = soup_client_context_get_remote_address(client_context);
+  if (remote == NULL || !G_IS_INET_SOCKET_ADDRESS(remote) ||
+      !g_inet_address_get_is_loopback(g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(remote))))
+  {
+    soup_message_set_status(message, SOUP_STATUS_FORBIDDEN);
+    return;
+  }
+
+  gint target = telemetry_target_kbps(telemetry);
+  gdouble last_second = telemetry_output_kbps(telemetry, 1);
+  gdouble last_window = telemetry_output_kbps(telemetry, TELEMETRY_WINDOW_SECONDS);
+  guint64 qp_frames = telemetry->qp_frames.load(std::memory_order_relaxed);
+
+  JsonBuilder *builder = json_builder_new();
+  json_builder_begin_object(builder);
+  json_builder_set_member_name(builder, "encoder");
+  json_builder_add_string_value(builder, telemetry->backend->factory);
+  json_builder_set_member_name(builder, "keyframes");
+  json_builder_add_int_value(builder, telemetry->keyframes.load(std::memory_order_relaxed));
+  telemetry_add_histogram_member(builder, "encode_latency_us", &telemetry->latency_us);
+  telemetry_add_histogram_member(builder, "frame_bytes", &telemetry->frame_bytes);
+  telemetry_add_histogram_member(builder, "keyframe_bytes", &telemetry->keyframe_bytes);
+
+  json_builder_set_member_name(builder, "qp");
+  json_builder_begin_object(builder);
+  json_builder_set_member_name(builder, "frames");
+  json_builder_add_int_value(builder, qp_frames);
+  json_builder_set_member_name(builder, "mean");
+  json_builder_add_double_value(builder, qp_frames ? telemetry->qp_sum.load(std::memory_order_relaxed) / (gdouble)qp_frames : -1.0);
+  json_builder_set_member_name(builder, "p50");
+  json_builder_add_int_value(builder, qp_frames ? (gint64)telemetry_qp_percentile(telemetry, 50) : -1);
+  json_builder_set_member_name(builder, "p95");
+  json_builder_add_int_value(builder, qp_frames ? (gint64)telemetry_qp_percentile(telemetry, 95) : -1);
+  json_builder_end_object(builder);
+
+  json_builder_set_member_name(builder, "bitrate");
+  json_builder_begin_object(builder);
+  json_builder_set_member_name(builder, "target_kbps");
+  json_builder_add_int_value(builder, target);
+  json_builder_set_member_name(builder, "actual_1s_kbps");
+  json_builder_add_double_value(builder, last_second);
+  json_builder_set_member_name(builder, "actual_10s_kbps");
+  json_builder_add_double_value(builder, last_window);
+  json_builder_set_member_name(builder, "ratio_1s");
+  json_builder_add_double_value(builder, target > 0 ? last_second / target : 0.0);
+  json_builder_set_member_name(builder, "ratio_10s");
+  json_builder_add_double_value(builder, target > 0 ? last_window / target : 0.0);
+  json_builder_end_object(builder);
+  json_builder_end_object(builder);
+
+  JsonGenerator *generator = json_generator_new();
+  JsonNode *root = json_builder_get_root(builder);
+  json_generator_set_root(generator, root);
+  gchar *json_str = json_generator_to_data(generator, NULL);
+
+  soup_message_set_response(message, "application/json", SOUP_MEMORY_TAKE, json_str, strlen(json_str));
+  soup_message_set_status(message, SOUP_STATUS_OK);
+
+  json_node_free(root);
+  g_object_unref(generator);
+  g_object_unref(builder);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+
+// Moves the probes to a replacement encoder (live profile switch). The old encoder is gone by
+// then, so the pending ring and the parsers have a single user again. Main loop only.
+static void
+encoder_telemetry_retarget(EncoderTelemetry *telemetry, GstElement *encoder)
+{
+  if (telemetry == NULL)
+    return;
+
+  if (telemetry->encoder)
+    gst_object_unref(telemetry->encoder);
+  telemetry->encoder = GST_ELEMENT(gst_object_ref(encoder));
+
+  GstPad *sink_pad = gst_element_get_static_pad(encoder, "sink");
+  GstPad *src_pad = gst_element_get_static_pad(encoder, "src");
+  // Caps may already be set on a running encoder; the probe only sees later caps events
+  GstCaps *caps = gst_pad_get_current_caps(src_pad);
+  if (caps)
+  {
+    telemetry_set_caps(telemetry, caps);
+    gst_caps_unref(caps);
+  }
+  gst_pad_add_probe(sink_pad, GST_PAD_PROBE_TYPE_BUFFER, telemetry_sink_probe_cb, telemetry, NULL);
+  gst_pad_add_probe(src_pad, (GstPadProbeType)(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+                    telemetry_src_probe_cb, telemetry, NULL);
+  gst_object_unref(sink_pad);
+  gst_object_unref(src_pad);
+}
+
+// Probes the named encoder and starts the periodic report. Lives until exit, like the pipeline.
+static EncoderTelemetry *
+attach_encoder_telemetry(GstElement *pipeline, const EncoderBackend *backend, const gchar *encoder_name)
+{
+  GstElement *encoder = gst_bin_get_by_name(GST_BIN(pipeline), encoder_name);
+  if (encoder == NULL)
+  {
+    g_print("⚠ Encoder telemetry off, %s not found\n", encoder_name);
+    return NULL;
+  }
+
+  EncoderTelemetry *telemetry = new EncoderTelemetry();
+  telemetry->backend = backend;
+  if (g_ascii_strcasecmp(backend->codec, "vp8") == 0)
+  {
+    telemetry->codec = TELEMETRY_CODEC_VP8;
+    gst_vp8_parser_init(&telemetry->vp8);
+  }
+  else if (g_ascii_strcasecmp(backend->codec, "h265") == 0)
+  {
+    telemetry->codec = TELEMETRY_CODEC_H265;
+    telemetry->h265 = gst_h265_parser_new();
+  }
+  else
+  {
+    telemetry->codec = TELEMETRY_CODEC_H264;
+    telemetry->h264 = gst_h264_nal_parser_new();
+  }
+  for (guint i = 0; i <= TELEMETRY_WINDOW_SECONDS; i++)
+    telemetry->second_stamp[i].store(-1);
+  telemetry->frame_pts = GST_CLOCK_TIME_NONE;
+  telemetry->frame_latency_us = -1;
+
+  encoder_telemetry_retarget(telemetry, encoder);
+  gst_object_unref(encoder);
+
+  g_timeout_add_seconds(TELEMETRY_REPORT_SECONDS, telemetry_report_cb, telemetry);
+  return telemetry;
+}
+
+#endif // ENCODER_TELEMETRY_H
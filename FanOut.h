@@ -0,0 +1,590 @@
+#ifndef FAN_OUT_H
+#define FAN_OUT_H
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <json-glib/json-glib.h>
+#include <sys/resource.h>
+#include <string.h>
+#include <atomic>
+
+// Ring fan-out of the encoded video to the viewers (--fanout=ring).
+//
+// With the default tee every viewer has a tee request pad and a queue with its own streaming
+// thread, and adding or removing a viewer blocks the tee's src pad (pad_probe_cb). In ring mode a
+// probe on the tee's sink pad publishes every RTP packet, by reference, into a single-producer
+// ring of FANOUT_RING_SLOTS slots. Each viewer is a consumer with its own cursor into the ring,
+// driven by one of a few worker threads (--fanout-workers) shared by all viewers:
+// - The producer never takes a lock and never waits for a consumer. A slot is overwritten one
+//   lap later whether or not everybody has read it; a consumer that fell a lap behind jumps to
+//   the newest packet and counts the skipped ones as lapped, like the leaky queue dropping them.
+// - A consumer reads a slot seqlock-style: the slot's sequence number before and after taking a
+//   reference tells whether the buffer is the one it wanted. While it takes the reference the
+//   worker publishes the slot as a hazard, and the producer keeps a replaced buffer alive until
+//   no worker has that slot marked.
+// - Adding or removing a viewer only takes its worker's list lock, never the producer's path.
+//   A worker pushes outside that lock, to a referenced snapshot of its consumers, so one viewer
+//   slow to take a packet holds up neither the others nor viewers joining and leaving; removing
+//   a viewer waits at most for a push to that viewer in progress.
+//
+// The consumer is a standalone src pad linked to the viewer bin's video_sink ghost pad. The
+// stream-start, caps and segment events seen on the tee are replayed to it before its first
+// packet, and again whenever they change.
+//
+// Every FANOUT_REPORT_SECONDS the viewer count, the delay from publish to push, lapped packets and
+// the process CPU time per viewer are printed, to compare against the tee on the same source.
+
+#define FANOUT_RING_SLOTS 2048       // power of two; about 2 s of packets at 6 Mbps
+#define FANOUT_MAX_WORKERS 16
+#define FANOUT_DEFAULT_WORKERS 4     // at most, fewer on smaller machines
+#define FANOUT_BATCH 32              // packets per consumer per turn, so one viewer can't starve the rest
+#define FANOUT_IDLE_WAIT_MS 50
+#define FANOUT_REPORT_SECONDS 10
+
+#define FANOUT_SEQ_WRITING G_MAXUINT64
+
+typedef enum
+{
+  FANOUT_TEE = 0,
+  FANOUT_RING,
+  FANOUT_MODE_COUNT
+} FanoutMode;
+
+static const gchar *fanout_mode_names[FANOUT_MODE_COUNT] = {"tee", "ring"};
+
+static gboolean
+fanout_mode_from_string(const gchar *name, FanoutMode *mode)
+{
+  if (name == NULL)
+  {
+    *mode = FANOUT_TEE;
+    return TRUE;
+  }
+  for (gint i = 0; i < FANOUT_MODE_COUNT; i++)
+  {
+    if (g_ascii_strcasecmp(name, fanout_mode_names[i]) == 0)
+    {
+      *mode = (FanoutMode)i;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+static gint
+fanout_default_workers()
+{
+  return MIN((gint)g_get_num_processors(), FANOUT_DEFAULT_WORKERS);
+}
+
+typedef struct
+{
+  std::atomic<GstBuffer *> buffer;
+  std::atomic<guint64> seq;          // of the buffer in it, FANOUT_SEQ_WRITING while it is replaced
+  std::atomic<gint64> published_us;
+} FanoutSlot;
+
+typedef struct
+{
+  GstBuffer *buffer;
+  guint slot;
+} FanoutRetired;
+
+// The sticky events a consumer needs before its first packet.
+typedef enum
+{
+  FANOUT_EVENT_STREAM_START = 0,
+  FANOUT_EVENT_CAPS,
+  FANOUT_EVENT_SEGMENT,
+  FANOUT_EVENT_COUNT
+} FanoutEvent;
+
+typedef struct _FanOut FanOut;
+typedef struct _FanoutWorker FanoutWorker;
+
+typedef struct
+{
+  GstPad *pad;          // ours, linked to the viewer
+  FanoutWorker *worker;
+  std::atomic<gint> refs; // the owner's, and a worker's while the consumer is in its snapshot
+
+  GMutex push_lock;     // held while the worker pushes, so a removed consumer is no longer used
+  gboolean removed;     // under push_lock
+
+  // Only the worker thread
+  guint64 cursor;       // next sequence number to push
+  guint events_cookie;  // of the events last pushed, 0 before the first
+
+  // Counted by the worker, read by the reports
+  std::atomic<guint64> packets;
+  std::atomic<guint64> lapped;
+  std::atomic<guint64> lag_us;      // total delay from publish to push
+  std::atomic<gint64> max_lag_us;   // since the last report
+} FanoutConsumer;
+
+struct _FanoutWorker
+{
+  FanOut *fanout;
+  GThread *thread;
+
+  GMutex list_lock;
+  GList *consumers;
+  guint count;
+  GPtrArray *snapshot;  // only the worker thread: the consumers it is pumping this turn
+
+  std::atomic<guint> hazard;  // slot + 1 the worker is taking a reference from, 0 for none
+
+  GMutex wake_lock;
+  GCond wake;
+  std::atomic<gboolean> sleeping;
+};
+
+struct _FanOut
+{
+  FanoutSlot slots[FANOUT_RING_SLOTS];
+  std::atomic<guint64> head;  // sequence number of the next packet
+
+  // Only the producer
+  GArray *retired;            // replaced buffers a worker may still be referencing
+
+  GMutex events_lock;
+  GstEvent *events[FANOUT_EVENT_COUNT];
+  guint events_cookie;
+
+  FanoutWorker workers[FANOUT_MAX_WORKERS];
+  guint worker_count;
+
+  // Only the main loop
+  gint64 last_report_us;
+  struct rusage last_usage;
+  guint64 last_packets;
+};
+
+static gboolean
+fanout_slot_in_use(FanOut *fanout, guint slot)
+{
+  for (guint i = 0; i < fanout->worker_count; i++)
+    if (fanout->workers[i].hazard.load() == slot + 1)
+      return TRUE;
+  return FALSE;
+}
+
+// Unrefs the replaced buffers no worker is taking a reference from any more.
+static void
+fanout_drain_retired(FanOut *fanout)
+{
+  for (guint i = 0; i < fanout->retired->len;)
+  {
+    FanoutRetired *retired = &g_array_index(fanout->retired, FanoutRetired, i);
+    if (fanout_slot_in_use(fanout, retired->slot))
+    {
+      i++;
+      continue;
+    }
+    gst_buffer_unref(retired->buffer);
+    g_array_remove_index_fast(fanout->retired, i);
+  }
+}
+
+static void
+fanout_wake_workers(FanOut *fanout)
+{
+  for (guint i = 0; i < fanout->worker_count; i++)
+  {
+    FanoutWorker *worker = &fanout->workers[i];
+    if (!worker->sleeping.load())
+      continue;
+    g_mutex_lock(&worker->wake_lock);
+    g_cond_signal(&worker->wake);
+    g_mutex_unlock(&worker->wake_lock);
+  }
+}
+
+// Only the tee's streaming thread calls this.
+static void
+fanout_publish(FanOut *fanout, GstBuffer *buffer, gint64 now)
+{
+  guint64 seq = fanout->head.load(std::memory_order_relaxed);
+  guint index = (guint)(seq & (FANOUT_RING_SLOTS - 1));
+  FanoutSlot *slot = &fanout->slots[index];
+
+  slot->seq.store(FANOUT_SEQ_WRITING);
+  GstBuffer *old = slot->buffer.exchange(gst_buffer_ref(buffer));
+  slot->published_us.store(now, std::memory_order_relaxed);
+  slot->seq.store(seq);
+  fanout->head.store(seq + 1);
+
+  if (fanout->retired->len > 0)
+    fanout_drain_retired(fanout);
+  if (old != NULL)
+  {
+    if (fanout_slot_in_use(fanout, index))
+    {
+      FanoutRetired retired = {old, index};
+      g_array_append_val(fanout->retired, retired);
+    }
+    else
+    {
+      gst_buffer_unref(old);
+    }
+  }
+}
+
+static void
+fanout_store_event(FanOut *fanout, FanoutEvent which, GstEvent *event)
+{
+  g_mutex_lock(&fanout->events_lock);
+  gst_event_replace(&fanout->events[which], event);
+  fanout->events_cookie++;
+  g_mutex_unlock(&fanout->events_lock);
+}
+
+static GstPadProbeReturn
+fanout_producer_probe_cb(G_GNUC_UNUSED GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  FanOut *fanout = (FanOut *)user_data;
+  GstPadProbeType type = GST_PAD_PROBE_INFO_TYPE(info);
+
+  if (type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM)
+  {
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+    switch (GST_EVENT_TYPE(event))
+    {
+    case GST_EVENT_STREAM_START:
+      fanout_store_event(fanout, FANOUT_EVENT_STREAM_START, event);
+      break;
+    case GST_EVENT_CAPS:
+      fanout_store_event(fanout, FANOUT_EVENT_CAPS, event);
+      break;
+    case GST_EVENT_SEGMENT:
+      fanout_store_event(fanout, FANOUT_EVENT_SEGMENT, event);
+      break;
+    default:
+      break;
+    }
+    return GST_PAD_PROBE_OK;
+  }
+
+  gint64 now = g_get_monotonic_time();
+  if (type & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+  {
+    GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+    guint length = gst_buffer_list_length(list);
+    for (guint i = 0; i < length; i++)
+      fanout_publish(fanout, gst_buffer_list_get(list, i), now);
+  }
+  else
+  {
+    fanout_publish(fanout, GST_PAD_PROBE_INFO_BUFFER(info), now);
+  }
+  fanout_wake_workers(fanout);
+
+  // The tee still feeds the UDP client
+  return GST_PAD_PROBE_OK;
+}
+
+// Pushes the stored sticky events if they changed since the consumer last saw them.
+static void
+fanout_consumer_sync_events(FanOut *fanout, FanoutConsumer *consumer)
+{
+  GstEvent *events[FANOUT_EVENT_COUNT] = {};
+
+  g_mutex_lock(&fanout->events_lock);
+  if (consumer->events_cookie == fanout->events_cookie)
+  {
+    g_mutex_unlock(&fanout->events_lock);
+    return;
+  }
+  for (gint i = 0; i < FANOUT_EVENT_COUNT; i++)
+    if (fanout->events[i] != NULL)
+      events[i] = gst_event_ref(fanout->events[i]);
+  consumer->events_cookie = fanout->events_cookie;
+  g_mutex_unlock(&fanout->events_lock);
+
+  for (gint i = 0; i < FANOUT_EVENT_COUNT; i++)
+    if (events[i] != NULL)
+      gst_pad_push_event(consumer->pad, events[i]);
+}
+
+// Takes a reference to packet seq, or returns NULL if it was overwritten already.
+static GstBuffer *
+fanout_read(FanOut *fanout, FanoutWorker *worker, guint64 seq, gint64 *published_us)
+{
+  guint index = (guint)(seq & (FANOUT_RING_SLOTS - 1));
+  FanoutSlot *slot = &fanout->slots[index];
+
+  worker->hazard.store(index + 1);
+  if (slot->seq.load() != seq)
+  {
+    worker->hazard.store(0);
+    return NULL;
+  }
+  GstBuffer *buffer = gst_buffer_ref(slot->buffer.load());
+  *published_us = slot->published_us.load(std::memory_order_relaxed);
+  worker->hazard.store(0);
+
+  if (slot->seq.load() != seq)
+  {
+    gst_buffer_unref(buffer);
+    return NULL;
+  }
+  return buffer;
+}
+
+// Pushes up to FANOUT_BATCH packets. Returns TRUE if the consumer has more waiting.
+static gboolean
+fanout_consumer_pump(FanOut *fanout, FanoutWorker *worker, FanoutConsumer *consumer)
+{
+  for (guint n = 0; n < FANOUT_BATCH; n++)
+  {
+    guint64 head = fanout->head.load();
+    if (consumer->cursor >= head)
+      return FALSE;
+
+    gint64 published_us = 0;
+    GstBuffer *buffer = head - consumer->cursor < FANOUT_RING_SLOTS
+                            ? fanout_read(fanout, worker, consumer->cursor, &published_us)
+                            : NULL;
+    if (buffer == NULL)
+    {
+      // Lapped: continue with the newest packet
+      consumer->lapped.fetch_add(head - consumer->cursor, std::memory_order_relaxed);
+      consumer->cursor = head;
+      return FALSE;
+    }
+    consumer->cursor++;
+
+    fanout_consumer_sync_events(fanout, consumer);
+    gint64 lag = g_get_monotonic_time() - published_us;
+    consumer->packets.fetch_add(1, std::memory_order_relaxed);
+    consumer->lag_us.fetch_add(lag, std::memory_order_relaxed);
+    if (lag > consumer->max_lag_us.load(std::memory_order_relaxed))
+      consumer->max_lag_us.store(lag, std::memory_order_relaxed);
+
+    // FLUSHING and EOS are expected while the viewer is torn down
+    gst_pad_push(consumer->pad, buffer);
+  }
+  return consumer->cursor < fanout->head.load();
+}
+
+static void
+fanout_consumer_unref(FanoutConsumer *consumer)
+{
+  if (consumer->refs.fetch_sub(1) != 1)
+    return;
+  g_mutex_clear(&consumer->push_lock);
+  gst_object_unref(consumer->pad);
+  delete consumer;
+}
+
+static gpointer
+fanout_worker_run(gpointer data)
+{
+  FanoutWorker *worker = (FanoutWorker *)data;
+  FanOut *fanout = worker->fanout;
+
+  while (TRUE)
+  {
+    gboolean more = FALSE;
+    g_mutex_lock(&worker->list_lock);
+    for (GList *l = worker->consumers; l != NULL; l = l->next)
+    {
+      FanoutConsumer *consumer = (FanoutConsumer *)l->data;
+      consumer->refs.fetch_add(1);
+      g_ptr_array_add(worker->snapshot, consumer);
+    }
+    g_mutex_unlock(&worker->list_lock);
+
+    for (guint i = 0; i < worker->snapshot->len; i++)
+    {
+      FanoutConsumer *consumer = (FanoutConsumer *)g_ptr_array_index(worker->snapshot, i);
+      g_mutex_lock(&consumer->push_lock);
+      if (!consumer->removed)
+        more |= fanout_consumer_pump(fanout, worker, consumer);
+      g_mutex_unlock(&consumer->push_lock);
+      fanout_consumer_unref(consumer);
+    }
+    g_ptr_array_set_size(worker->snapshot, 0);
+    if (more)
+      continue;
+
+    // Sleep until the producer publishes; it checks sleeping after moving head
+    g_mutex_lock(&worker->wake_lock);
+    worker->sleeping.store(TRUE);
+    guint64 head = fanout->head.load();
+    gboolean idle = TRUE;
+    g_mutex_lock(&worker->list_lock);
+    for (GList *l = worker->consumers; l != NULL && idle; l = l->next)
+      idle = ((FanoutConsumer *)l->data)->cursor >= head;
+    g_mutex_unlock(&worker->list_lock);
+    if (idle)
+      g_cond_wait_until(&worker->wake, &worker->wake_lock,
+                        g_get_monotonic_time() + FANOUT_IDLE_WAIT_MS * G_TIME_SPAN_MILLISECOND);
+    worker->sleeping.store(FALSE);
+    g_mutex_unlock(&worker->wake_lock);
+  }
+  return NULL;
+}
+
+// Starts a consumer at the newest packet, on the worker with the fewest viewers. sink is the
+// viewer's video sink pad, which must be able to take data.
+static FanoutConsumer *
+fanout_add_consumer(FanOut *fanout, GstPad *sink)
+{
+  FanoutConsumer *consumer = new FanoutConsumer();
+  consumer->refs.store(1);
+  g_mutex_init(&consumer->push_lock);
+  consumer->pad = gst_pad_new(NULL, GST_PAD_SRC);
+  gst_pad_set_active(consumer->pad, TRUE);
+  if (GST_PAD_LINK_FAILED(gst_pad_link(consumer->pad, sink)))
+  {
+    gst_pad_set_active(consumer->pad, FALSE);
+    fanout_consumer_unref(consumer);
+    return NULL;
+  }
+
+  FanoutWorker *worker = &fanout->workers[0];
+  for (guint i = 1; i < fanout->worker_count; i++)
+    if (fanout->workers[i].count < worker->count)
+      worker = &fanout->workers[i];
+  consumer->worker = worker;
+
+  g_mutex_lock(&worker->list_lock);
+  consumer->cursor = fanout->head.load();
+  worker->consumers = g_list_prepend(worker->consumers, consumer);
+  worker->count++;
+  g_mutex_unlock(&worker->list_lock);
+  return consumer;
+}
+
+// Takes the consumer off its worker. Once this returns nothing is pushed to the viewer any more;
+// it waits for a push already in progress.
+static void
+fanout_remove_consumer(FanoutConsumer *consumer)
+{
+  FanoutWorker *worker = consumer->worker;
+  g_mutex_lock(&worker->list_lock);
+  worker->consumers = g_list_remove(worker->consumers, consumer);
+  worker->count--;
+  g_mutex_unlock(&worker->list_lock);
+
+  g_mutex_lock(&consumer->push_lock);
+  consumer->removed = TRUE;
+  g_mutex_unlock(&consumer->push_lock);
+}
+
+// After fanout_remove_consumer(). A worker may still hold the consumer in its snapshot; it is
+// deleted once that is done with it.
+static void
+fanout_consumer_free(FanoutConsumer *consumer)
+{
+  GstPad *peer = gst_pad_get_peer(consumer->pad);
+  if (peer != NULL)
+  {
+    gst_pad_unlink(consumer->pad, peer);
+    gst_object_unref(peer);
+  }
+  gst_pad_set_active(consumer->pad, FALSE);
+  fanout_consumer_unref(consumer);
+}
+
+static void
+fanout_consumer_add_members(JsonBuilder *builder, FanoutConsumer *consumer)
+{
+  guint64 packets = consumer->packets.load(std::memory_order_relaxed);
+
+  json_builder_set_member_name(builder, "fanout_packets");
+  json_builder_add_int_value(builder, (gint64)packets);
+  json_builder_set_member_name(builder, "fanout_lapped");
+  json_builder_add_int_value(builder, (gint64)consumer->lapped.load(std::memory_order_relaxed));
+  json_builder_set_member_name(builder, "fanout_mean_lag_ms");
+  json_builder_add_double_value(builder,
+                                packets ? consumer->lag_us.load(std::memory_order_relaxed) / 1000.0 / packets : 0.0);
+}
+
+static gboolean
+fanout_report_cb(gpointer user_data)
+{
+  FanOut *fanout = (FanOut *)user_data;
+  gint64 now = g_get_monotonic_time();
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  gdouble seconds = (now - fanout->last_report_us) / (gdouble)G_USEC_PER_SEC;
+  gdouble cpu_s = (usage.ru_utime.tv_sec - fanout->last_usage.ru_utime.tv_sec) +
+                  (usage.ru_utime.tv_usec - fanout->last_usage.ru_utime.tv_usec) / 1e6 +
+                  (usage.ru_stime.tv_sec - fanout->last_usage.ru_stime.tv_sec) +
+                  (usage.ru_stime.tv_usec - fanout->last_usage.ru_stime.tv_usec) / 1e6;
+  guint64 head = fanout->head.load();
+
+  guint viewers = 0;
+  guint64 packets = 0, lapped = 0, lag_us = 0;
+  gint64 max_lag_us = 0;
+  for (guint i = 0; i < fanout->worker_count; i++)
+  {
+    FanoutWorker *worker = &fanout->workers[i];
+    g_mutex_lock(&worker->list_lock);
+    for (GList *l = worker->consumers; l != NULL; l = l->next)
+    {
+      FanoutConsumer *consumer = (FanoutConsumer *)l->data;
+      viewers++;
+      packets += consumer->packets.load(std::memory_order_relaxed);
+      lapped += consumer->lapped.load(std::memory_order_relaxed);
+      lag_us += consumer->lag_us.load(std::memory_order_relaxed);
+      max_lag_us = MAX(max_lag_us, consumer->max_lag_us.exchange(0, std::memory_order_relaxed));
+    }
+    g_mutex_unlock(&worker->list_lock);
+  }
+
+  if (head > fanout->last_packets)
+    g_print("🔀 Ring fan-out: %.0f pkt/s to %u viewers on %u workers, lag mean %.2f ms max %.2f ms, "
+            "%" G_GUINT64_FORMAT " lapped, process CPU %.1f%% (%.1f%% per viewer)\n",
+            (head - fanout->last_packets) / seconds, viewers, fanout->worker_count,
+            packets ? lag_us / 1000.0 / packets : 0.0, max_lag_us / 1000.0, lapped,
+            100.0 * cpu_s / seconds, viewers ? 100.0 * cpu_s / seconds / viewers : 0.0);
+
+  fanout->last_packets = head;
+  fanout->last_report_us = now;
+  fanout->last_usage = usage;
+  return G_SOURCE_CONTINUE;
+}
+
+// Publishes what goes through tee's sink pad and starts the workers. Lives until exit, like the
+// pipeline.
+static FanOut *
+attach_fanout(GstElement *tee, guint workers)
+{
+  GstPad *sink = gst_element_get_static_pad(tee, "sink");
+  if (sink == NULL)
+    return NULL;
+
+  FanOut *fanout = new FanOut();
+  fanout->retired = g_array_new(FALSE, FALSE, sizeof(FanoutRetired));
+  g_mutex_init(&fanout->events_lock);
+  fanout->worker_count = CLAMP(workers, 1u, (guint)FANOUT_MAX_WORKERS);
+  for (guint i = 0; i < fanout->worker_count; i++)
+  {
+    FanoutWorker *worker = &fanout->workers[i];
+    worker->fanout = fanout;
+    g_mutex_init(&worker->list_lock);
+    worker->snapshot = g_ptr_array_new();
+    g_mutex_init(&worker->wake_lock);
+    g_cond_init(&worker->wake);
+    gchar *name = g_strdup_printf("fanout-%u", i);
+    worker->thread = g_thread_new(name, fanout_worker_run, worker);
+    g_free(name);
+  }
+
+  gst_pad_add_probe(sink,
+                    (GstPadProbeType)(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST |
+                                      GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+                    fanout_producer_probe_cb, fanout, NULL);
+  gst_object_unref(sink);
+
+  fanout->last_report_us = g_get_monotonic_time();
+  getrusage(RUSAGE_SELF, &fanout->last_usage);
+  g_timeout_add_seconds(FANOUT_REPORT_SECONDS, fanout_report_cb, fanout);
+  return fanout;
+}
+
+#endif // FAN_OUT_H
@@ -0,0 +1,140 @@
+#ifndef FORWARD_ERROR_CORRECTION_H
+#define FORWARD_ERROR_CORRECTION_H
+
+#include <glib.h>
+#include <gst/gst.h>
+
+#ifndef GST_USE_UNSTABLE_API
+#define GST_USE_UNSTABLE_API
+#endif
+#include <gst/webrtc/webrtc.h>
+
+#include <math.h>
+#include <string.h>
+
+// Forward error correction per viewer (--fec).
+//
+// NACK/RTX needs at least one round trip to repair a loss, more than a frame interval on a
+// high-RTT link. With FEC the video transceiver sends RED-wrapped media plus ULPFEC packets, XOR
+// parity over groups of media packets, and the browser rebuilds a lost packet from its group
+// without asking. webrtcbin inserts the encoder and offers red/ulpfec itself once the
+// transceiver's fec-type is set; its fec-percentage (FEC packets per 100 media packets) can be
+// changed while playing.
+//
+// Each viewer's percentage follows its loss rate from the ABR stats tick: FEC_LOSS_MULTIPLIER
+// parity packets per lost packet, so most groups see at most one loss, between FEC_FLOOR_PERCENTAGE
+// and --fec-max. Loss is smoothed, up quickly and down slowly, and the percentage moves in
+// FEC_STEP_PERCENTAGE steps so a noisy report doesn't reconfigure the encoder every second.
+// NACK/RTX stays on for what FEC can't repair.
+//
+// The viewer's bandwidth estimate covers everything it receives, parity included, so the share
+// FEC takes is charged before the estimate picks the viewer's rendition, layers or the encoder
+// bitrate.
+
+#define FEC_DEFAULT_MAX_PERCENTAGE 50
+#define FEC_FLOOR_PERCENTAGE 5  // covers an isolated loss before the first report
+#define FEC_STEP_PERCENTAGE 5
+#define FEC_LOSS_MULTIPLIER 3.0
+#define FEC_LOSS_RISE 0.5       // smoothing weight of a report above the current loss
+#define FEC_LOSS_FALL 0.1       // and of one below
+
+typedef enum
+{
+  FEC_MODE_OFF = 0,
+  FEC_MODE_ULPFEC, // RED + ULPFEC
+  FEC_MODE_COUNT
+} FecMode;
+
+static const gchar *fec_mode_names[FEC_MODE_COUNT] = {"off", "ulpfec"};
+
+// FlexFEC isn't offered: webrtcbin only builds RED/ULPFEC encoders.
+static gboolean
+fec_mode_from_string(const gchar *name, FecMode *mode)
+{
+  if (name == NULL)
+  {
+    *mode = FEC_MODE_OFF;
+    return TRUE;
+  }
+  for (gint i = 0; i < FEC_MODE_COUNT; i++)
+  {
+    if (g_ascii_strcasecmp(name, fec_mode_names[i]) == 0)
+    {
+      *mode = (FecMode)i;
+      return TRUE;
+    }
+  }
+  if (g_ascii_strcasecmp(name, "red") == 0)
+  {
+    *mode = FEC_MODE_ULPFEC;
+    return TRUE;
+  }
+  return FALSE;
+}
+
+// Per viewer, lives in the receiver entry.
+typedef struct
+{
+  gboolean enabled;     // the transceiver sends FEC
+  guint percentage;     // what the transceiver is set to
+  gdouble smoothed_loss; // 0..1
+} ViewerFec;
+
+static void
+viewer_fec_init(ViewerFec *fec)
+{
+  memset(fec, 0, sizeof(ViewerFec));
+  fec->percentage = FEC_FLOOR_PERCENTAGE;
+}
+
+// Turns FEC on for a video transceiver before negotiation. FALSE if this webrtcbin can't.
+static gboolean
+viewer_fec_configure(GstWebRTCRTPTransceiver *transceiver, ViewerFec *fec)
+{
+  if (!g_object_class_find_property(G_OBJECT_GET_CLASS(transceiver), "fec-type"))
+    return FALSE;
+
+  g_object_set(transceiver, "fec-type", GST_WEBRTC_FEC_TYPE_ULP_RED, "fec-percentage", fec->percentage, NULL);
+  fec->enabled = TRUE;
+  return TRUE;
+}
+
+// kbps the viewer receives per kbps of media. A ULPFEC packet is about as large as the largest
+// media packet it protects, so the packet percentage is close enough for bytes.
+static gdouble
+viewer_fec_overhead(const ViewerFec *fec)
+{
+  return fec->enabled ? 1.0 + fec->percentage / 100.0 : 1.0;
+}
+
+// Feeds one loss report (0..1). Returns TRUE if the percentage changed.
+static gboolean
+viewer_fec_update(ViewerFec *fec, gdouble loss, guint max_percentage)
+{
+  gdouble weight = loss > fec->smoothed_loss ? FEC_LOSS_RISE : FEC_LOSS_FALL;
+  fec->smoothed_loss += weight * (loss - fec->smoothed_loss);
+
+  gdouble wanted = fec->smoothed_loss * 100.0 * FEC_LOSS_MULTIPLIER;
+  guint percentage = (guint)ceil(wanted / FEC_STEP_PERCENTAGE) * FEC_STEP_PERCENTAGE;
+  percentage = CLAMP(percentage, (guint)FEC_FLOOR_PERCENTAGE, MAX(max_percentage, (guint)FEC_FLOOR_PERCENTAGE));
+  if (percentage == fec->percentage)
+    return FALSE;
+
+  fec->percentage = percentage;
+  return TRUE;
+}
+
+// Applies the viewer's percentage to its video transceiver (the first one).
+static void
+viewer_fec_apply(GstElement *webrtcbin, const ViewerFec *fec)
+{
+  GstWebRTCRTPTransceiver *transceiver = NULL;
+  g_signal_emit_by_name(webrtcbin, "get-transceiver", 0, &transceiver);
+  if (transceiver == NULL)
+    return;
+
+  g_object_set(transceiver, "fec-percentage", fec->percentage, NULL);
+  gst_object_unref(transceiver);
+}
+
+#endif // FORWARD_ERROR_CORRECTION_H
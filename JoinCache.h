@@ -0,0 +1,380 @@
+#ifndef JOIN_CACHE_H
+#define JOIN_CACHE_H
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <gst/rtp/gstrtpbuffer.h>
+
+#ifndef GST_USE_UNSTABLE_API
+#define GST_USE_UNSTABLE_API
+#endif
+#include <gst/webrtc/webrtc.h>
+
+#include "TemporalLayers.h"
+
+// Join cache (--join-cache): a first picture as soon as a viewer can receive one.
+//
+// A new viewer gets nothing it can decode until the next keyframe. The IDR requested when it
+// connects (KeyframeControl.h) still takes a keyframe window plus an encode. A probe on the tee's
+// sink pad keeps the newest keyframe, all buffers of that frame with the parameter sets the parser
+// puts in front of it, by reference. When the viewer's peer connection is up (ICE and DTLS), its
+// next frame is preceded by a copy of it:
+// - timestamps are rewritten to just before that frame, so the browser plays it out now;
+// - on the single-encoder RTP stream the copy takes the sequence numbers (and VP8 picture IDs)
+//   from that frame on; like every packet, it gets its abs-send-time in front of webrtcbin.
+//   With simulcast the cached frame is encoded video and the viewer's own payloader numbers it.
+// The live delta frames that follow reference pictures the viewer never got, so they are held
+// back until the next keyframe, normally the IDR requested on connect. Everything after the copy
+// is renumbered across the held frames, so the browser sees a gapless stream showing the cached
+// picture until the keyframe.
+
+#define JOIN_CACHE_MAX_BYTES (4 * 1024 * 1024)  // a larger keyframe isn't cached
+
+typedef struct
+{
+  gboolean rtp;                // packets (single encoder) rather than encoded frames (simulcast)
+  gboolean vp8;
+
+  GMutex lock;
+  GstBufferList *keyframe;     // newest complete keyframe, NULL before the first
+  gint64 captured_us;
+
+  // Only the tee's streaming thread
+  GstBufferList *collecting;
+  gsize collecting_bytes;
+  GstClockTime last_pts;
+} JoinCache;
+
+// Set on RTP packets too, by the keyframe marker on the payloader (KeyframeControl.h).
+static gboolean
+join_cache_is_keyframe(GstBuffer *buffer)
+{
+  return !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+}
+
+static void
+join_cache_add(JoinCache *cache, GstBuffer *buffer)
+{
+  GstClockTime pts = GST_BUFFER_PTS(buffer);
+
+  if (pts != cache->last_pts)
+  {
+    cache->last_pts = pts;
+    if (cache->collecting != NULL)
+    {
+      g_mutex_lock(&cache->lock);
+      if (cache->keyframe != NULL)
+        gst_buffer_list_unref(cache->keyframe);
+      cache->keyframe = cache->collecting;
+      cache->captured_us = g_get_monotonic_time();
+      g_mutex_unlock(&cache->lock);
+      cache->collecting = NULL;
+    }
+
+    if (join_cache_is_keyframe(buffer))
+    {
+      cache->collecting = gst_buffer_list_new();
+      cache->collecting_bytes = 0;
+    }
+  }
+
+  if (cache->collecting == NULL)
+    return;
+
+  cache->collecting_bytes += gst_buffer_get_size(buffer);
+  if (cache->collecting_bytes > JOIN_CACHE_MAX_BYTES)
+  {
+    gst_buffer_list_unref(cache->collecting);
+    cache->collecting = NULL;
+    return;
+  }
+  gst_buffer_list_add(cache->collecting, gst_buffer_ref(buffer));
+}
+
+static GstPadProbeReturn
+join_cache_probe_cb(G_GNUC_UNUSED GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  JoinCache *cache = (JoinCache *)user_data;
+
+  if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+  {
+    GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+    guint length = gst_buffer_list_length(list);
+    for (guint i = 0; i < length; i++)
+      join_cache_add(cache, gst_buffer_list_get(list, i));
+  }
+  else
+  {
+    join_cache_add(cache, GST_PAD_PROBE_INFO_BUFFER(info));
+  }
+  return GST_PAD_PROBE_OK;
+}
+
+// Caches the keyframes going into tee. Lives until exit, like the pipeline.
+static JoinCache *
+attach_join_cache(GstElement *tee, gboolean rtp, gboolean vp8)
+{
+  GstPad *sink = gst_element_get_static_pad(tee, "sink");
+  if (sink == NULL)
+    return NULL;
+
+  JoinCache *cache = g_new0(JoinCache, 1);
+  g_mutex_init(&cache->lock);
+  cache->rtp = rtp;
+  cache->vp8 = vp8;
+  cache->last_pts = GST_CLOCK_TIME_NONE;
+
+  gst_pad_add_probe(sink, (GstPadProbeType)(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                    join_cache_probe_cb, cache, NULL);
+  gst_object_unref(sink);
+  return cache;
+}
+
+// A reference to the cached keyframe, or NULL.
+static GstBufferList *
+join_cache_get(JoinCache *cache, gint64 *age_us)
+{
+  g_mutex_lock(&cache->lock);
+  GstBufferList *keyframe = cache->keyframe ? gst_buffer_list_ref(cache->keyframe) : NULL;
+  *age_us = g_get_monotonic_time() - cache->captured_us;
+  g_mutex_unlock(&cache->lock);
+  return keyframe;
+}
+
+// Per viewer, shared by the probe on its video sink pad and the connection-state handler.
+typedef struct
+{
+  JoinCache *cache;
+  gchar *label;
+  gint pending;           // the peer connection came up, replay before the next frame
+  gint enabled;           // cleared once the viewer leaves the cached encoder
+
+  // Only the streaming thread into the viewer
+  gboolean injecting;     // our own copy is going through the probe
+  GstClockTime last_pts;
+  gboolean holding;       // dropping live frames until a keyframe
+  gboolean dropping_frame;
+  guint held_frames;
+  guint16 seq_offset;     // added to every live packet after a replay
+  guint16 picture_offset; // VP8 picture ID, the same
+} JoinReplay;
+
+static void
+join_replay_clear(gpointer data)
+{
+  g_free(((JoinReplay *)data)->label);
+}
+
+static void
+join_replay_release(gpointer replay)
+{
+  g_atomic_rc_box_release_full(replay, join_replay_clear);
+}
+
+// The cached keyframe, timestamped just before live and, on RTP, numbered from its sequence number
+// and picture ID.
+static GstBufferList *
+join_replay_copy(JoinReplay *replay, GstBufferList *keyframe, GstBuffer *live)
+{
+  guint32 live_ts = 0;
+  guint16 live_seq = 0;
+  guint16 picture_shift = 0; // cached picture ID minus the one it takes over
+
+  if (replay->cache->rtp)
+  {
+    GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+    if (!gst_rtp_buffer_map(live, GST_MAP_READ, &rtp))
+      return NULL;
+    live_ts = gst_rtp_buffer_get_timestamp(&rtp);
+    live_seq = gst_rtp_buffer_get_seq(&rtp) + replay->seq_offset;
+    gst_rtp_buffer_unmap(&rtp);
+
+    guint16 live_picture, cached_picture;
+    if (replay->cache->vp8 && rtp_vp8_picture_id(live, &live_picture) &&
+        rtp_vp8_picture_id(gst_buffer_list_get(keyframe, 0), &cached_picture))
+      picture_shift = cached_picture - (guint16)(live_picture + replay->picture_offset);
+  }
+
+  GstClockTime pts = GST_BUFFER_PTS_IS_VALID(live) && GST_BUFFER_PTS(live) > 0 ? GST_BUFFER_PTS(live) - 1
+                                                                                : GST_BUFFER_PTS(live);
+  GstBufferList *copy = gst_buffer_list_copy_deep(keyframe);
+  guint length = gst_buffer_list_length(copy);
+  for (guint i = 0; i < length; i++)
+  {
+    GstBuffer *buffer = gst_buffer_list_get_writable(copy, i);
+    GST_BUFFER_PTS(buffer) = pts;
+    GST_BUFFER_DTS(buffer) = GST_CLOCK_TIME_NONE;
+    if (!replay->cache->rtp)
+      continue;
+
+    GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+    if (gst_rtp_buffer_map(buffer, GST_MAP_READWRITE, &rtp))
+    {
+      gst_rtp_buffer_set_seq(&rtp, live_seq + i);
+      gst_rtp_buffer_set_timestamp(&rtp, live_ts - 1);
+      gst_rtp_buffer_unmap(&rtp);
+    }
+    rtp_close_dropped_gap(buffer, 0, picture_shift, replay->cache->vp8);
+  }
+  return copy;
+}
+
+static void
+join_replay_inject(JoinReplay *replay, GstPad *pad, GstBuffer *live)
+{
+  gint64 age_us = 0;
+  GstBufferList *keyframe = join_cache_get(replay->cache, &age_us);
+  if (keyframe == NULL)
+    return;
+
+  GstBufferList *copy = join_replay_copy(replay, keyframe, live);
+  gst_buffer_list_unref(keyframe);
+  if (copy == NULL)
+    return;
+
+  guint length = gst_buffer_list_length(copy);
+  gsize bytes = gst_buffer_list_calculate_size(copy);
+  replay->injecting = TRUE;
+  GstFlowReturn ret = gst_pad_chain_list(pad, copy);
+  replay->injecting = FALSE;
+  if (ret != GST_FLOW_OK)
+    return;
+
+  if (replay->cache->rtp)
+  {
+    replay->seq_offset += length;
+    replay->picture_offset++;
+  }
+  replay->holding = TRUE;
+  g_print("⚡ %s: sent the cached keyframe on connect (%u %s, %zu KB, %" G_GINT64_FORMAT " ms old)\n",
+          replay->label, length, replay->cache->rtp ? "packets" : "buffers", bytes / 1024, age_us / 1000);
+}
+
+// Decides on one live buffer after the replay. Returns FALSE to drop it; may replace *buffer with
+// a renumbered copy.
+static gboolean
+join_replay_filter_buffer(JoinReplay *replay, GstBuffer **buffer)
+{
+  GstClockTime pts = GST_BUFFER_PTS(*buffer);
+  if (pts != replay->last_pts)
+  {
+    replay->last_pts = pts;
+    if (replay->holding && (join_cache_is_keyframe(*buffer) || !g_atomic_int_get(&replay->enabled)))
+    {
+      replay->holding = FALSE;
+      g_print("⚡ %s: live from the next keyframe on, %u frames held back\n", replay->label, replay->held_frames);
+    }
+    replay->dropping_frame = replay->holding;
+    if (replay->dropping_frame)
+    {
+      replay->held_frames++;
+      replay->picture_offset--;
+    }
+  }
+
+  if (replay->dropping_frame)
+  {
+    replay->seq_offset--;
+    return FALSE;
+  }
+
+  if (!replay->cache->rtp || (replay->seq_offset == 0 && replay->picture_offset == 0))
+    return TRUE;
+
+  *buffer = gst_buffer_make_writable(*buffer);
+  rtp_close_dropped_gap(*buffer, (guint16)-replay->seq_offset, (guint16)-replay->picture_offset, replay->cache->vp8);
+  return TRUE;
+}
+
+static GstPadProbeReturn
+join_replay_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  JoinReplay *replay = (JoinReplay *)user_data;
+  gboolean is_list = (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST) != 0;
+
+  if (replay->injecting)
+    return GST_PAD_PROBE_OK;
+
+  GstBuffer *first = is_list ? gst_buffer_list_get(GST_PAD_PROBE_INFO_BUFFER_LIST(info), 0)
+                             : GST_PAD_PROBE_INFO_BUFFER(info);
+  if (first == NULL)
+    return GST_PAD_PROBE_OK;
+
+  // Only in front of a new frame, never inside one
+  if (GST_BUFFER_PTS(first) != replay->last_pts && g_atomic_int_get(&replay->pending))
+  {
+    g_atomic_int_set(&replay->pending, FALSE);
+    if (g_atomic_int_get(&replay->enabled))
+      join_replay_inject(replay, pad, first);
+  }
+
+  if (is_list)
+  {
+    GstBufferList *list = gst_buffer_list_make_writable(GST_PAD_PROBE_INFO_BUFFER_LIST(info));
+    for (guint i = 0; i < gst_buffer_list_length(list);)
+    {
+      GstBuffer *packet = gst_buffer_ref(gst_buffer_list_get(list, i));
+      gst_buffer_list_remove(list, i, 1);
+      if (join_replay_filter_buffer(replay, &packet))
+        gst_buffer_list_insert(list, i++, packet);
+      else
+        gst_buffer_unref(packet);
+    }
+    GST_PAD_PROBE_INFO_DATA(info) = list;
+    return gst_buffer_list_length(list) > 0 ? GST_PAD_PROBE_OK : GST_PAD_PROBE_DROP;
+  }
+
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+  if (!join_replay_filter_buffer(replay, &buffer))
+    return GST_PAD_PROBE_DROP;
+
+  GST_PAD_PROBE_INFO_DATA(info) = buffer;
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+join_replay_connection_state_cb(GstElement *webrtcbin, G_GNUC_UNUSED GParamSpec *pspec, gpointer user_data)
+{
+  GstWebRTCPeerConnectionState state;
+
+  g_object_get(webrtcbin, "connection-state", &state, NULL);
+  if (state == GST_WEBRTC_PEER_CONNECTION_STATE_CONNECTED)
+    g_atomic_int_set(&((JoinReplay *)user_data)->pending, TRUE);
+}
+
+// Replays the cache into pad, the viewer's video sink, once webrtcbin is connected. Must be the
+// first probe on pad, so later filters see the copy like live video.
+static JoinReplay *
+attach_join_replay(JoinCache *cache, GstPad *pad, GstElement *webrtcbin)
+{
+  JoinReplay *replay = g_atomic_rc_box_new0(JoinReplay);
+  replay->cache = cache;
+  replay->enabled = TRUE;
+  replay->last_pts = GST_CLOCK_TIME_NONE;
+
+  gst_pad_add_probe(pad, (GstPadProbeType)(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                    join_replay_probe_cb, g_atomic_rc_box_acquire(replay), join_replay_release);
+  g_signal_connect_data(webrtcbin, "notify::connection-state", G_CALLBACK(join_replay_connection_state_cb),
+                        g_atomic_rc_box_acquire(replay), (GClosureNotify)join_replay_release, (GConnectFlags)0);
+  return replay;
+}
+
+// Names the viewer in the log. Call before video can reach pad; a pooled viewer gets it on connect.
+static void
+join_replay_set_label(JoinReplay *replay, const gchar *label)
+{
+  if (replay == NULL)
+    return;
+  g_free(replay->label);
+  replay->label = g_strdup(label);
+}
+
+// The viewer moved to an encoder whose keyframes aren't cached.
+static void
+join_replay_disable(JoinReplay *replay)
+{
+  if (replay != NULL)
+    g_atomic_int_set(&replay->enabled, FALSE);
+}
+
+#endif // JOIN_CACHE_H
@@ -0,0 +1,360 @@
+#ifndef KEYFRAME_CONTROL_H
+#define KEYFRAME_CONTROL_H
+
+#include <glib.h>
+#include <gst/gst.h>
+
+#ifndef GST_USE_UNSTABLE_API
+#define GST_USE_UNSTABLE_API
+#endif
+#include <gst/webrtc/webrtc.h>
+
+#include "EncoderBackend.h"
+
+// On-demand keyframes for the shared encoder.
+//
+// The encoder runs with a long GOP (--gop frames, a safety net for the plain UDP client, which
+// cannot ask for anything). Viewers get an IDR when they connect and whenever their webrtcbin
+// receives a PLI/FIR, which arrives at the encoder as an upstream GstForceKeyUnit event. With
+// several viewers those requests pile up, so they are coalesced at the encoder src pad:
+//  - while a forced IDR is on its way, further requests are dropped, it serves them all;
+//  - within --keyframe-window ms of the last forced IDR, requests are dropped and one deferred
+//    IDR is sent when the window ends, so a viewer that lost the previous one still gets one.
+// That bounds forced IDRs to one per window no matter how many viewers ask.
+//
+// RTP packets don't carry the encoder's DELTA_UNIT flag through every payloader, so a probe pair
+// on the shared payloader (attach_keyframe_marker) sets it on each packet from the frame it was
+// cut from: cleared on all packets of a keyframe, set on the rest. Anything downstream, however
+// far behind, tells keyframes by the flag.
+
+#define KEYFRAME_DEFAULT_GOP 600          // frames, 10 s at 60 fps
+#define KEYFRAME_DEFAULT_WINDOW_MS 500
+#define KEYFRAME_REPORT_SECONDS 10
+#define KEYFRAME_EVENT_NAME "GstForceKeyUnit"
+#define KEYFRAME_OWN_EVENT_FIELD "keyframe-control" // marks events sent by us, not counted again
+
+typedef struct
+{
+  GMutex lock;
+  GstPad *encoder_src_pad;
+  gint window_ms;
+  gint64 last_forced_us;
+  gboolean pending;        // forced IDR requested, not seen at the encoder output yet
+  guint deferred_source;   // timeout sending the deferred IDR, 0 if none
+  guint64 requested;       // PLI/FIR from viewers plus joins
+  guint64 forced;          // requests let through to the encoder
+  guint64 coalesced;       // requests served by another IDR
+  guint64 produced;        // keyframes out of the encoder, forced or periodic
+  GstClockTime last_keyframe_pts; // with slice output one keyframe spans several buffers
+  gint64 last_report_us;
+} KeyframeControl;
+
+static GstEvent *
+keyframe_control_new_event()
+{
+  return gst_event_new_custom(GST_EVENT_CUSTOM_UPSTREAM,
+                              gst_structure_new(KEYFRAME_EVENT_NAME,
+                                                "running-time", G_TYPE_UINT64, GST_CLOCK_TIME_NONE,
+                                                "all-headers", G_TYPE_BOOLEAN, TRUE,
+                                                "count", G_TYPE_UINT, 0,
+                                                KEYFRAME_OWN_EVENT_FIELD, G_TYPE_BOOLEAN, TRUE,
+                                                NULL));
+}
+
+// The encoder src pad changes on a live profile switch; take a ref under the lock.
+static GstPad *
+keyframe_control_get_pad_locked(KeyframeControl *control)
+{
+  return (GstPad *)gst_object_ref(control->encoder_src_pad);
+}
+
+static void
+keyframe_control_send(GstPad *encoder_src_pad)
+{
+  gst_pad_send_event(encoder_src_pad, keyframe_control_new_event());
+  gst_object_unref(encoder_src_pad);
+}
+
+static gboolean
+keyframe_control_deferred_cb(gpointer user_data)
+{
+  KeyframeControl *control = (KeyframeControl *)user_data;
+
+  g_mutex_lock(&control->lock);
+  control->deferred_source = 0;
+  control->last_forced_us = g_get_monotonic_time();
+  control->pending = TRUE;
+  control->forced++;
+  GstPad *pad = keyframe_control_get_pad_locked(control);
+  g_mutex_unlock(&control->lock);
+
+  keyframe_control_send(pad);
+  return G_SOURCE_REMOVE;
+}
+
+// Counts one request and decides whether it reaches the encoder. Called with the lock held.
+static gboolean
+keyframe_control_admit_locked(KeyframeControl *control)
+{
+  gint64 now = g_get_monotonic_time();
+  gint64 since_forced = now - control->last_forced_us;
+  gint64 window_us = (gint64)control->window_ms * 1000;
+
+  control->requested++;
+
+  // A forced IDR is on its way and serves this request too. If the encoder ignored it, the
+  // next request after the window goes through again.
+  if (control->pending && since_forced < window_us)
+  {
+    control->coalesced++;
+    return FALSE;
+  }
+
+  if (since_forced < window_us)
+  {
+    control->coalesced++;
+    if (control->deferred_source == 0)
+      control->deferred_source = g_timeout_add((guint)((window_us - since_forced) / 1000) + 1,
+                                               keyframe_control_deferred_cb, control);
+    return FALSE;
+  }
+
+  control->last_forced_us = now;
+  control->pending = TRUE;
+  control->forced++;
+  return TRUE;
+}
+
+// Asks for an IDR from application code, e.g. when a viewer has connected.
+static void
+keyframe_control_request(KeyframeControl *control)
+{
+  if (control == NULL)
+    return;
+
+  g_mutex_lock(&control->lock);
+  GstPad *pad = keyframe_control_admit_locked(control) ? keyframe_control_get_pad_locked(control) : NULL;
+  g_mutex_unlock(&control->lock);
+
+  if (pad != NULL)
+    keyframe_control_send(pad);
+}
+
+static gboolean
+keyframe_control_request_idle_cb(gpointer user_data)
+{
+  keyframe_control_request((KeyframeControl *)user_data);
+  return G_SOURCE_REMOVE;
+}
+
+// The same from a streaming thread, which shouldn't send events up into the encoder itself.
+static void
+keyframe_control_request_async(KeyframeControl *control)
+{
+  if (control != NULL)
+    g_idle_add(keyframe_control_request_idle_cb, control);
+}
+
+static GstPadProbeReturn
+keyframe_control_event_probe_cb(G_GNUC_UNUSED GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  KeyframeControl *control = (KeyframeControl *)user_data;
+  GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+
+  if (GST_EVENT_TYPE(event) != GST_EVENT_CUSTOM_UPSTREAM || !gst_event_has_name(event, KEYFRAME_EVENT_NAME))
+    return GST_PAD_PROBE_OK;
+
+  // Already admitted by keyframe_control_request() or the deferred timer
+  if (gst_structure_has_field(gst_event_get_structure(event), KEYFRAME_OWN_EVENT_FIELD))
+    return GST_PAD_PROBE_OK;
+
+  g_mutex_lock(&control->lock);
+  gboolean admit = keyframe_control_admit_locked(control);
+  g_mutex_unlock(&control->lock);
+
+  return admit ? GST_PAD_PROBE_OK : GST_PAD_PROBE_DROP;
+}
+
+static GstPadProbeReturn
+keyframe_control_buffer_probe_cb(G_GNUC_UNUSED GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  KeyframeControl *control = (KeyframeControl *)user_data;
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+  gint64 now = g_get_monotonic_time();
+
+  g_mutex_lock(&control->lock);
+  if (!GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT) &&
+      GST_BUFFER_PTS(buffer) != control->last_keyframe_pts)
+  {
+    control->produced++;
+    control->pending = FALSE;
+    control->last_keyframe_pts = GST_BUFFER_PTS(buffer);
+  }
+
+  if (now - control->last_report_us >= KEYFRAME_REPORT_SECONDS * G_USEC_PER_SEC)
+  {
+    g_print("🔑 Keyframes: requested %" G_GUINT64_FORMAT ", forced %" G_GUINT64_FORMAT
+            ", coalesced %" G_GUINT64_FORMAT ", produced %" G_GUINT64_FORMAT " (window %d ms)\n",
+            control->requested, control->forced, control->coalesced, control->produced,
+            control->window_ms);
+    control->last_report_us = now;
+  }
+  g_mutex_unlock(&control->lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+keyframe_control_add_probes(KeyframeControl *control, GstPad *encoder_src_pad)
+{
+  gst_pad_add_probe(encoder_src_pad, GST_PAD_PROBE_TYPE_EVENT_UPSTREAM,
+                    keyframe_control_event_probe_cb, control, NULL);
+  gst_pad_add_probe(encoder_src_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                    keyframe_control_buffer_probe_cb, control, NULL);
+}
+
+// Installs the coalescing probes on the named encoder. Returns NULL if the encoder isn't found.
+// The control lives as long as the pipeline, which lives until exit.
+static KeyframeControl *
+attach_keyframe_control(GstElement *pipeline, const gchar *encoder_name, gint window_ms)
+{
+  GstElement *encoder = gst_bin_get_by_name(GST_BIN(pipeline), encoder_name);
+  if (encoder == NULL)
+  {
+    g_print("⚠ Encoder element not found, keyframe requests are not coalesced\n");
+    return NULL;
+  }
+
+  KeyframeControl *control = g_new0(KeyframeControl, 1);
+  g_mutex_init(&control->lock);
+  control->encoder_src_pad = gst_element_get_static_pad(encoder, "src");
+  control->window_ms = window_ms;
+  control->last_keyframe_pts = GST_CLOCK_TIME_NONE;
+  control->last_report_us = g_get_monotonic_time();
+  gst_object_unref(encoder);
+
+  keyframe_control_add_probes(control, control->encoder_src_pad);
+  return control;
+}
+
+// Moves the control to a replacement encoder after a live profile switch. The probes on the
+// old encoder go away with it; the new one starts with an IDR, nothing is pending any more.
+static void
+keyframe_control_retarget(KeyframeControl *control, GstElement *encoder)
+{
+  if (control == NULL)
+    return;
+
+  GstPad *src_pad = gst_element_get_static_pad(encoder, "src");
+  g_mutex_lock(&control->lock);
+  GstPad *old_pad = control->encoder_src_pad;
+  control->encoder_src_pad = src_pad;
+  control->pending = FALSE;
+  g_mutex_unlock(&control->lock);
+  gst_object_unref(old_pad);
+
+  keyframe_control_add_probes(control, src_pad);
+}
+
+static void
+keyframe_control_connection_state_cb(GstElement *webrtcbin, G_GNUC_UNUSED GParamSpec *pspec, gpointer user_data)
+{
+  GstWebRTCPeerConnectionState state;
+
+  g_object_get(webrtcbin, "connection-state", &state, NULL);
+  if (state == GST_WEBRTC_PEER_CONNECTION_STATE_CONNECTED)
+    keyframe_control_request((KeyframeControl *)user_data);
+}
+
+// A viewer that just connected needs an IDR to start decoding; don't make it wait for the GOP.
+static void
+keyframe_control_watch_viewer(KeyframeControl *control, GstElement *webrtcbin)
+{
+  if (control == NULL)
+    return;
+
+  g_signal_connect(webrtcbin, "notify::connection-state",
+                   G_CALLBACK(keyframe_control_connection_state_cb), control);
+}
+
+// The payloader's own streaming thread: its packets are pushed while the frame they come from is
+// in its chain function, so the newest keyframe PTS at its input is the one to compare against.
+typedef struct
+{
+  GstClockTime keyframe_pts;
+} KeyframeMarker;
+
+static GstPadProbeReturn
+keyframe_marker_sink_probe_cb(G_GNUC_UNUSED GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  KeyframeMarker *marker = (KeyframeMarker *)user_data;
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+  if (!GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+    marker->keyframe_pts = GST_BUFFER_PTS(buffer);
+  return GST_PAD_PROBE_OK;
+}
+
+static GstBuffer *
+keyframe_marker_mark(KeyframeMarker *marker, GstBuffer *buffer)
+{
+  gboolean keyframe = GST_BUFFER_PTS_IS_VALID(buffer) && GST_BUFFER_PTS(buffer) == marker->keyframe_pts;
+  if (keyframe != GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+    return buffer;
+
+  buffer = gst_buffer_make_writable(buffer);
+  if (keyframe)
+    GST_BUFFER_FLAG_UNSET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+  else
+    GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+  return buffer;
+}
+
+static gboolean
+keyframe_marker_mark_list_cb(GstBuffer **buffer, G_GNUC_UNUSED guint idx, gpointer user_data)
+{
+  *buffer = keyframe_marker_mark((KeyframeMarker *)user_data, *buffer);
+  return TRUE;
+}
+
+static GstPadProbeReturn
+keyframe_marker_src_probe_cb(G_GNUC_UNUSED GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  KeyframeMarker *marker = (KeyframeMarker *)user_data;
+
+  if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+  {
+    GstBufferList *list = gst_buffer_list_make_writable(GST_PAD_PROBE_INFO_BUFFER_LIST(info));
+    gst_buffer_list_foreach(list, keyframe_marker_mark_list_cb, marker);
+    GST_PAD_PROBE_INFO_DATA(info) = list;
+  }
+  else
+  {
+    GST_PAD_PROBE_INFO_DATA(info) = keyframe_marker_mark(marker, GST_PAD_PROBE_INFO_BUFFER(info));
+  }
+  return GST_PAD_PROBE_OK;
+}
+
+// Marks keyframe packets on the named payloader's output. The payloader stays across live
+// profile switches, so this is done once; the marker lives until exit, like the pipeline.
+static void
+attach_keyframe_marker(GstElement *pipeline, const gchar *payloader_name)
+{
+  GstElement *payloader = gst_bin_get_by_name(GST_BIN(pipeline), payloader_name);
+  if (payloader == NULL)
+    return;
+
+  KeyframeMarker *marker = g_new0(KeyframeMarker, 1);
+  marker->keyframe_pts = GST_CLOCK_TIME_NONE;
+
+  GstPad *sink = gst_element_get_static_pad(payloader, "sink");
+  gst_pad_add_probe(sink, GST_PAD_PROBE_TYPE_BUFFER, keyframe_marker_sink_probe_cb, marker, NULL);
+  gst_object_unref(sink);
+  GstPad *src = gst_element_get_static_pad(payloader, "src");
+  gst_pad_add_probe(src, (GstPadProbeType)(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                    keyframe_marker_src_probe_cb, marker, NULL);
+  gst_object_unref(src);
+  gst_object_unref(payloader);
+}
+
+#endif // KEYFRAME_CONTROL_H
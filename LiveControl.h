@@ -0,0 +1,382 @@
+#ifndef LIVE_CONTROL_H
+#define LIVE_CONTROL_H
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <libsoup/soup.h>
+#include <json-glib/json-glib.h>
+#include <string.h>
+#include <atomic>
+
+#include "EncoderBackend.h"
+#include "ProfileSwitch.h"
+
+// Live parameter changes for a running StreamingProgram.
+//
+// WebControlServer POSTs {"bitrate": kbps, "fps": n} to http://127.0.0.1:8081/control on the
+// signaling server instead of restarting the process. The encoder bitrate and the videorate
+// max-rate are changed in place, so the pipeline and every ReceiverEntry stay up. The reply
+// carries how long the property change took and how long until the next encoded frame left
+// the encoder, which is when the new settings are actually in effect.
+//
+// {"width": w, "height": h} switches the capture and encoder to a new resolution at an IDR (see
+// ProfileSwitch.h); the reply then carries the switch gap instead. Bitrate and fps sent along
+// are applied to the new encoder.
+
+#define LIVE_CONTROL_PATH "/control"
+#define LIVE_CONTROL_TIMEOUT_MS 1000
+
+typedef struct
+{
+  GstElement *pipeline;
+  const EncoderBackend *backend;
+  int *bitrate; // program's current bitrate (kbps), updated on success
+  int *fps;     // program's current max fps, updated on success
+  ProfileSwitch *profile; // NULL if the resolution can't change live (simulcast)
+} LiveControl;
+
+// One in-flight /control request. The encoder sink probe remembers the PTS of the first raw
+// frame that reaches the encoder after the change, the src probe timestamps the encoded frame
+// with that PTS. Freed by the last probe destroy notify, which GStreamer calls once the probe
+// is removed and no longer running.
+typedef struct
+{
+  SoupServer *server;
+  SoupMessage *message;
+  gint64 request_us;
+  gint64 set_us;
+  std::atomic<GstClockTime> first_input_pts;
+  std::atomic<gint64> first_frame_us;
+  std::atomic<int> refs;
+  int bitrate;
+  int fps;
+  gboolean success;
+  GstPad *encoder_sink_pad;
+  GstPad *encoder_src_pad;
+  gulong sink_probe_id;
+  gulong src_probe_id;
+} LiveControlRequest;
+
+static void
+send_live_control_reply(SoupMessage *message, guint status, gboolean success, const gchar *text,
+                        int bitrate, int fps, gint64 set_us, gint64 first_frame_us)
+{
+  JsonBuilder *builder = json_builder_new();
+  json_builder_begin_object(builder);
+  json_builder_set_member_name(builder, "success");
+  json_builder_add_boolean_value(builder, success);
+  json_builder_set_member_name(builder, "message");
+  json_builder_add_string_value(builder, text);
+  json_builder_set_member_name(builder, "bitrate");
+  json_builder_add_int_value(builder, bitrate);
+  json_builder_set_member_name(builder, "fps");
+  json_builder_add_int_value(builder, fps);
+  json_builder_set_member_name(builder, "set_us");
+  json_builder_add_int_value(builder, set_us);
+  json_builder_set_member_name(builder, "first_frame_ms");
+  json_builder_add_double_value(builder, first_frame_us >= 0 ? first_frame_us / 1000.0 : -1.0);
+  json_builder_end_object(builder);
+
+  JsonGenerator *generator = json_generator_new();
+  JsonNode *root = json_builder_get_root(builder);
+  json_generator_set_root(generator, root);
+  gchar *json_str = json_generator_to_data(generator, NULL);
+
+  soup_message_set_response(message, "application/json", SOUP_MEMORY_TAKE, json_str, strlen(json_str));
+  soup_message_set_status(message, status);
+
+  json_node_free(root);
+  g_object_unref(generator);
+  g_object_unref(builder);
+}
+
+// One in-flight resolution change, replied to when the switch is over.
+typedef struct
+{
+  LiveControl *control;
+  SoupServer *server;
+  SoupMessage *message;
+  int bitrate;
+  int fps;
+} LiveProfileRequest;
+
+static void
+send_live_profile_reply(SoupMessage *message, guint status, gboolean success, const gchar *text,
+                        int width, int height, int bitrate, int fps, gint64 gap_us, gint64 ready_us)
+{
+  JsonBuilder *builder = json_builder_new();
+  json_builder_begin_object(builder);
+  json_builder_set_member_name(builder, "success");
+  json_builder_add_boolean_value(builder, success);
+  json_builder_set_member_name(builder, "message");
+  json_builder_add_string_value(builder, text);
+  json_builder_set_member_name(builder, "width");
+  json_builder_add_int_value(builder, width);
+  json_builder_set_member_name(builder, "height");
+  json_builder_add_int_value(builder, height);
+  json_builder_set_member_name(builder, "bitrate");
+  json_builder_add_int_value(builder, bitrate);
+  json_builder_set_member_name(builder, "fps");
+  json_builder_add_int_value(builder, fps);
+  json_builder_set_member_name(builder, "switch_gap_ms");
+  json_builder_add_double_value(builder, gap_us >= 0 ? gap_us / 1000.0 : -1.0);
+  json_builder_set_member_name(builder, "first_frame_ms");
+  json_builder_add_double_value(builder, ready_us >= 0 ? ready_us / 1000.0 : -1.0);
+  json_builder_end_object(builder);
+
+  JsonGenerator *generator = json_generator_new();
+  JsonNode *root = json_builder_get_root(builder);
+  json_generator_set_root(generator, root);
+  gchar *json_str = json_generator_to_data(generator, NULL);
+
+  soup_message_set_response(message, "application/json", SOUP_MEMORY_TAKE, json_str, strlen(json_str));
+  soup_message_set_status(message, status);
+
+  json_node_free(root);
+  g_object_unref(generator);
+  g_object_unref(builder);
+}
+
+static void
+live_profile_done_cb(gboolean success, const gchar *text, gint64 gap_us, gint64 ready_us, gpointer user_data)
+{
+  LiveProfileRequest *request = (LiveProfileRequest *)user_data;
+  LiveControl *control = request->control;
+
+  // The new encoder and videorate were built with these
+  if (success)
+  {
+    *control->bitrate = request->bitrate;
+    *control->fps = request->fps;
+  }
+
+  send_live_profile_reply(request->message, success ? SOUP_STATUS_OK : SOUP_STATUS_GATEWAY_TIMEOUT, success, text,
+                          *control->profile->width, *control->profile->height,
+                          *control->bitrate, *control->fps, gap_us, ready_us);
+  soup_server_unpause_message(request->server, request->message);
+  g_free(request);
+}
+
+static GstPadProbeReturn
+live_control_input_probe_cb(G_GNUC_UNUSED GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  LiveControlRequest *request = (LiveControlRequest *)user_data;
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+  GstClockTime unset = GST_CLOCK_TIME_NONE;
+
+  if (GST_BUFFER_PTS_IS_VALID(buffer))
+    request->first_input_pts.compare_exchange_strong(unset, GST_BUFFER_PTS(buffer));
+
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+live_control_output_probe_cb(G_GNUC_UNUSED GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  LiveControlRequest *request = (LiveControlRequest *)user_data;
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+  GstClockTime first_input = request->first_input_pts.load();
+  gint64 unset = 0;
+
+  if (first_input != GST_CLOCK_TIME_NONE && GST_BUFFER_PTS_IS_VALID(buffer) &&
+      GST_BUFFER_PTS(buffer) >= first_input)
+    request->first_frame_us.compare_exchange_strong(unset, g_get_monotonic_time());
+
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+live_control_request_unref(gpointer user_data)
+{
+  LiveControlRequest *request = (LiveControlRequest *)user_data;
+
+  if (--request->refs > 0)
+    return;
+
+  gst_object_unref(request->encoder_sink_pad);
+  gst_object_unref(request->encoder_src_pad);
+  delete request;
+}
+
+// Polled from the main loop until the first post-change frame is seen or the request times out.
+static gboolean
+live_control_poll_cb(gpointer user_data)
+{
+  LiveControlRequest *request = (LiveControlRequest *)user_data;
+  gint64 first_frame = request->first_frame_us.load();
+  gint64 now = g_get_monotonic_time();
+
+  if (first_frame == 0 && now - request->request_us < LIVE_CONTROL_TIMEOUT_MS * 1000)
+    return G_SOURCE_CONTINUE;
+
+  gint64 first_frame_delay = first_frame ? first_frame - request->request_us : -1;
+
+  g_print("⚡ Live change applied: bitrate=%d kbps fps=%d (set %" G_GINT64_FORMAT " us, first frame %.2f ms)\n",
+          request->bitrate, request->fps, request->set_us,
+          first_frame_delay >= 0 ? first_frame_delay / 1000.0 : -1.0);
+
+  send_live_control_reply(request->message, SOUP_STATUS_OK, request->success,
+                          request->success ? "Applied live" : "Partially applied (see StreamingProgram log)",
+                          request->bitrate, request->fps, request->set_us, first_frame_delay);
+  soup_server_unpause_message(request->server, request->message);
+
+  // Frees the request once neither probe can run any more.
+  gst_pad_remove_probe(request->encoder_sink_pad, request->sink_probe_id);
+  gst_pad_remove_probe(request->encoder_src_pad, request->src_probe_id);
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+set_video_max_rate(GstElement *pipeline, int max_fps)
+{
+  GstElement *videorate = gst_bin_get_by_name(GST_BIN(pipeline), VIDEO_RATE_NAME);
+  if (videorate == NULL)
+    return FALSE;
+
+  g_object_set(videorate, "max-rate", max_fps, NULL);
+  gst_object_unref(videorate);
+  return TRUE;
+}
+
+static void
+live_control_handler(SoupServer *server, SoupMessage *message, G_GNUC_UNUSED const char *path,
+                     G_GNUC_UNUSED GHashTable *query, SoupClientContext *client_context,
+                     gpointer user_data)
+{
+  LiveControl *control = (LiveControl *)user_data;
+
+  if (message->method != SOUP_METHOD_POST)
+  {
+    soup_message_set_status(message, SOUP_STATUS_METHOD_NOT_ALLOWED);
+    return;
+  }
+
+  // Only the local control server may retune the encoder.
+  GSocketAddress *remote = soup_client_context_get_remote_address(client_context);
+  if (remote == NULL || !G_IS_INET_SOCKET_ADDRESS(remote) ||
+      !g_inet_address_get_is_loopback(g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(remote))))
+  {
+    soup_message_set_status(message, SOUP_STATUS_FORBIDDEN);
+    return;
+  }
+
+  gint64 request_us = g_get_monotonic_time();
+  int new_bitrate = *control->bitrate;
+  int new_fps = *control->fps;
+
+  JsonParser *parser = json_parser_new();
+  if (!json_parser_load_from_data(parser, message->request_body->data, message->request_body->length, NULL) ||
+      !JSON_NODE_HOLDS_OBJECT(json_parser_get_root(parser)))
+  {
+    g_object_unref(parser);
+    send_live_control_reply(message, SOUP_STATUS_BAD_REQUEST, FALSE, "Invalid JSON",
+                            *control->bitrate, *control->fps, 0, -1);
+    return;
+  }
+
+  JsonObject *obj = json_node_get_object(json_parser_get_root(parser));
+  if (json_object_has_member(obj, "bitrate"))
+    new_bitrate = json_object_get_int_member(obj, "bitrate");
+  if (json_object_has_member(obj, "fps"))
+    new_fps = json_object_get_int_member(obj, "fps");
+  int new_width = control->profile ? *control->profile->width : 0;
+  int new_height = control->profile ? *control->profile->height : 0;
+  gboolean resize = FALSE;
+  if (json_object_has_member(obj, "width") || json_object_has_member(obj, "height"))
+  {
+    if (json_object_has_member(obj, "width"))
+      new_width = json_object_get_int_member(obj, "width");
+    if (json_object_has_member(obj, "height"))
+      new_height = json_object_get_int_member(obj, "height");
+    resize = control->profile == NULL || new_width != *control->profile->width ||
+             new_height != *control->profile->height;
+  }
+  g_object_unref(parser);
+
+  if (new_bitrate <= 0 || new_fps <= 0)
+  {
+    send_live_control_reply(message, SOUP_STATUS_BAD_REQUEST, FALSE, "bitrate and fps must be positive",
+                            *control->bitrate, *control->fps, 0, -1);
+    return;
+  }
+
+  if (resize)
+  {
+    const gchar *reason = "Resolution can't change live with simulcast renditions, restart to change it";
+    LiveProfileRequest *profile_request = g_new0(LiveProfileRequest, 1);
+    profile_request->control = control;
+    profile_request->server = server;
+    profile_request->message = message;
+    profile_request->bitrate = new_bitrate;
+    profile_request->fps = new_fps;
+
+    if (control->profile == NULL ||
+        !profile_switch_start(control->profile, new_width, new_height, new_bitrate, new_fps,
+                              live_profile_done_cb, profile_request, &reason))
+    {
+      g_print("⚠ Live resolution change to %dx%d refused: %s\n", new_width, new_height, reason);
+      send_live_profile_reply(message, SOUP_STATUS_CONFLICT, FALSE, reason,
+                              control->profile ? *control->profile->width : 0,
+                              control->profile ? *control->profile->height : 0,
+                              *control->bitrate, *control->fps, -1, -1);
+      g_free(profile_request);
+      return;
+    }
+
+    // Replied to by live_profile_done_cb once the new branch has taken over
+    soup_server_pause_message(server, message);
+    return;
+  }
+
+  GstElement *encoder = gst_bin_get_by_name(GST_BIN(control->pipeline), VIDEO_ENCODER_NAME);
+  if (encoder == NULL)
+  {
+    send_live_control_reply(message, SOUP_STATUS_INTERNAL_SERVER_ERROR, FALSE, "Encoder not found",
+                            *control->bitrate, *control->fps, 0, -1);
+    return;
+  }
+
+  LiveControlRequest *request = new LiveControlRequest();
+  request->server = server;
+  request->message = message;
+  request->request_us = request_us;
+  request->first_input_pts = GST_CLOCK_TIME_NONE;
+  request->first_frame_us = 0;
+  request->refs = 2;
+  request->encoder_sink_pad = gst_element_get_static_pad(encoder, "sink");
+  request->encoder_src_pad = gst_element_get_static_pad(encoder, "src");
+  request->success = TRUE;
+  gst_object_unref(encoder);
+
+  if (new_bitrate != *control->bitrate)
+  {
+    if (set_encoder_bitrate(control->pipeline, control->backend, new_bitrate))
+      *control->bitrate = new_bitrate;
+    else
+      request->success = FALSE;
+  }
+  if (new_fps != *control->fps)
+  {
+    if (set_video_max_rate(control->pipeline, new_fps))
+      *control->fps = new_fps;
+    else
+      request->success = FALSE;
+  }
+
+  request->set_us = g_get_monotonic_time() - request_us;
+  request->bitrate = *control->bitrate;
+  request->fps = *control->fps;
+
+  // Frames already inside the encoder were configured before the change; only time the
+  // first one that enters after it.
+  request->sink_probe_id = gst_pad_add_probe(request->encoder_sink_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                                             live_control_input_probe_cb, request, live_control_request_unref);
+  request->src_probe_id = gst_pad_add_probe(request->encoder_src_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                                            live_control_output_probe_cb, request, live_control_request_unref);
+
+  // Reply once the change is visible at the encoder output.
+  soup_server_pause_message(server, message);
+  g_timeout_add(5, live_control_poll_cb, request);
+}
+
+#endif // LIVE_CONTROL_H
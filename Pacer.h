@@ -0,0 +1,186 @@
+#ifndef PACER_H
+#define PACER_H
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <json-glib/json-glib.h>
+
+#include "RtpHeaderExtensions.h"
+#include "RtxControl.h"
+
+// Send-side pacing per viewer (--pacing).
+//
+// An IDR leaves the payloader as one burst of packets at line rate, and every viewer's
+// webrtcbin forwards it at once; a shallow router buffer on the uplink drops the tail. The pacer
+// sits on the last pad in front of the viewer's webrtcbin, which the viewer's queue thread
+// drives, and holds each packet until a virtual link running at --pacing times the target
+// bitrate is free. Up to PACER_BURST_MS of idle credit may go out back to back, so a stream
+// within its rate is never held. Buffer lists (a payloaded frame or slice) are split and paced
+// packet by packet. A packet it releases gets its abs-send-time then, so the browser's estimator
+// doesn't take the hold for network delay.
+//
+// Retransmissions come from rtprtxsend inside webrtcbin, on another thread, and are never held:
+// their bytes are charged to the same virtual link, so new media waits for them instead.
+//
+// A packet is never held more than PACER_MAX_DELAY_MS; past that the link is too slow for the
+// stream, and the viewer's leaky queue and ABR deal with it.
+
+#define PACER_BURST_MS 5
+#define PACER_MAX_DELAY_MS 200
+#define PACER_SUGGESTED_FACTOR 2.5
+
+typedef struct
+{
+  gint rate_bps;    // set from the main loop
+  RtxControl *rtx;  // the viewer's, for retransmitted bytes; may be NULL
+
+  // Only the viewer's queue thread
+  gint64 link_free_us; // when the virtual link has sent everything so far
+  guint64 rtx_bytes_charged;
+
+  // Counted by the queue thread, read by the report
+  guint packets;
+  guint held;         // packets that had to wait
+  gint max_delay_us;  // since the last report
+  gsize delay_us;     // total time packets waited
+} Pacer;
+
+static void
+pacer_clear(gpointer data)
+{
+  Pacer *pacer = (Pacer *)data;
+  if (pacer->rtx)
+    rtx_control_release(pacer->rtx);
+}
+
+static void
+pacer_release(gpointer pacer)
+{
+  g_atomic_rc_box_release_full(pacer, pacer_clear);
+}
+
+// Waits until buffer may go out.
+static void
+pacer_hold(Pacer *pacer, GstBuffer *buffer)
+{
+  gint rate_bps = g_atomic_int_get(&pacer->rate_bps);
+  gint64 now = g_get_monotonic_time();
+
+  g_atomic_int_inc(&pacer->packets);
+  if (rate_bps <= 0)
+    return;
+
+  gint64 link_free = MAX(pacer->link_free_us, now - PACER_BURST_MS * 1000);
+  if (pacer->rtx != NULL)
+  {
+    guint64 rtx_bytes = pacer->rtx->rtx_bytes.load(std::memory_order_relaxed);
+    link_free += (gint64)(rtx_bytes - pacer->rtx_bytes_charged) * 8 * G_USEC_PER_SEC / rate_bps;
+    pacer->rtx_bytes_charged = rtx_bytes;
+  }
+
+  gint64 wait = MIN(link_free - now, (gint64)PACER_MAX_DELAY_MS * 1000);
+  if (wait > 0)
+  {
+    g_usleep(wait);
+    g_atomic_int_inc(&pacer->held);
+    g_atomic_pointer_add(&pacer->delay_us, wait);
+    if (wait > g_atomic_int_get(&pacer->max_delay_us))
+      g_atomic_int_set(&pacer->max_delay_us, (gint)wait);
+    link_free = MIN(link_free, now + wait); // forget a backlog the cap let through
+  }
+
+  pacer->link_free_us = link_free + (gint64)gst_buffer_get_size(buffer) * 8 * G_USEC_PER_SEC / rate_bps;
+}
+
+static GstPadProbeReturn
+pacer_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  Pacer *pacer = (Pacer *)user_data;
+
+  if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER)
+  {
+    pacer_hold(pacer, GST_PAD_PROBE_INFO_BUFFER(info));
+    GstBuffer *buffer = gst_buffer_make_writable(GST_PAD_PROBE_INFO_BUFFER(info));
+    rtp_restamp_abs_send_time(buffer, rtp_abs_send_time_now());
+    GST_PAD_PROBE_INFO_DATA(info) = buffer;
+    return GST_PAD_PROBE_OK;
+  }
+
+  // Push the list's packets one at a time; each comes back through here as a buffer
+  if (g_atomic_int_get(&pacer->rate_bps) <= 0)
+  {
+    GstBufferList *list = gst_buffer_list_make_writable(GST_PAD_PROBE_INFO_BUFFER_LIST(info));
+    guint32 abs_send_time = rtp_abs_send_time_now();
+    guint length = gst_buffer_list_length(list);
+    for (guint i = 0; i < length; i++)
+      rtp_restamp_abs_send_time(gst_buffer_list_get_writable(list, i), abs_send_time);
+    GST_PAD_PROBE_INFO_DATA(info) = list;
+    return GST_PAD_PROBE_OK;
+  }
+
+  GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+  guint length = gst_buffer_list_length(list);
+  GstFlowReturn ret = GST_FLOW_OK;
+  for (guint i = 0; i < length && ret == GST_FLOW_OK; i++)
+    ret = gst_pad_push(pad, gst_buffer_ref(gst_buffer_list_get(list, i)));
+  gst_buffer_list_unref(list);
+  GST_PAD_PROBE_INFO_FLOW_RETURN(info) = ret;
+  return GST_PAD_PROBE_HANDLED;
+}
+
+// Paces what leaves pad, which must be driven by the viewer's own thread and be the last in front
+// of webrtcbin, as the pacer stamps abs-send-time. rtx may be NULL.
+static Pacer *
+attach_pacer(GstPad *pad, RtxControl *rtx)
+{
+  Pacer *pacer = g_atomic_rc_box_new0(Pacer);
+  if (rtx != NULL)
+  {
+    pacer->rtx = (RtxControl *)rtx_control_acquire(rtx);
+    pacer->rtx_bytes_charged = rtx->rtx_bytes.load(std::memory_order_relaxed);
+  }
+  gst_pad_add_probe(pad, (GstPadProbeType)(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                    pacer_probe_cb, g_atomic_rc_box_acquire(pacer), pacer_release);
+  return pacer;
+}
+
+static void
+pacer_set_rate(Pacer *pacer, gdouble factor, gint target_kbps)
+{
+  if (pacer != NULL)
+    g_atomic_int_set(&pacer->rate_bps, (gint)(factor * target_kbps * 1000));
+}
+
+static void
+pacer_add_members(JsonBuilder *builder, Pacer *pacer)
+{
+  guint packets = g_atomic_int_get(&pacer->packets);
+  guint held = g_atomic_int_get(&pacer->held);
+  gsize delay_us = (gsize)g_atomic_pointer_get(&pacer->delay_us);
+
+  json_builder_set_member_name(builder, "pacing_kbps");
+  json_builder_add_int_value(builder, g_atomic_int_get(&pacer->rate_bps) / 1000);
+  json_builder_set_member_name(builder, "paced_packets");
+  json_builder_add_int_value(builder, packets);
+  json_builder_set_member_name(builder, "paced_held");
+  json_builder_add_int_value(builder, held);
+  json_builder_set_member_name(builder, "paced_mean_hold_ms");
+  json_builder_add_double_value(builder, held ? delay_us / 1000.0 / held : 0.0);
+}
+
+// One report line; restarts the max hold time.
+static void
+pacer_report(Pacer *pacer, const gchar *label)
+{
+  guint packets = g_atomic_int_get(&pacer->packets);
+  guint held = g_atomic_int_get(&pacer->held);
+  gsize delay_us = (gsize)g_atomic_pointer_get(&pacer->delay_us);
+  gint max_delay_us = g_atomic_int_get(&pacer->max_delay_us);
+  g_atomic_int_set(&pacer->max_delay_us, 0);
+
+  g_print("🚦 %s: paced at %d kbps, %u of %u packets held, mean %.1f ms, max %.1f ms\n", label,
+          g_atomic_int_get(&pacer->rate_bps) / 1000, held, packets, held ? delay_us / 1000.0 / held : 0.0,
+          max_delay_us / 1000.0);
+}
+
+#endif // PACER_H
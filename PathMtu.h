@@ -0,0 +1,155 @@
+#ifndef PATH_MTU_H
+#define PATH_MTU_H
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <gst/gst.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <map>
+
+#include "EncoderBackend.h"
+
+// Per-viewer path MTU (--probe-mtu).
+//
+// At session setup the kernel is asked for the MTU of the path to the viewer's address: a
+// connected UDP socket with DF set reports the route MTU, lowered by any ICMP "fragmentation
+// needed" already received for that destination, which is what VPN tunnels and PPPoE links
+// show up as. Nothing is sent. The viewer's RTP packets are then clamped so packet, SRTP tag,
+// UDP and IP headers fit, with PATH_MTU_RESERVE left for header extensions and TURN framing.
+// The address is the one the viewer's WebSocket came from; a viewer behind a TURN relay is
+// clamped to the path to that address, not to the relay.
+//
+// Viewers with their own payloader (simulcast) get their own packet size. Viewers sharing the
+// payloader get the smallest packet size any of them needs, for as long as that viewer stays.
+
+#define PATH_MTU_RESERVE 20 // header extensions, TURN ChannelData
+
+// Path MTU towards ip as the kernel knows it, -1 if it can't tell.
+static gint
+path_mtu_probe(const gchar *ip)
+{
+  gint mtu = -1;
+
+#if defined(IP_MTU_DISCOVER) && defined(IP_MTU) && defined(IPV6_MTU_DISCOVER) && defined(IPV6_MTU)
+  // A dual-stack listener reports IPv4 viewers as ::ffff:a.b.c.d
+  const gchar *address_string = g_str_has_prefix(ip, "::ffff:") && strchr(ip, '.') ? ip + 7 : ip;
+  GInetAddress *address = g_inet_address_new_from_string(address_string);
+  if (address == NULL)
+    return -1;
+
+  GSocketFamily family = g_inet_address_get_family(address);
+  gboolean ipv6 = family == G_SOCKET_FAMILY_IPV6;
+  GSocket *socket = g_socket_new(family, G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_UDP, NULL);
+  if (socket != NULL)
+  {
+    gint level = ipv6 ? IPPROTO_IPV6 : IPPROTO_IP;
+    GSocketAddress *remote = g_inet_socket_address_new(address, 9); // discard, never sent to
+    g_socket_set_option(socket, level, ipv6 ? IPV6_MTU_DISCOVER : IP_MTU_DISCOVER,
+                        ipv6 ? IPV6_PMTUDISC_DO : IP_PMTUDISC_DO, NULL);
+    if (!g_socket_connect(socket, remote, NULL, NULL) ||
+        !g_socket_get_option(socket, level, ipv6 ? IPV6_MTU : IP_MTU, &mtu, NULL))
+      mtu = -1;
+    g_object_unref(remote);
+    g_object_unref(socket);
+  }
+  g_object_unref(address);
+#else
+  (void)ip;
+#endif
+
+  return mtu;
+}
+
+// Largest RTP packet for the viewer at ip: configured_mtu, or less if its path needs it. Prints
+// what was found and the per-packet overhead that results.
+static gint
+path_mtu_clamp(const gchar *ip, gint configured_mtu, const EncoderBackend *backend)
+{
+  gint path_mtu = path_mtu_probe(ip);
+  if (path_mtu <= 0)
+  {
+    g_print("📏 %s: path MTU unknown, RTP packets up to %d B\n", ip, configured_mtu);
+    return configured_mtu;
+  }
+
+  // IPv6 headers are 20 bytes longer than the IPv4 ones RTP_TRANSPORT_OVERHEAD counts
+  gint ip_extra = strchr(ip, ':') && !strchr(ip, '.') ? 20 : 0;
+  gint path_rtp_mtu = path_mtu - RTP_TRANSPORT_OVERHEAD - ip_extra - PATH_MTU_RESERVE;
+  gint rtp_mtu = CLAMP(path_rtp_mtu, VIDEO_RTP_MTU_MIN, configured_mtu);
+  guint overhead = rtp_packet_overhead(backend) + ip_extra;
+
+  g_print("📏 %s: path MTU %d, RTP packets up to %d B%s, %u B overhead per packet (%.1f%% of a full one)\n",
+          ip, path_mtu, rtp_mtu, rtp_mtu < configured_mtu ? " (clamped)" : "", overhead,
+          100.0 * overhead / (rtp_mtu + RTP_TRANSPORT_OVERHEAD + ip_extra));
+  return rtp_mtu;
+}
+
+// The smallest packet size among the viewers of a shared payloader.
+typedef struct
+{
+  GMutex lock;
+  GstElement *payloader;
+  gint configured_mtu;
+  gint current_mtu;
+  std::map<gint, guint> *viewers; // RTP MTU -> number of viewers needing it
+} SharedRtpMtu;
+
+static void
+shared_rtp_mtu_apply_locked(SharedRtpMtu *shared)
+{
+  gint mtu = shared->viewers->empty() ? shared->configured_mtu
+                                      : MIN(shared->configured_mtu, shared->viewers->begin()->first);
+  if (mtu == shared->current_mtu)
+    return;
+
+  g_print("📏 Shared payloader: RTP packets up to %d B (was %d)\n", mtu, shared->current_mtu);
+  g_object_set(shared->payloader, "mtu", (guint)mtu, NULL);
+  shared->current_mtu = mtu;
+}
+
+static void
+shared_rtp_mtu_add(SharedRtpMtu *shared, gint rtp_mtu)
+{
+  if (shared == NULL || rtp_mtu <= 0)
+    return;
+
+  g_mutex_lock(&shared->lock);
+  (*shared->viewers)[rtp_mtu]++;
+  shared_rtp_mtu_apply_locked(shared);
+  g_mutex_unlock(&shared->lock);
+}
+
+// Viewer teardown may run on a streaming thread, hence the lock.
+static void
+shared_rtp_mtu_remove(SharedRtpMtu *shared, gint rtp_mtu)
+{
+  if (shared == NULL || rtp_mtu <= 0)
+    return;
+
+  g_mutex_lock(&shared->lock);
+  auto viewer = shared->viewers->find(rtp_mtu);
+  if (viewer != shared->viewers->end() && --viewer->second == 0)
+    shared->viewers->erase(viewer);
+  shared_rtp_mtu_apply_locked(shared);
+  g_mutex_unlock(&shared->lock);
+}
+
+// Tracks the pipeline's shared payloader. Lives until exit, like the pipeline.
+static SharedRtpMtu *
+attach_shared_rtp_mtu(GstElement *pipeline, gint configured_mtu)
+{
+  GstElement *payloader = gst_bin_get_by_name(GST_BIN(pipeline), VIDEO_PAYLOADER_NAME);
+  if (payloader == NULL)
+    return NULL;
+
+  SharedRtpMtu *shared = g_new0(SharedRtpMtu, 1);
+  g_mutex_init(&shared->lock);
+  shared->payloader = payloader;
+  shared->configured_mtu = configured_mtu;
+  shared->current_mtu = configured_mtu;
+  shared->viewers = new std::map<gint, guint>();
+  return shared;
+}
+
+#endif // PATH_MTU_H
@@ -0,0 +1,453 @@
+#ifndef PROFILE_SWITCH_H
+#define PROFILE_SWITCH_H
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <atomic>
+
+#include "VideoSource.h"
+#include "EncoderBackend.h"
+
+// Live resolution changes for a running pipeline, without dropping WebRTC sessions.
+//
+// A new capture + encode branch (a bin ending in the parser) is built next to the running one.
+// Its frames are dropped until its first IDR; on that IDR the payloader's input is moved from the
+// old branch to the new one and the old branch is torn down. The payloader, the tee and every
+// viewer's webrtcbin stay in place, so SSRC, sequence numbers and RTP timestamps continue and the
+// browser just sees new SPS/PPS (or a VP8 keyframe with a new size) in band; no renegotiation.
+//
+// A v4l2 device can't stream to two elements, so there the old branch is stopped first and the
+// gap includes reopening the device. If the new capture gives no IDR in time, a branch at the
+// previous size is built the same way, so the viewers get video back instead of none until a
+// restart. Raw file and shm sources have a fixed frame size and are not switched. The gap is
+// measured from the last old frame to the new IDR at the payloader.
+
+#define PROFILE_SWITCH_TIMEOUT_MS 5000
+#define PROFILE_SWITCH_MIN_SIZE 64
+#define PROFILE_SWITCH_MAX_SIZE 4096
+
+typedef enum
+{
+  PROFILE_SWITCH_WAITING = 0, // new branch running, no IDR yet
+  PROFILE_SWITCH_SWITCHED,    // payloader fed by the new branch
+  PROFILE_SWITCH_ABANDONED    // timed out, new branch being removed
+} ProfileSwitchState;
+
+// Called on the main loop once the new encoder feeds the payloader, to move probes and
+// controllers (keyframes, encode latency, temporal layers) over to it.
+typedef void (*ProfileSwitchedFunc)(GstElement *encoder, gint bitrate_kbps, gpointer user_data);
+
+// Called on the main loop when the switch is over. gap_us and ready_us are -1 on failure.
+typedef void (*ProfileSwitchDoneFunc)(gboolean success, const gchar *text, gint64 gap_us, gint64 ready_us,
+                                      gpointer user_data);
+
+typedef struct
+{
+  GstElement *pipeline;
+  const EncoderBackend *backend;
+  EncoderPreset preset;
+  EncoderOptions options;
+  VideoSourceConfig source; // width/height follow the live profile
+  int *width;               // program's current resolution, updated on success
+  int *height;
+  ProfileSwitchedFunc switched;
+  gpointer switched_data;
+  gboolean busy;            // one switch at a time
+} ProfileSwitch;
+
+typedef struct
+{
+  ProfileSwitch *profile;
+  gint width;
+  gint height;
+  gint bitrate_kbps;
+  gint fps;
+  gboolean break_before_make;
+  gboolean restoring;          // the previous size, after a v4l2 switch that timed out
+  GstElement *branch;
+  GList *old_elements;         // capture + encode chain feeding the payloader until now
+  GstPad *old_src_pad;
+  gulong old_probe_id;
+  GstPad *payloader_sink_pad;
+  std::atomic<int> state;
+  std::atomic<gboolean> cut;   // old frames no longer reach the payloader
+  std::atomic<gint64> last_old_us;
+  std::atomic<gint64> switched_us;
+  gint64 request_us;
+  guint timeout_source;
+  ProfileSwitchDoneFunc done;  // NULL when restoring, the switch was answered already
+  gpointer done_data;
+} ProfileSwitchRequest;
+
+// Checks that the source can deliver the new size before anything is torn down; a capture
+// that fails caps negotiation would take the whole pipeline down with it.
+static gboolean
+profile_switch_source_supports(const VideoSourceConfig *source, gint width, gint height, const gchar **reason)
+{
+  if (source->kind == VIDEO_SOURCE_FILE || source->kind == VIDEO_SOURCE_SHM)
+  {
+    *reason = "Raw file and shm sources have a fixed frame size, restart to change it";
+    return FALSE;
+  }
+  if (source->kind != VIDEO_SOURCE_V4L2)
+    return TRUE;
+
+  // Querying formats works while another fd of the device is streaming.
+  GstElement *probe = gst_element_factory_make("v4l2src", NULL);
+  if (probe == NULL)
+  {
+    *reason = "v4l2src not available";
+    return FALSE;
+  }
+  g_object_set(probe, "device", source->device ? source->device : VIDEO_SOURCE_DEFAULT_DEVICE, NULL);
+
+  gboolean supported = FALSE;
+  if (gst_element_set_state(probe, GST_STATE_READY) == GST_STATE_CHANGE_SUCCESS)
+  {
+    GstPad *pad = gst_element_get_static_pad(probe, "src");
+    GstCaps *device_caps = gst_pad_query_caps(pad, NULL);
+    GstCaps *wanted = gst_caps_new_simple("video/x-raw",
+                                          "format", G_TYPE_STRING, "NV12",
+                                          "width", G_TYPE_INT, width,
+                                          "height", G_TYPE_INT, height,
+                                          "framerate", GST_TYPE_FRACTION, VIDEO_SOURCE_CAPTURE_FPS, 1,
+                                          NULL);
+    supported = gst_caps_can_intersect(device_caps, wanted);
+    gst_caps_unref(wanted);
+    gst_caps_unref(device_caps);
+    gst_object_unref(pad);
+  }
+  gst_element_set_state(probe, GST_STATE_NULL);
+  gst_object_unref(probe);
+
+  if (!supported)
+    *reason = "Capture device does not offer NV12 at that size";
+  return supported;
+}
+
+// Walks upstream from the payloader and returns the elements of the branch feeding it (each
+// with a ref), source last. After a first switch that's just the branch bin.
+static GList *
+profile_switch_collect_branch(GstPad *payloader_sink_pad)
+{
+  GList *elements = NULL;
+  GstPad *peer = gst_pad_get_peer(payloader_sink_pad);
+
+  while (peer != NULL)
+  {
+    GstElement *element = gst_pad_get_parent_element(peer);
+    gst_object_unref(peer);
+    peer = NULL;
+    if (element == NULL)
+      break;
+    elements = g_list_append(elements, element);
+
+    GstIterator *sink_pads = gst_element_iterate_sink_pads(element);
+    GValue item = G_VALUE_INIT;
+    if (gst_iterator_next(sink_pads, &item) == GST_ITERATOR_OK)
+    {
+      peer = gst_pad_get_peer(GST_PAD(g_value_get_object(&item)));
+      g_value_unset(&item);
+    }
+    gst_iterator_free(sink_pads);
+  }
+  return elements;
+}
+
+// Stops and removes elements from whatever bin holds them, source first so nothing is pushed
+// into an element that is already shutting down.
+static void
+profile_switch_remove_elements(GList *elements)
+{
+  for (GList *l = g_list_last(elements); l != NULL; l = l->prev)
+    gst_element_set_state(GST_ELEMENT(l->data), GST_STATE_NULL);
+
+  for (GList *l = elements; l != NULL; l = l->next)
+  {
+    GstElement *element = GST_ELEMENT(l->data);
+    GstObject *parent = gst_object_get_parent(GST_OBJECT(element));
+    if (parent != NULL)
+    {
+      gst_bin_remove(GST_BIN(parent), element);
+      gst_object_unref(parent);
+    }
+  }
+  g_list_free_full(elements, gst_object_unref);
+}
+
+static void
+profile_switch_request_free(ProfileSwitchRequest *request)
+{
+  request->profile->busy = FALSE;
+  if (request->old_src_pad)
+    gst_object_unref(request->old_src_pad);
+  gst_object_unref(request->payloader_sink_pad);
+  delete request;
+}
+
+static GstPadProbeReturn
+profile_switch_old_probe_cb(G_GNUC_UNUSED GstPad *pad, G_GNUC_UNUSED GstPadProbeInfo *info, gpointer user_data)
+{
+  ProfileSwitchRequest *request = (ProfileSwitchRequest *)user_data;
+
+  if (request->cut.load())
+    return GST_PAD_PROBE_DROP;
+
+  request->last_old_us = g_get_monotonic_time();
+  return GST_PAD_PROBE_OK;
+}
+
+static gboolean
+profile_switch_finish_cb(gpointer user_data)
+{
+  ProfileSwitchRequest *request = (ProfileSwitchRequest *)user_data;
+  ProfileSwitch *profile = request->profile;
+
+  if (request->timeout_source)
+    g_source_remove(request->timeout_source);
+
+  // The old branch's frames are dropped at its src pad since the switch, stop it now.
+  profile_switch_remove_elements(request->old_elements);
+  request->old_elements = NULL;
+
+  gint64 last_old_us = request->last_old_us.load();
+  gint64 gap_us = last_old_us ? request->switched_us.load() - last_old_us : -1;
+  gint64 ready_us = request->switched_us.load() - request->request_us;
+
+  if (request->restoring)
+    g_print("🔁 Profile %dx%d restored at IDR: gap %.1f ms\n", request->width, request->height, gap_us / 1000.0);
+  else
+    g_print("🔁 Profile switch %dx%d -> %dx%d at IDR: gap %.1f ms, ready after %.1f ms%s\n",
+            profile->source.width, profile->source.height, request->width, request->height,
+            gap_us / 1000.0, ready_us / 1000.0, request->break_before_make ? " (capture reopened)" : "");
+
+  profile->source.width = request->width;
+  profile->source.height = request->height;
+  *profile->width = request->width;
+  *profile->height = request->height;
+
+  GstElement *encoder = gst_bin_get_by_name(GST_BIN(request->branch), VIDEO_ENCODER_NAME);
+  if (encoder != NULL && profile->switched != NULL)
+    profile->switched(encoder, request->bitrate_kbps, profile->switched_data);
+  if (encoder != NULL)
+    gst_object_unref(encoder);
+
+  if (request->done != NULL)
+    request->done(TRUE, "Switched live at IDR", gap_us, ready_us, request->done_data);
+  profile_switch_request_free(request);
+  return G_SOURCE_REMOVE;
+}
+
+// Runs on the new branch's streaming thread. Blocking probe: a relink done here is picked up
+// before the buffer goes on, so the payloader gets the new stream's caps and segment first.
+static GstPadProbeReturn
+profile_switch_new_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  ProfileSwitchRequest *request = (ProfileSwitchRequest *)user_data;
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+  int waiting = PROFILE_SWITCH_WAITING;
+
+  if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+    return GST_PAD_PROBE_DROP;
+  if (!request->state.compare_exchange_strong(waiting, PROFILE_SWITCH_SWITCHED))
+    return GST_PAD_PROBE_DROP;
+
+  request->cut = TRUE;
+  request->switched_us = g_get_monotonic_time();
+
+  GstPad *current = gst_pad_get_peer(request->payloader_sink_pad);
+  if (current != NULL)
+  {
+    gst_pad_unlink(current, request->payloader_sink_pad);
+    gst_object_unref(current);
+  }
+  gst_pad_link(pad, request->payloader_sink_pad);
+
+  g_idle_add(profile_switch_finish_cb, request);
+  return GST_PAD_PROBE_REMOVE;
+}
+
+static gboolean profile_switch_timeout_cb(gpointer user_data);
+
+// The capture + encode chain for width x height, as a bin with a src ghost pad, or NULL.
+static GstElement *
+profile_switch_build_branch(ProfileSwitch *profile, gint width, gint height, gint bitrate_kbps, gint fps)
+{
+  VideoSourceConfig source = profile->source;
+  source.width = width;
+  source.height = height;
+  gchar *source_head = build_video_source_string(&source);
+  gchar *encoder = build_encoder_string(profile->backend, profile->preset, bitrate_kbps, &profile->options,
+                                        VIDEO_ENCODER_NAME);
+  gchar *description = g_strdup_printf("%s ! videorate name=" VIDEO_RATE_NAME " drop-only=true max-rate=%d ! "
+                                       "queue ! %s",
+                                       source_head, fps, encoder);
+  GError *error = NULL;
+  GstElement *branch = gst_parse_bin_from_description(description, TRUE, &error);
+  g_free(source_head);
+  g_free(encoder);
+  g_free(description);
+  if (branch == NULL)
+    g_print("⚠ Could not build the new video branch: %s\n", error ? error->message : "unknown error");
+  g_clear_error(&error);
+  return branch;
+}
+
+// Adds the request's branch to the pipeline; its first IDR takes over the payloader.
+static void
+profile_switch_run_branch(ProfileSwitchRequest *request)
+{
+  gst_bin_add(GST_BIN(request->profile->pipeline), request->branch);
+  GstPad *branch_src_pad = gst_element_get_static_pad(request->branch, "src");
+  gst_pad_add_probe(branch_src_pad, (GstPadProbeType)(GST_PAD_PROBE_TYPE_BLOCK | GST_PAD_PROBE_TYPE_BUFFER),
+                    profile_switch_new_probe_cb, request, NULL);
+  gst_object_unref(branch_src_pad);
+
+  request->timeout_source = g_timeout_add(PROFILE_SWITCH_TIMEOUT_MS, profile_switch_timeout_cb, request);
+  gst_element_sync_state_with_parent(request->branch);
+}
+
+// After a v4l2 switch timed out the old capture is gone already; reopen it at the previous size.
+// Returns FALSE if that branch can't even be built.
+static gboolean
+profile_switch_restore(ProfileSwitchRequest *failed)
+{
+  ProfileSwitch *profile = failed->profile;
+  GstElement *branch = profile_switch_build_branch(profile, profile->source.width, profile->source.height,
+                                                   failed->bitrate_kbps, failed->fps);
+  if (branch == NULL)
+    return FALSE;
+
+  ProfileSwitchRequest *request = new ProfileSwitchRequest();
+  request->profile = profile;
+  request->width = profile->source.width;
+  request->height = profile->source.height;
+  request->bitrate_kbps = failed->bitrate_kbps;
+  request->fps = failed->fps;
+  request->break_before_make = TRUE;
+  request->restoring = TRUE;
+  request->branch = branch;
+  request->payloader_sink_pad = (GstPad *)gst_object_ref(failed->payloader_sink_pad);
+  request->state = PROFILE_SWITCH_WAITING;
+  request->cut = TRUE;
+  request->last_old_us = failed->last_old_us.load();
+  request->switched_us = 0;
+  request->request_us = g_get_monotonic_time();
+  profile->busy = TRUE;
+
+  profile_switch_run_branch(request);
+  return TRUE;
+}
+
+static gboolean
+profile_switch_timeout_cb(gpointer user_data)
+{
+  ProfileSwitchRequest *request = (ProfileSwitchRequest *)user_data;
+  int waiting = PROFILE_SWITCH_WAITING;
+
+  request->timeout_source = 0;
+  // Lost the race against the IDR: finish_cb is already queued.
+  if (!request->state.compare_exchange_strong(waiting, PROFILE_SWITCH_ABANDONED))
+    return G_SOURCE_REMOVE;
+
+  profile_switch_remove_elements(g_list_append(NULL, gst_object_ref(request->branch)));
+  if (!request->break_before_make)
+    gst_pad_remove_probe(request->old_src_pad, request->old_probe_id);
+
+  if (request->restoring)
+  {
+    g_print("⚠ Capture at %dx%d gave no IDR within %d ms either, video stopped\n", request->width,
+            request->height, PROFILE_SWITCH_TIMEOUT_MS);
+    profile_switch_request_free(request);
+    return G_SOURCE_REMOVE;
+  }
+
+  g_print("⚠ Profile switch to %dx%d abandoned: no IDR from the new branch within %d ms%s\n",
+          request->width, request->height, PROFILE_SWITCH_TIMEOUT_MS,
+          request->break_before_make ? ", reopening the capture at the previous size" : "");
+  gboolean restoring = request->break_before_make && profile_switch_restore(request);
+  const gchar *text = !request->break_before_make ? "New branch produced no keyframe, kept the old profile"
+                      : restoring ? "New capture produced no keyframe, restoring the previous resolution"
+                                  : "New capture produced no keyframe, video stopped";
+  request->done(FALSE, text, -1, -1, request->done_data);
+  ProfileSwitch *profile = request->profile;
+  profile_switch_request_free(request);
+  profile->busy = restoring; // until the restored capture has its IDR
+  return G_SOURCE_REMOVE;
+}
+
+// Starts a switch to width x height with the given encoder bitrate and max fps. Returns FALSE
+// with *reason set if it can't be started; otherwise done is called once it's over.
+static gboolean
+profile_switch_start(ProfileSwitch *profile, gint width, gint height, gint bitrate_kbps, gint fps,
+                     ProfileSwitchDoneFunc done, gpointer done_data, const gchar **reason)
+{
+  if (profile->busy)
+  {
+    *reason = "A profile switch is already in progress";
+    return FALSE;
+  }
+  if (width < PROFILE_SWITCH_MIN_SIZE || height < PROFILE_SWITCH_MIN_SIZE ||
+      width > PROFILE_SWITCH_MAX_SIZE || height > PROFILE_SWITCH_MAX_SIZE || (width | height) & 1)
+  {
+    *reason = "Width and height must be even and within 64-4096";
+    return FALSE;
+  }
+  if (!profile_switch_source_supports(&profile->source, width, height, reason))
+    return FALSE;
+
+  GstElement *payloader = gst_bin_get_by_name(GST_BIN(profile->pipeline), VIDEO_PAYLOADER_NAME);
+  if (payloader == NULL)
+  {
+    *reason = "Payloader not found";
+    return FALSE;
+  }
+
+  GstElement *branch = profile_switch_build_branch(profile, width, height, bitrate_kbps, fps);
+  if (branch == NULL)
+  {
+    gst_object_unref(payloader);
+    *reason = "Could not build the new video branch";
+    return FALSE;
+  }
+
+  ProfileSwitchRequest *request = new ProfileSwitchRequest();
+  request->profile = profile;
+  request->width = width;
+  request->height = height;
+  request->bitrate_kbps = bitrate_kbps;
+  request->fps = fps;
+  request->break_before_make = profile->source.kind == VIDEO_SOURCE_V4L2;
+  request->branch = branch;
+  request->payloader_sink_pad = gst_element_get_static_pad(payloader, "sink");
+  request->old_src_pad = gst_pad_get_peer(request->payloader_sink_pad);
+  request->old_elements = profile_switch_collect_branch(request->payloader_sink_pad);
+  request->state = PROFILE_SWITCH_WAITING;
+  request->cut = FALSE;
+  request->last_old_us = 0;
+  request->switched_us = 0;
+  request->request_us = g_get_monotonic_time();
+  request->done = done;
+  request->done_data = done_data;
+  gst_object_unref(payloader);
+  profile->busy = TRUE;
+
+  if (request->old_src_pad)
+    request->old_probe_id = gst_pad_add_probe(request->old_src_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                                              profile_switch_old_probe_cb, request, NULL);
+
+  // Frees the device for the new capture; the last old frame is what the gap is measured from.
+  if (request->break_before_make)
+  {
+    request->cut = TRUE;
+    if (request->last_old_us.load() == 0)
+      request->last_old_us = g_get_monotonic_time();
+    profile_switch_remove_elements(request->old_elements);
+    request->old_elements = NULL;
+  }
+
+  profile_switch_run_branch(request);
+  return TRUE;
+}
+
+#endif // PROFILE_SWITCH_H
@@ -0,0 +1,218 @@
+#ifndef RTP_HEADER_EXTENSIONS_H
+#define RTP_HEADER_EXTENSIONS_H
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <gst/rtp/rtp.h>
+#include <stdio.h>
+#include <string.h>
+
+// RTP header extensions on the video stream.
+//
+// The payloader's caps carry extmap-N fields, which webrtcbin turns into a=extmap lines of the
+// offer:
+// - transport-wide-cc: rtpsession numbers every packet and answers the browser's feedback,
+//   so the browser runs its own send-side bandwidth estimation on our stream.
+// - abs-send-time: when the packet left, 6.18 fixed-point seconds, for the receive-side
+//   estimator of browsers that don't use transport-wide-cc.
+// - playout-delay: the min/max delay the browser may add before rendering a frame
+//   (--playout-delay). 0:0 asks for no jitter buffer smoothing at all.
+//
+// GStreamer writes transport-wide-cc itself. abs-send-time and playout-delay have no header
+// extension element, a probe on the payloader's src pad writes them. The payloader is shared by
+// every viewer and sits in front of their queues (and pacers), so the abs-send-time it writes is
+// only a placeholder: each viewer overwrites it on the last pad in front of its webrtcbin, where
+// the packet really leaves. The extensions add up to 16 bytes to a packet, within the
+// PATH_MTU_RESERVE that --probe-mtu leaves.
+
+#define RTP_HDREXT_TWCC_ID 3
+#define RTP_HDREXT_ABS_SEND_TIME_ID 4
+#define RTP_HDREXT_PLAYOUT_DELAY_ID 5
+
+#define RTP_HDREXT_TWCC_URI "http://www.ietf.org/id/draft-holmer-rmcat-transport-wide-cc-extensions-01"
+#define RTP_HDREXT_ABS_SEND_TIME_URI "http://www.webrtc.org/experiments/rtp-hdrext/abs-send-time"
+#define RTP_HDREXT_PLAYOUT_DELAY_URI "http://www.webrtc.org/experiments/rtp-hdrext/playout-delay"
+
+#define PLAYOUT_DELAY_DEFAULT "0:0"
+#define PLAYOUT_DELAY_MAX_MS 40950 // 12 bits of 10 ms
+
+// Fields for application/x-rtp caps that negotiate the extensions, starting with a comma. Browsers
+// only send transport-wide-cc feedback with a=rtcp-fb transport-cc as well.
+#define RTP_HDREXT_CAPS_FIELDS \
+  ",extmap-" G_STRINGIFY(RTP_HDREXT_TWCC_ID) "=(string)" RTP_HDREXT_TWCC_URI \
+  ",extmap-" G_STRINGIFY(RTP_HDREXT_ABS_SEND_TIME_ID) "=(string)" RTP_HDREXT_ABS_SEND_TIME_URI \
+  ",extmap-" G_STRINGIFY(RTP_HDREXT_PLAYOUT_DELAY_ID) "=(string)" RTP_HDREXT_PLAYOUT_DELAY_URI \
+  ",rtcp-fb-transport-cc=(boolean)true"
+
+// Parses --playout-delay: "MIN:MAX" in milliseconds, or "off". FALSE if it is neither.
+static gboolean
+playout_delay_from_string(const gchar *value, gboolean *enabled, guint *min_ms, guint *max_ms)
+{
+  if (g_strcmp0(value, "off") == 0)
+  {
+    *enabled = FALSE;
+    return TRUE;
+  }
+
+  guint min = 0, max = 0;
+  gchar tail;
+  if (value == NULL || sscanf(value, "%u:%u%c", &min, &max, &tail) != 2 || min > max ||
+      max > PLAYOUT_DELAY_MAX_MS)
+    return FALSE;
+
+  *enabled = TRUE;
+  *min_ms = min;
+  *max_ms = max;
+  return TRUE;
+}
+
+typedef struct
+{
+  gboolean playout_delay;
+  guint8 playout_delay_data[3]; // 12 bits min, 12 bits max, 10 ms units
+  gboolean frame_start;         // the next packet starts a frame
+} RtpHeaderExtensionProbe;
+
+// abs-send-time is NTP seconds; NTP and Unix time differ by a multiple of 64 s, so the 6 bits of
+// seconds it carries are the same.
+static guint32
+rtp_abs_send_time_now()
+{
+  return (guint32)(((guint64)g_get_real_time() << 18) / G_USEC_PER_SEC) & 0xFFFFFF;
+}
+
+// Overwrites the abs-send-time buffer already carries. buffer must be writable; one without the
+// extension is left alone.
+static void
+rtp_restamp_abs_send_time(GstBuffer *buffer, guint32 abs_send_time)
+{
+  GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+  gpointer data;
+  guint size;
+
+  if (!gst_rtp_buffer_map(buffer, GST_MAP_READWRITE, &rtp))
+    return;
+  if (gst_rtp_buffer_get_extension_onebyte_header(&rtp, RTP_HDREXT_ABS_SEND_TIME_ID, 0, &data, &size) && size == 3)
+  {
+    guint8 *send_time = (guint8 *)data;
+    send_time[0] = (guint8)(abs_send_time >> 16);
+    send_time[1] = (guint8)(abs_send_time >> 8);
+    send_time[2] = (guint8)abs_send_time;
+  }
+  gst_rtp_buffer_unmap(&rtp);
+}
+
+static void
+rtp_header_extensions_write(RtpHeaderExtensionProbe *probe, GstBuffer *buffer, guint32 abs_send_time)
+{
+  GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+  if (!gst_rtp_buffer_map(buffer, GST_MAP_READWRITE, &rtp))
+    return;
+
+  guint8 send_time[3] = {(guint8)(abs_send_time >> 16), (guint8)(abs_send_time >> 8), (guint8)abs_send_time};
+  gst_rtp_buffer_add_extension_onebyte_header(&rtp, RTP_HDREXT_ABS_SEND_TIME_ID, send_time, sizeof(send_time));
+
+  // The browser takes a frame's playout delay from its first packet
+  if (probe->playout_delay && probe->frame_start)
+    gst_rtp_buffer_add_extension_onebyte_header(&rtp, RTP_HDREXT_PLAYOUT_DELAY_ID, probe->playout_delay_data,
+                                                sizeof(probe->playout_delay_data));
+  probe->frame_start = gst_rtp_buffer_get_marker(&rtp);
+
+  gst_rtp_buffer_unmap(&rtp);
+}
+
+// Only the payloader's streaming thread runs this, no locking needed.
+static GstPadProbeReturn
+rtp_header_extensions_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  RtpHeaderExtensionProbe *probe = (RtpHeaderExtensionProbe *)user_data;
+  guint32 abs_send_time = rtp_abs_send_time_now();
+
+  if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+  {
+    GstBufferList *list = gst_buffer_list_make_writable(GST_PAD_PROBE_INFO_BUFFER_LIST(info));
+    guint length = gst_buffer_list_length(list);
+    for (guint i = 0; i < length; i++)
+    {
+      GstBuffer *buffer = gst_buffer_list_get_writable(list, i);
+      rtp_header_extensions_write(probe, buffer, abs_send_time);
+    }
+    info->data = list;
+  }
+  else
+  {
+    GstBuffer *buffer = gst_buffer_make_writable(GST_PAD_PROBE_INFO_BUFFER(info));
+    rtp_header_extensions_write(probe, buffer, abs_send_time);
+    info->data = buffer;
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+// Writes abs-send-time, and playout-delay if enabled, into the packets leaving payloader. The
+// probe lives as long as the pad.
+static void
+attach_rtp_header_extensions(GstElement *payloader, gboolean playout_delay, guint min_ms, guint max_ms)
+{
+  GstPad *pad = gst_element_get_static_pad(payloader, "src");
+  if (pad == NULL)
+    return;
+
+  RtpHeaderExtensionProbe *probe = g_new0(RtpHeaderExtensionProbe, 1);
+  guint min = min_ms / 10, max = max_ms / 10;
+  probe->playout_delay = playout_delay;
+  probe->playout_delay_data[0] = (guint8)(min >> 4);
+  probe->playout_delay_data[1] = (guint8)(((min & 0xF) << 4) | (max >> 8));
+  probe->playout_delay_data[2] = (guint8)max;
+  probe->frame_start = TRUE;
+
+  gst_pad_add_probe(pad, (GstPadProbeType)(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                    rtp_header_extensions_probe_cb, probe, g_free);
+  gst_object_unref(pad);
+}
+
+// The same for the payloader named payloader_name in pipeline.
+static void
+attach_rtp_header_extensions_by_name(GstElement *pipeline, const gchar *payloader_name, gboolean playout_delay,
+                                     guint min_ms, guint max_ms)
+{
+  GstElement *payloader = gst_bin_get_by_name(GST_BIN(pipeline), payloader_name);
+  if (payloader == NULL)
+    return;
+
+  attach_rtp_header_extensions(payloader, playout_delay, min_ms, max_ms);
+  gst_object_unref(payloader);
+}
+
+static GstPadProbeReturn
+rtp_abs_send_time_probe_cb(G_GNUC_UNUSED GstPad *pad, GstPadProbeInfo *info, G_GNUC_UNUSED gpointer user_data)
+{
+  guint32 abs_send_time = rtp_abs_send_time_now();
+
+  if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+  {
+    GstBufferList *list = gst_buffer_list_make_writable(GST_PAD_PROBE_INFO_BUFFER_LIST(info));
+    guint length = gst_buffer_list_length(list);
+    for (guint i = 0; i < length; i++)
+      rtp_restamp_abs_send_time(gst_buffer_list_get_writable(list, i), abs_send_time);
+    info->data = list;
+  }
+  else
+  {
+    GstBuffer *buffer = gst_buffer_make_writable(GST_PAD_PROBE_INFO_BUFFER(info));
+    rtp_restamp_abs_send_time(buffer, abs_send_time);
+    info->data = buffer;
+  }
+  return GST_PAD_PROBE_OK;
+}
+
+// Stamps abs-send-time on the packets leaving pad, a viewer's last pad in front of webrtcbin. Add
+// it after any probe on pad that holds packets back.
+static void
+attach_abs_send_time(GstPad *pad)
+{
+  gst_pad_add_probe(pad, (GstPadProbeType)(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                    rtp_abs_send_time_probe_cb, NULL, NULL);
+}
+
+#endif // RTP_HEADER_EXTENSIONS_H
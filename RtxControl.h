@@ -0,0 +1,381 @@
+#ifndef RTX_CONTROL_H
+#define RTX_CONTROL_H
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <gst/rtp/rtp.h>
+#include <json-glib/json-glib.h>
+#include <string.h>
+#include <atomic>
+
+// Deadline-aware retransmission with a bandwidth cap, per viewer.
+//
+// rtpsession turns every NACKed sequence number into a GstRTPRetransmissionRequest event sent
+// upstream to rtprtxsend. A probe on rtprtxsend's src pad looks at each request first:
+// - A retransmission reaches the viewer as long after the original would have as the original
+//   packet is old now. Once that is more than the viewer's RTT plus --rtx-deadline-frames frame
+//   intervals, the frame has been played (or skipped) and the request is dropped ("late").
+//   rtprtxsend's history (max-size-time) is cut to the same window.
+// - A token bucket refilled at --rtx-max-share of the viewer's send rate, holding
+//   RTX_BUDGET_BURST_MS of it, pays for each retransmitted packet. Requests it can't pay for are
+//   dropped ("budget"), so a loss burst cannot take over the uplink.
+// A probe on the sink pad remembers when each original packet went out and how big it was.
+// Packets leaving the src pad with an SSRC that never came in on the sink pad are
+// retransmissions; they are counted with their bytes.
+//
+// The stats tick on the main loop updates RTT and budget; the streaming threads only read them.
+
+#define RTX_HISTORY_SLOTS 4096      // sequence numbers remembered, a power of 2
+#define RTX_DEFAULT_RTT_MS 100      // until the first receiver report
+#define RTX_DEFAULT_DEADLINE_FRAMES 3
+#define RTX_DEFAULT_MAX_SHARE 25    // percent of the send rate
+#define RTX_BUDGET_BURST_MS 100
+#define RTX_MEDIA_SSRCS 4           // video and audio share the bundled session
+#define RTX_NO_SEQNUM G_MAXUINT      // never a 16-bit sequence number
+
+typedef struct
+{
+  std::atomic<gint> refs; // the viewer's, and one per probe or pacer using the control
+
+  // Set from the main loop
+  gint deadline_ms; // 0: no deadline
+  gint budget_bps;  // 0: no cap
+
+  // Original packets, written by the sink pad probe and read by the request probe. A slot read
+  // while it is being overwritten gives a wrong answer for one request, nothing worse.
+  guint seqnums[RTX_HISTORY_SLOTS];  // RTX_NO_SEQNUM until the slot is first written
+  guint sent_ms[RTX_HISTORY_SLOTS];
+  guint sizes[RTX_HISTORY_SLOTS];
+  guint media_ssrcs[RTX_MEDIA_SSRCS]; // 0: free, filled in order by the sink pad probe
+
+  // Only the request probe
+  gint64 bucket_us;
+  gdouble bucket_bytes;
+
+  // Counted by the request probe, read by the report
+  guint requests;
+  guint skipped_late;
+  guint skipped_budget;
+
+  // Counted by the src pad probe
+  guint rtx_packets;
+  std::atomic<guint64> rtx_bytes; // also read by the pacer, on the queue thread
+} RtxControl;
+
+static guint
+rtx_control_now_ms(void)
+{
+  return (guint)(g_get_monotonic_time() / 1000);
+}
+
+static void
+rtx_control_remember(RtxControl *control, GstBuffer *buffer, guint now_ms)
+{
+  GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+  if (!gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp))
+    return;
+
+  guint seqnum = gst_rtp_buffer_get_seq(&rtp);
+  guint slot = seqnum & (RTX_HISTORY_SLOTS - 1);
+  guint ssrc = gst_rtp_buffer_get_ssrc(&rtp);
+  for (guint i = 0; i < RTX_MEDIA_SSRCS; i++)
+  {
+    guint known = g_atomic_int_get(&control->media_ssrcs[i]);
+    if (known == ssrc)
+      break;
+    if (known == 0)
+    {
+      g_atomic_int_set(&control->media_ssrcs[i], ssrc);
+      break;
+    }
+  }
+  g_atomic_int_set(&control->sent_ms[slot], now_ms);
+  g_atomic_int_set(&control->sizes[slot], gst_buffer_get_size(buffer));
+  g_atomic_int_set(&control->seqnums[slot], seqnum);
+  gst_rtp_buffer_unmap(&rtp);
+}
+
+static GstPadProbeReturn
+rtx_control_sink_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  RtxControl *control = (RtxControl *)user_data;
+  guint now_ms = rtx_control_now_ms();
+
+  if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+  {
+    GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+    guint length = gst_buffer_list_length(list);
+    for (guint i = 0; i < length; i++)
+      rtx_control_remember(control, gst_buffer_list_get(list, i), now_ms);
+  }
+  else
+    rtx_control_remember(control, GST_PAD_PROBE_INFO_BUFFER(info), now_ms);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+rtx_control_count(RtxControl *control, GstBuffer *buffer)
+{
+  GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+  if (!gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp))
+    return;
+
+  guint ssrc = gst_rtp_buffer_get_ssrc(&rtp);
+  gst_rtp_buffer_unmap(&rtp);
+  for (guint i = 0; i < RTX_MEDIA_SSRCS; i++)
+  {
+    if ((guint)g_atomic_int_get(&control->media_ssrcs[i]) == ssrc)
+      return;
+  }
+
+  g_atomic_int_inc(&control->rtx_packets);
+  control->rtx_bytes.fetch_add(gst_buffer_get_size(buffer), std::memory_order_relaxed);
+}
+
+static GstPadProbeReturn
+rtx_control_src_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  RtxControl *control = (RtxControl *)user_data;
+
+  if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+  {
+    GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+    guint length = gst_buffer_list_length(list);
+    for (guint i = 0; i < length; i++)
+      rtx_control_count(control, gst_buffer_list_get(list, i));
+  }
+  else
+    rtx_control_count(control, GST_PAD_PROBE_INFO_BUFFER(info));
+
+  return GST_PAD_PROBE_OK;
+}
+
+// Returns FALSE for a request that should not be served.
+static gboolean
+rtx_control_admit(RtxControl *control, guint seqnum)
+{
+  guint slot = seqnum & (RTX_HISTORY_SLOTS - 1);
+  guint now_ms = rtx_control_now_ms();
+  guint size = 0;
+
+  g_atomic_int_inc(&control->requests);
+  if ((guint)g_atomic_int_get(&control->seqnums[slot]) == seqnum)
+  {
+    gint deadline_ms = g_atomic_int_get(&control->deadline_ms);
+    guint age_ms = now_ms - (guint)g_atomic_int_get(&control->sent_ms[slot]);
+    if (deadline_ms > 0 && age_ms > (guint)deadline_ms)
+    {
+      g_atomic_int_inc(&control->skipped_late);
+      return FALSE;
+    }
+    size = g_atomic_int_get(&control->sizes[slot]);
+  }
+
+  gint budget_bps = g_atomic_int_get(&control->budget_bps);
+  if (budget_bps <= 0 || size == 0)
+    return TRUE;
+
+  gint64 now_us = g_get_monotonic_time();
+  gdouble burst = budget_bps / 8.0 * RTX_BUDGET_BURST_MS / 1000.0;
+  if (control->bucket_us == 0)
+    control->bucket_bytes = burst;
+  else
+    control->bucket_bytes = MIN(burst, control->bucket_bytes +
+                                           budget_bps / 8.0 * (now_us - control->bucket_us) / G_USEC_PER_SEC);
+  control->bucket_us = now_us;
+
+  if (control->bucket_bytes < size)
+  {
+    g_atomic_int_inc(&control->skipped_budget);
+    return FALSE;
+  }
+  control->bucket_bytes -= size;
+  return TRUE;
+}
+
+// rtpsession sends the requests from its RTCP thread, one at a time.
+static GstPadProbeReturn
+rtx_control_request_probe_cb(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  RtxControl *control = (RtxControl *)user_data;
+  GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+  guint seqnum;
+
+  if (GST_EVENT_TYPE(event) != GST_EVENT_CUSTOM_UPSTREAM ||
+      !gst_event_has_name(event, "GstRTPRetransmissionRequest") ||
+      !gst_structure_get_uint(gst_event_get_structure(event), "seqnum", &seqnum))
+    return GST_PAD_PROBE_OK;
+
+  return rtx_control_admit(control, seqnum) ? GST_PAD_PROBE_OK : GST_PAD_PROBE_DROP;
+}
+
+// Allocates a control shared by the viewer and the probes, each takes a reference with
+// rtx_control_acquire() and releases it with rtx_control_release(). Allocated with new, like the
+// fan-out consumers, as it holds a std::atomic.
+static RtxControl *
+rtx_control_new(void)
+{
+  RtxControl *control = new RtxControl();
+  control->refs.store(1);
+  // Zero is a sequence number; an empty slot must not look like the original of packet 0
+  for (guint i = 0; i < RTX_HISTORY_SLOTS; i++)
+    control->seqnums[i] = RTX_NO_SEQNUM;
+  return control;
+}
+
+static gpointer
+rtx_control_acquire(RtxControl *control)
+{
+  control->refs.fetch_add(1);
+  return control;
+}
+
+static void
+rtx_control_release(gpointer data)
+{
+  RtxControl *control = (RtxControl *)data;
+  if (control->refs.fetch_sub(1) == 1)
+    delete control;
+}
+
+// Puts control in front of rtxsend (an rtprtxsend).
+static void
+attach_rtx_control(GstElement *rtxsend, RtxControl *control)
+{
+  GstPad *sink = gst_element_get_static_pad(rtxsend, "sink");
+  GstPad *src = gst_element_get_static_pad(rtxsend, "src");
+  if (sink != NULL && src != NULL)
+  {
+    gst_pad_add_probe(sink, (GstPadProbeType)(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                      rtx_control_sink_probe_cb, rtx_control_acquire(control), rtx_control_release);
+    gst_pad_add_probe(src, GST_PAD_PROBE_TYPE_EVENT_UPSTREAM, rtx_control_request_probe_cb,
+                      rtx_control_acquire(control), rtx_control_release);
+    gst_pad_add_probe(src, (GstPadProbeType)(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                      rtx_control_src_probe_cb, rtx_control_acquire(control), rtx_control_release);
+  }
+  if (sink)
+    gst_object_unref(sink);
+  if (src)
+    gst_object_unref(src);
+}
+
+// Recomputes the deadline and budget from the viewer's RTT (ms, <= 0 if unknown) and send rate.
+// Returns the history window rtprtxsend should keep in ms, 0 for its default.
+static gint
+rtx_control_update(RtxControl *control, gdouble rtt_ms, gint fps, gint deadline_frames, gdouble send_kbps,
+                   gint max_share)
+{
+  gint deadline_ms = 0;
+  if (deadline_frames > 0)
+    deadline_ms = (gint)(rtt_ms > 0 ? rtt_ms : RTX_DEFAULT_RTT_MS) + deadline_frames * 1000 / MAX(fps, 1);
+  g_atomic_int_set(&control->deadline_ms, deadline_ms);
+  g_atomic_int_set(&control->budget_bps, max_share > 0 ? (gint)(send_kbps * 10.0 * max_share) : 0);
+  return deadline_ms;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////
+// Per-viewer retransmission statistics: what the viewer asked for (NACK, PLI and FIR packets
+// rtpsession received from it) and what it cost (RTX requests, packets and bytes). Collected on
+// the main loop for the periodic report and GET /viewer-stats (loopback only).
+
+#define VIEWER_STATS_PATH "/viewer-stats"
+
+typedef struct
+{
+  guint nack_received; // RTCP NACK packets, each can name several sequence numbers
+  guint pli_received;
+  guint fir_received;
+  guint rtx_requests;  // sequence numbers NACKed
+  guint rtx_packets;
+  guint64 rtx_bytes;
+  guint skipped_late;
+  guint skipped_budget;
+} ViewerRtxStats;
+
+static gboolean
+viewer_rtx_stats_add_source(GQuark field_id, const GValue *value, gpointer user_data)
+{
+  (void)field_id;
+  ViewerRtxStats *stats = (ViewerRtxStats *)user_data;
+  gboolean internal = FALSE;
+  guint count;
+
+  if (!GST_VALUE_HOLDS_STRUCTURE(value))
+    return TRUE;
+  const GstStructure *source = gst_value_get_structure(value);
+  if (!gst_structure_get_boolean(source, "internal", &internal) || !internal)
+    return TRUE;
+
+  if (gst_structure_get_uint(source, "recv-nack-count", &count))
+    stats->nack_received += count;
+  if (gst_structure_get_uint(source, "recv-pli-count", &count))
+    stats->pli_received += count;
+  if (gst_structure_get_uint(source, "recv-fir-count", &count))
+    stats->fir_received += count;
+  return TRUE;
+}
+
+// rtpbin is the viewer's (owned by its webrtcbin), control its RtxControl; either may be NULL.
+static void
+viewer_rtx_stats_collect(ViewerRtxStats *stats, GstElement *rtpbin, RtxControl *control)
+{
+  memset(stats, 0, sizeof(ViewerRtxStats));
+
+  if (rtpbin != NULL)
+  {
+    GObject *session = NULL;
+    g_signal_emit_by_name(rtpbin, "get-internal-session", 0, &session);
+    if (session != NULL)
+    {
+      GstStructure *session_stats = NULL;
+      g_object_get(session, "stats", &session_stats, NULL);
+      if (session_stats != NULL)
+      {
+        const GValue *sources = gst_structure_get_value(session_stats, "source-stats");
+        if (sources != NULL && G_VALUE_HOLDS(sources, G_TYPE_VALUE_ARRAY))
+        {
+          G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+          GValueArray *array = (GValueArray *)g_value_get_boxed(sources);
+          for (guint i = 0; array != NULL && i < array->n_values; i++)
+            viewer_rtx_stats_add_source(0, g_value_array_get_nth(array, i), stats);
+          G_GNUC_END_IGNORE_DEPRECATIONS
+        }
+        gst_structure_free(session_stats);
+      }
+      g_object_unref(session);
+    }
+  }
+
+  if (control != NULL)
+  {
+    stats->rtx_requests = g_atomic_int_get(&control->requests);
+    stats->rtx_packets = g_atomic_int_get(&control->rtx_packets);
+    stats->rtx_bytes = control->rtx_bytes.load(std::memory_order_relaxed);
+    stats->skipped_late = g_atomic_int_get(&control->skipped_late);
+    stats->skipped_budget = g_atomic_int_get(&control->skipped_budget);
+  }
+}
+
+static void
+viewer_rtx_stats_add_members(JsonBuilder *builder, const ViewerRtxStats *stats)
+{
+  json_builder_set_member_name(builder, "nack_received");
+  json_builder_add_int_value(builder, stats->nack_received);
+  json_builder_set_member_name(builder, "pli_received");
+  json_builder_add_int_value(builder, stats->pli_received);
+  json_builder_set_member_name(builder, "fir_received");
+  json_builder_add_int_value(builder, stats->fir_received);
+  json_builder_set_member_name(builder, "rtx_requests");
+  json_builder_add_int_value(builder, stats->rtx_requests);
+  json_builder_set_member_name(builder, "rtx_packets");
+  json_builder_add_int_value(builder, stats->rtx_packets);
+  json_builder_set_member_name(builder, "rtx_bytes");
+  json_builder_add_int_value(builder, (gint64)stats->rtx_bytes);
+  json_builder_set_member_name(builder, "rtx_skipped_late");
+  json_builder_add_int_value(builder, stats->skipped_late);
+  json_builder_set_member_name(builder, "rtx_skipped_budget");
+  json_builder_add_int_value(builder, stats->skipped_budget);
+}
+
+#endif // RTX_CONTROL_H
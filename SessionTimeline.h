@@ -0,0 +1,208 @@
+#ifndef SESSION_TIMELINE_H
+#define SESSION_TIMELINE_H
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <json-glib/json-glib.h>
+#include <atomic>
+
+#ifndef GST_USE_UNSTABLE_API
+#define GST_USE_UNSTABLE_API
+#endif
+#include <gst/webrtc/webrtc.h>
+
+#include "EncoderTelemetry.h"
+
+// Session setup timeline.
+//
+// Every viewer records when it reached each step between the websocket being accepted and video
+// leaving its queue: negotiation-needed, offer sent, answer received, first local and remote ICE
+// candidate, ICE connected, DTLS connected and the first buffer on the queue's src pad. Each step
+// is kept as the time since the accept, once, on whichever thread gets there.
+//
+// Across viewers the same times go into log2 histograms (the encoder telemetry's), so GET
+// /viewer-stats can tell p50/p95/p99 per step. A viewer that reached every step prints its
+// timeline, which shows where a slow one spent its time.
+//
+// webrtcbin has no DTLS signal of its own; the peer connection state turns connected once every
+// DTLS transport is, so that is taken as DTLS connected.
+
+typedef enum
+{
+  SESSION_NEGOTIATION_NEEDED,
+  SESSION_OFFER_SENT,
+  SESSION_ANSWER_RECEIVED,
+  SESSION_FIRST_LOCAL_CANDIDATE,
+  SESSION_FIRST_REMOTE_CANDIDATE,
+  SESSION_ICE_CONNECTED,
+  SESSION_DTLS_CONNECTED,
+  SESSION_FIRST_BUFFER,
+  SESSION_MILESTONES
+} SessionMilestone;
+
+static const gchar *const session_milestone_names[SESSION_MILESTONES] = {
+    "negotiation_needed", "offer_sent", "answer_received", "first_local_candidate",
+    "first_remote_candidate", "ice_connected", "dtls_connected", "first_buffer"};
+
+// All viewers since start. Lives until exit.
+typedef struct
+{
+  std::atomic<guint64> sessions;
+  TelemetryHistogram since_accept_us[SESSION_MILESTONES];
+} SessionStats;
+
+// Per viewer, shared by the main loop, webrtcbin's signals and the queue's src probe.
+typedef struct
+{
+  SessionStats *stats;
+  gint64 accepted_us;              // 0 while the viewer waits in the pool
+  gchar *label;
+  gint at_us[SESSION_MILESTONES];  // since the accept, 0 until reached
+  gint reached;
+} SessionTimeline;
+
+static SessionStats *
+session_stats_new()
+{
+  return new SessionStats();
+}
+
+static void
+session_timeline_clear(gpointer data)
+{
+  g_free(((SessionTimeline *)data)->label);
+}
+
+static void
+session_timeline_release(gpointer timeline)
+{
+  g_atomic_rc_box_release_full(timeline, session_timeline_clear);
+}
+
+static SessionTimeline *
+session_timeline_new(SessionStats *stats)
+{
+  SessionTimeline *timeline = g_atomic_rc_box_new0(SessionTimeline);
+  timeline->stats = stats;
+  return timeline;
+}
+
+// The websocket was accepted at accepted_us. Call on the main loop before the viewer is connected;
+// nothing is recorded before.
+static void
+session_timeline_start(SessionTimeline *timeline, gint64 accepted_us, const gchar *label)
+{
+  timeline->label = g_strdup(label);
+  timeline->accepted_us = accepted_us;
+  timeline->stats->sessions.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void
+session_timeline_print(SessionTimeline *timeline)
+{
+  GString *line = g_string_new(NULL);
+  g_string_append_printf(line, "🧭 %s: setup", timeline->label);
+  for (guint i = 0; i < SESSION_MILESTONES; i++)
+    g_string_append_printf(line, "%s %s %.1f ms", i == 0 ? "" : ",", session_milestone_names[i],
+                           g_atomic_int_get(&timeline->at_us[i]) / 1000.0);
+  g_print("%s\n", line->str);
+  g_string_free(line, TRUE);
+}
+
+// Records milestone the first time it is reached, from any thread.
+static void
+session_timeline_mark(SessionTimeline *timeline, SessionMilestone milestone)
+{
+  if (timeline == NULL || timeline->accepted_us == 0)
+    return;
+
+  gint64 elapsed_us = g_get_monotonic_time() - timeline->accepted_us;
+  gint at_us = (gint)CLAMP(elapsed_us, 1, G_MAXINT);
+  if (!g_atomic_int_compare_and_exchange(&timeline->at_us[milestone], 0, at_us))
+    return;
+
+  telemetry_histogram_add(&timeline->stats->since_accept_us[milestone], (guint64)at_us);
+  if (g_atomic_int_add(&timeline->reached, 1) + 1 == SESSION_MILESTONES)
+    session_timeline_print(timeline);
+}
+
+static void
+session_timeline_ice_state_cb(GstElement *webrtcbin, G_GNUC_UNUSED GParamSpec *pspec, gpointer user_data)
+{
+  GstWebRTCICEConnectionState state;
+
+  g_object_get(webrtcbin, "ice-connection-state", &state, NULL);
+  if (state == GST_WEBRTC_ICE_CONNECTION_STATE_CONNECTED || state == GST_WEBRTC_ICE_CONNECTION_STATE_COMPLETED)
+    session_timeline_mark((SessionTimeline *)user_data, SESSION_ICE_CONNECTED);
+}
+
+static void
+session_timeline_connection_state_cb(GstElement *webrtcbin, G_GNUC_UNUSED GParamSpec *pspec, gpointer user_data)
+{
+  GstWebRTCPeerConnectionState state;
+
+  g_object_get(webrtcbin, "connection-state", &state, NULL);
+  if (state == GST_WEBRTC_PEER_CONNECTION_STATE_CONNECTED)
+    session_timeline_mark((SessionTimeline *)user_data, SESSION_DTLS_CONNECTED);
+}
+
+static GstPadProbeReturn
+session_timeline_buffer_probe_cb(G_GNUC_UNUSED GstPad *pad, G_GNUC_UNUSED GstPadProbeInfo *info, gpointer user_data)
+{
+  SessionTimeline *timeline = (SessionTimeline *)user_data;
+
+  session_timeline_mark(timeline, SESSION_FIRST_BUFFER);
+  return g_atomic_int_get(&timeline->at_us[SESSION_FIRST_BUFFER]) != 0 ? GST_PAD_PROBE_REMOVE : GST_PAD_PROBE_OK;
+}
+
+// Watches webrtcbin's ICE and peer connection states and the first buffer out of queue_element.
+// The other milestones are marked by the signalling code.
+static void
+attach_session_timeline(SessionTimeline *timeline, GstElement *webrtcbin, GstElement *queue_element)
+{
+  g_signal_connect_data(webrtcbin, "notify::ice-connection-state", G_CALLBACK(session_timeline_ice_state_cb),
+                        g_atomic_rc_box_acquire(timeline), (GClosureNotify)session_timeline_release, (GConnectFlags)0);
+  g_signal_connect_data(webrtcbin, "notify::connection-state", G_CALLBACK(session_timeline_connection_state_cb),
+                        g_atomic_rc_box_acquire(timeline), (GClosureNotify)session_timeline_release, (GConnectFlags)0);
+
+  GstPad *src = gst_element_get_static_pad(queue_element, "src");
+  gst_pad_add_probe(src, (GstPadProbeType)(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                    session_timeline_buffer_probe_cb, g_atomic_rc_box_acquire(timeline), session_timeline_release);
+  gst_object_unref(src);
+}
+
+// The viewer's own timeline, in ms since the accept, steps not reached yet left out.
+static void
+session_timeline_add_members(JsonBuilder *builder, SessionTimeline *timeline)
+{
+  json_builder_set_member_name(builder, "setup_ms");
+  json_builder_begin_object(builder);
+  for (guint i = 0; i < SESSION_MILESTONES; i++)
+  {
+    gint at_us = g_atomic_int_get(&timeline->at_us[i]);
+    if (at_us == 0)
+      continue;
+    json_builder_set_member_name(builder, session_milestone_names[i]);
+    json_builder_add_double_value(builder, at_us / 1000.0);
+  }
+  json_builder_end_object(builder);
+}
+
+// Percentiles per step over every viewer since start, in µs since the accept.
+static void
+session_stats_add_member(JsonBuilder *builder, SessionStats *stats)
+{
+  json_builder_set_member_name(builder, "session_setup");
+  json_builder_begin_object(builder);
+  json_builder_set_member_name(builder, "sessions");
+  json_builder_add_int_value(builder, stats->sessions.load(std::memory_order_relaxed));
+  for (guint i = 0; i < SESSION_MILESTONES; i++)
+  {
+    gchar *name = g_strdup_printf("%s_us", session_milestone_names[i]);
+    telemetry_add_histogram_member(builder, name, &stats->since_accept_us[i]);
+    g_free(name);
+  }
+  json_builder_end_object(builder);
+}
+
+#endif // SESSION_TIMELINE_H
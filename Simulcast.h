@@ -0,0 +1,141 @@
+#ifndef SIMULCAST_H
+#define SIMULCAST_H
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <stdlib.h>
+
+#include "EncoderBackend.h"
+#include "KeyframeControl.h"
+#include "LiveControl.h"
+
+// Rendition ladder for simulcast (--renditions=1080,720,360).
+//
+// One capture is split after videorate; every rendition scales it to its height (keeping the
+// input aspect ratio), has its own encoder and its own tee of encoded, not yet payloaded, video.
+// Viewers carry their own payloader, so moving a viewer from one rendition tee to another at an
+// IDR keeps its SSRC, sequence numbers and RTP timestamps continuous. Rendition 0 keeps the
+// names of the single-encoder pipeline ("venc", tee "t"), so live control, keyframe control and
+// ABR act on the top rendition, and the UDP client is fed from it.
+
+#define SIMULCAST_MAX_RENDITIONS 4
+#define SIMULCAST_MIN_BITRATE 300 // kbps, floor for the scaled-down renditions
+
+typedef struct
+{
+  gint width;
+  gint height;
+  gint bitrate_kbps;
+  gchar *encoder_name;
+  gchar *tee_name;
+  GstElement *tee;            // set once the pipeline is built
+  KeyframeControl *keyframes; // per-rendition IDR requests (switches, joins, PLI/FIR)
+} Rendition;
+
+typedef struct
+{
+  guint count; // 0 = simulcast off, single encoder as before
+  Rendition renditions[SIMULCAST_MAX_RENDITIONS];
+} RenditionLadder;
+
+// Parses a comma separated list of heights, highest first. Bitrates scale with the pixel count
+// from bitrate_kbps at the top rendition.
+static gboolean
+parse_rendition_ladder(const gchar *spec, gint width, gint height, gint bitrate_kbps, RenditionLadder *ladder)
+{
+  ladder->count = 0;
+  if (spec == NULL || spec[0] == '\0')
+    return TRUE;
+
+  gchar **heights = g_strsplit(spec, ",", -1);
+  gboolean ok = TRUE;
+
+  for (guint i = 0; heights[i] != NULL && ok; i++)
+  {
+    gint rendition_height = atoi(g_strstrip(heights[i]));
+    Rendition *previous = ladder->count > 0 ? &ladder->renditions[ladder->count - 1] : NULL;
+
+    if (ladder->count == SIMULCAST_MAX_RENDITIONS || rendition_height < 90 || rendition_height > height ||
+        (previous && rendition_height >= previous->height))
+    {
+      ok = FALSE;
+      break;
+    }
+
+    Rendition *rendition = &ladder->renditions[ladder->count];
+    rendition->height = rendition_height & ~1;
+    rendition->width = (gint)((gint64)width * rendition_height / height) & ~1;
+    rendition->encoder_name = ladder->count == 0 ? g_strdup(VIDEO_ENCODER_NAME)
+                                                 : g_strdup_printf(VIDEO_ENCODER_NAME "_%u", ladder->count);
+    rendition->tee_name = ladder->count == 0 ? g_strdup("t") : g_strdup_printf("t_%u", ladder->count);
+    ladder->count++;
+  }
+  g_strfreev(heights);
+
+  if (!ok || ladder->count < 2)
+  {
+    for (guint i = 0; i < ladder->count; i++)
+    {
+      g_free(ladder->renditions[i].encoder_name);
+      g_free(ladder->renditions[i].tee_name);
+    }
+    ladder->count = 0;
+    return FALSE;
+  }
+
+  gdouble top_pixels = (gdouble)ladder->renditions[0].width * ladder->renditions[0].height;
+  for (guint i = 0; i < ladder->count; i++)
+  {
+    Rendition *rendition = &ladder->renditions[i];
+    gint scaled = (gint)(bitrate_kbps * (rendition->width * (gdouble)rendition->height) / top_pixels);
+    rendition->bitrate_kbps = i == 0 ? bitrate_kbps : MAX(scaled, SIMULCAST_MIN_BITRATE);
+  }
+  return TRUE;
+}
+
+// Builds the whole video branch: capture head, videorate, one encoder + tee per rendition and the
+// UDP client (udp_egress, see UdpEgress.h) on rendition 0. Free with g_free().
+static gchar *
+build_simulcast_video_string(const RenditionLadder *ladder, const gchar *source_head, gint fps,
+                             gint input_width, gint input_height,
+                             const EncoderBackend *backend, EncoderPreset preset,
+                             const EncoderOptions *options, const gchar *udp_egress)
+{
+  GString *pipeline = g_string_new(NULL);
+
+  g_string_append_printf(pipeline, "%s ! videorate name=" VIDEO_RATE_NAME " drop-only=true max-rate=%d ! "
+                                   "tee name=rt ",
+                         source_head, fps);
+
+  for (guint i = 0; i < ladder->count; i++)
+  {
+    const Rendition *rendition = &ladder->renditions[i];
+    gchar *encoder = build_encoder_string(backend, preset, rendition->bitrate_kbps, options,
+                                          rendition->encoder_name);
+
+    g_string_append(pipeline, "rt. ! queue ! ");
+    if (rendition->width != input_width || rendition->height != input_height)
+      g_string_append_printf(pipeline, "videoscale ! video/x-raw,width=%d,height=%d ! ",
+                             rendition->width, rendition->height);
+    g_string_append_printf(pipeline, "%s ! tee name=%s allow-not-linked=true ", encoder, rendition->tee_name);
+    g_free(encoder);
+  }
+
+  gchar *payloader = build_payloader_string(backend, VIDEO_PAYLOADER_NAME, options->rtp_mtu);
+  g_string_append_printf(pipeline, "t. ! queue ! %s ! %s", payloader, udp_egress);
+  g_free(payloader);
+
+  return g_string_free(pipeline, FALSE);
+}
+
+static void
+print_rendition_ladder(const RenditionLadder *ladder)
+{
+  g_print(" Simulcast renditions:");
+  for (guint i = 0; i < ladder->count; i++)
+    g_print(" %dx%d@%dkbps", ladder->renditions[i].width, ladder->renditions[i].height,
+            ladder->renditions[i].bitrate_kbps);
+  g_print("\n");
+}
+
+#endif // SIMULCAST_H
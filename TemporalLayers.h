@@ -0,0 +1,377 @@
+#ifndef TEMPORAL_LAYERS_H
+#define TEMPORAL_LAYERS_H
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <gst/rtp/gstrtpbuffer.h>
+#include <string.h>
+
+#include "EncoderBackend.h"
+
+// Temporal layers (--temporal-layers): per-viewer frame-rate reduction from one encoder.
+//
+// With hierarchical-P (layer ids 0,2,1,2 over four frames) every layer only references the
+// layers below it, so a viewer can be fed layer 0 (15 fps), layers 0-1 (30 fps) or everything
+// (60 fps) from the same stream. A probe on the encoder src pad tags each encoded frame with its
+// layer, keyed by PTS; the per-viewer filter in front of the viewer's queue looks the layer up
+// and drops frames above the viewer's limit. On RTP (single-encoder pipeline) it also closes the
+// gaps it leaves in the sequence numbers and VP8 picture IDs, so the viewer never NACKs them.
+//
+// Layer ids come from the bitstream where the codec carries them (H.264 SVC prefix NAL
+// temporal_id, H.265 TemporalId, otherwise H.264 nal_ref_idc == 0 frames as layer 1), and for
+// VP8 from the layer id vp8enc attaches to each frame (GstVP8Meta, GStreamer 1.20+), the same one
+// rtpvp8pay writes as TID. Without that meta every VP8 frame counts as layer 0 and nothing is
+// dropped, rather than guessing the position in the pattern.
+
+#define TEMPORAL_LAYER_COUNT 3
+#define TEMPORAL_LAYER_HISTORY 64        // frames remembered for the PTS lookup
+#define TEMPORAL_LAYER_DECAY_FRAMES 120  // halve the per-layer byte counts every 2 s at 60 fps
+
+#define TEMPORAL_VP8_META "GstVP8Meta"
+
+typedef enum
+{
+  TEMPORAL_CODEC_H264,
+  TEMPORAL_CODEC_H265,
+  TEMPORAL_CODEC_VP8
+} TemporalCodec;
+
+typedef struct
+{
+  GMutex lock;
+  TemporalCodec codec;
+  GstClockTime pts[TEMPORAL_LAYER_HISTORY];
+  guint8 layer[TEMPORAL_LAYER_HISTORY];
+  guint head;
+  gdouble layer_bytes[TEMPORAL_LAYER_COUNT];
+  guint frames_since_decay;
+  gint max_layer_seen;
+} TemporalLayerMap;
+
+typedef struct
+{
+  TemporalLayerMap *map;     // the encoder feeding this viewer (changes on rendition switch)
+  gint max_layer;            // set from the main loop, highest layer forwarded
+  gboolean rewrite_rtp;      // filter sees RTP packets, keep seq/picture-id continuous
+  GstClockTime frame_pts;    // frame the last buffer belonged to
+  gboolean dropping_frame;
+  guint16 dropped_packets;   // seqnum offset
+  guint16 dropped_pictures;  // VP8 picture-id offset
+  guint64 dropped_frames;
+} TemporalLayerFilter;
+
+// Layer of one H.264/H.265 NAL unit, -1 if it says nothing about layers.
+static gint
+temporal_layer_of_nal(TemporalCodec codec, const guint8 *nal, gsize size)
+{
+  if (size < 2)
+    return -1;
+
+  if (codec == TEMPORAL_CODEC_H265)
+  {
+    guint type = (nal[0] >> 1) & 0x3f;
+    guint temporal_id_plus1 = nal[1] & 0x07;
+    return (type < 32 && temporal_id_plus1 > 0) ? (gint)temporal_id_plus1 - 1 : -1;
+  }
+
+  guint type = nal[0] & 0x1f;
+  if ((type == 14 || type == 20) && size >= 4)
+    return nal[3] >> 5; // SVC extension temporal_id
+  if (type == 1 || type == 5)
+    return ((nal[0] >> 5) & 0x03) == 0 ? 1 : 0; // non-reference slices are disposable
+  return -1;
+}
+
+// Walks the NAL units of one access unit, byte-stream (start codes) or 4-byte length prefixed.
+static gint
+temporal_layer_of_access_unit(TemporalCodec codec, const guint8 *data, gsize size)
+{
+  gint layer = -1;
+  gboolean byte_stream = size >= 4 && data[0] == 0 && data[1] == 0 &&
+                         (data[2] == 1 || (data[2] == 0 && data[3] == 1));
+  gsize offset = 0;
+
+  while (offset + 4 < size)
+  {
+    gsize start, end;
+
+    if (byte_stream)
+    {
+      while (offset + 3 <= size && !(data[offset] == 0 && data[offset + 1] == 0 && data[offset + 2] == 1))
+        offset++;
+      start = offset + 3;
+      end = start;
+      while (end + 3 <= size && !(data[end] == 0 && data[end + 1] == 0 && (data[end + 2] == 1 || data[end + 2] == 0)))
+        end++;
+      if (end + 3 > size)
+        end = size;
+    }
+    else
+    {
+      gsize length = ((gsize)data[offset] << 24) | (data[offset + 1] << 16) | (data[offset + 2] << 8) | data[offset + 3];
+      start = offset + 4;
+      end = MIN(start + length, size);
+    }
+
+    if (start >= size)
+      break;
+
+    gint nal_layer = temporal_layer_of_nal(codec, data + start, end - start);
+    // An SVC prefix / H.265 TemporalId is definitive, nal_ref_idc only a fallback
+    if (nal_layer >= 0 && (layer < 0 || nal_layer > layer))
+      layer = nal_layer;
+    offset = end;
+  }
+  return layer;
+}
+
+static TemporalLayerMap *
+temporal_layer_map_new(const EncoderBackend *backend)
+{
+  TemporalLayerMap *map = g_new0(TemporalLayerMap, 1);
+  g_mutex_init(&map->lock);
+  if (g_ascii_strcasecmp(backend->codec, "vp8") == 0)
+    map->codec = TEMPORAL_CODEC_VP8;
+  else if (g_ascii_strcasecmp(backend->codec, "h265") == 0)
+    map->codec = TEMPORAL_CODEC_H265;
+  else
+    map->codec = TEMPORAL_CODEC_H264;
+  for (guint i = 0; i < TEMPORAL_LAYER_HISTORY; i++)
+    map->pts[i] = GST_CLOCK_TIME_NONE;
+  return map;
+}
+
+static GstPadProbeReturn
+temporal_layer_tag_probe_cb(G_GNUC_UNUSED GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  TemporalLayerMap *map = (TemporalLayerMap *)user_data;
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+  gboolean keyframe = !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+  gint layer = 0;
+
+  if (map->codec == TEMPORAL_CODEC_VP8)
+  {
+    GstCustomMeta *meta = gst_buffer_get_custom_meta(buffer, TEMPORAL_VP8_META);
+    guint layer_id = 0;
+    gboolean temporal_scaling = FALSE;
+    if (meta != NULL)
+    {
+      GstStructure *fields = gst_custom_meta_get_structure(meta);
+      if (gst_structure_get_boolean(fields, "use-temporal-scaling", &temporal_scaling) && temporal_scaling)
+        gst_structure_get_uint(fields, "layer-id", &layer_id);
+    }
+    layer = keyframe ? 0 : (gint)layer_id;
+  }
+  else if (!keyframe)
+  {
+    GstMapInfo mapped;
+    if (gst_buffer_map(buffer, &mapped, GST_MAP_READ))
+    {
+      layer = MAX(temporal_layer_of_access_unit(map->codec, mapped.data, mapped.size), 0);
+      gst_buffer_unmap(buffer, &mapped);
+    }
+  }
+  layer = MIN(layer, TEMPORAL_LAYER_COUNT - 1);
+
+  g_mutex_lock(&map->lock);
+  map->pts[map->head] = GST_BUFFER_PTS(buffer);
+  map->layer[map->head] = layer;
+  map->head = (map->head + 1) % TEMPORAL_LAYER_HISTORY;
+  map->layer_bytes[layer] += gst_buffer_get_size(buffer);
+  map->max_layer_seen = MAX(map->max_layer_seen, layer);
+  if (++map->frames_since_decay >= TEMPORAL_LAYER_DECAY_FRAMES)
+  {
+    for (guint i = 0; i < TEMPORAL_LAYER_COUNT; i++)
+      map->layer_bytes[i] /= 2;
+    map->frames_since_decay = 0;
+  }
+  g_mutex_unlock(&map->lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+// Tags the frames of a replacement encoder (live profile switch) into the same map, so the
+// viewers' filters keep working.
+static void
+temporal_layer_map_retarget(TemporalLayerMap *map, GstElement *encoder)
+{
+  if (map == NULL)
+    return;
+
+  GstPad *src_pad = gst_element_get_static_pad(encoder, "src");
+  gst_pad_add_probe(src_pad, GST_PAD_PROBE_TYPE_BUFFER, temporal_layer_tag_probe_cb, map, NULL);
+  gst_object_unref(src_pad);
+}
+
+// Tags frames at the output of the named encoder. The map lives until exit, like the pipeline.
+static TemporalLayerMap *
+attach_temporal_layer_map(GstElement *pipeline, const EncoderBackend *backend, const gchar *encoder_name)
+{
+  GstElement *encoder = gst_bin_get_by_name(GST_BIN(pipeline), encoder_name);
+  if (encoder == NULL)
+    return NULL;
+
+  TemporalLayerMap *map = temporal_layer_map_new(backend);
+  temporal_layer_map_retarget(map, encoder);
+  gst_object_unref(encoder);
+  return map;
+}
+
+static gint
+temporal_layer_map_lookup(TemporalLayerMap *map, GstClockTime pts)
+{
+  gint layer = -1;
+
+  g_mutex_lock(&map->lock);
+  for (guint i = 0; i < TEMPORAL_LAYER_HISTORY; i++)
+  {
+    guint index = (map->head + TEMPORAL_LAYER_HISTORY - 1 - i) % TEMPORAL_LAYER_HISTORY;
+    if (map->pts[index] == pts)
+    {
+      layer = map->layer[index];
+      break;
+    }
+  }
+  g_mutex_unlock(&map->lock);
+  return layer;
+}
+
+// Number of layers the encoder actually produces (1 = nothing to drop).
+static guint
+temporal_layer_map_count(TemporalLayerMap *map)
+{
+  g_mutex_lock(&map->lock);
+  guint count = map->max_layer_seen + 1;
+  g_mutex_unlock(&map->lock);
+  return count;
+}
+
+// Share of the encoder bitrate a viewer receives with layers 0..max_layer.
+static gdouble
+temporal_layer_map_fraction(TemporalLayerMap *map, gint max_layer)
+{
+  gdouble kept = 0, total = 0;
+
+  g_mutex_lock(&map->lock);
+  for (gint i = 0; i < TEMPORAL_LAYER_COUNT; i++)
+  {
+    total += map->layer_bytes[i];
+    if (i <= max_layer)
+      kept += map->layer_bytes[i];
+  }
+  g_mutex_unlock(&map->lock);
+  return total > 0 ? kept / total : 1.0;
+}
+
+static void
+temporal_layer_filter_init(TemporalLayerFilter *filter, TemporalLayerMap *map, gboolean rewrite_rtp)
+{
+  memset(filter, 0, sizeof(TemporalLayerFilter));
+  filter->map = map;
+  filter->max_layer = TEMPORAL_LAYER_COUNT - 1;
+  filter->rewrite_rtp = rewrite_rtp;
+  filter->frame_pts = GST_CLOCK_TIME_NONE;
+}
+
+// The VP8 picture ID rtpvp8pay put in buffer, 7 or 15 bits. FALSE if it sent none.
+static gboolean
+rtp_vp8_picture_id(GstBuffer *buffer, guint16 *picture_id)
+{
+  GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+  gboolean found = FALSE;
+
+  if (!gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp))
+    return FALSE;
+
+  const guint8 *payload = (const guint8 *)gst_rtp_buffer_get_payload(&rtp);
+  guint payload_size = gst_rtp_buffer_get_payload_len(&rtp);
+  // Same layout as rtp_close_dropped_gap reads
+  if (payload_size >= 3 && (payload[0] & 0x80) && (payload[1] & 0x80))
+  {
+    if (!(payload[2] & 0x80))
+    {
+      *picture_id = payload[2];
+      found = TRUE;
+    }
+    else if (payload_size >= 4)
+    {
+      *picture_id = ((payload[2] & 0x7f) << 8) | payload[3];
+      found = TRUE;
+    }
+  }
+  gst_rtp_buffer_unmap(&rtp);
+  return found;
+}
+
+// Closes the gaps dropped frames leave in the RTP sequence numbers and, when rtpvp8pay sends
+// one, the VP8 picture ID. Dropped frames are never sent, so RTX has nothing to resend for them.
+static void
+rtp_close_dropped_gap(GstBuffer *buffer, guint16 dropped_packets, guint16 dropped_pictures, gboolean vp8)
+{
+  GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+
+  if (!gst_rtp_buffer_map(buffer, GST_MAP_READWRITE, &rtp))
+    return;
+
+  gst_rtp_buffer_set_seq(&rtp, gst_rtp_buffer_get_seq(&rtp) - dropped_packets);
+
+  guint8 *payload = (guint8 *)gst_rtp_buffer_get_payload(&rtp);
+  guint payload_size = gst_rtp_buffer_get_payload_len(&rtp);
+  // VP8 descriptor: X bit, then I bit, then 7 or 15 bit picture ID (RFC 7741)
+  if (vp8 && dropped_pictures != 0 && payload_size >= 3 && (payload[0] & 0x80) && (payload[1] & 0x80))
+  {
+    if ((payload[2] & 0x80) && payload_size >= 4)
+    {
+      guint16 picture_id = (((payload[2] & 0x7f) << 8) | payload[3]) - dropped_pictures;
+      payload[2] = 0x80 | ((picture_id >> 8) & 0x7f);
+      payload[3] = picture_id & 0xff;
+    }
+    else
+    {
+      payload[2] = (payload[2] - dropped_pictures) & 0x7f;
+    }
+  }
+  gst_rtp_buffer_unmap(&rtp);
+}
+
+// Decides on one buffer in front of a viewer's queue. Returns FALSE to drop it; may replace
+// *buffer with a writable copy when RTP headers need rewriting.
+static gboolean
+temporal_layer_filter_buffer(TemporalLayerFilter *filter, GstBuffer **buffer)
+{
+  TemporalLayerMap *map = (TemporalLayerMap *)g_atomic_pointer_get(&filter->map);
+  GstClockTime pts = GST_BUFFER_PTS(*buffer);
+
+  if (map == NULL)
+    return TRUE;
+
+  // The limit is latched per frame so a frame is never cut in the middle.
+  if (pts != filter->frame_pts)
+  {
+    filter->frame_pts = pts;
+    gint layer = temporal_layer_map_lookup(map, pts);
+    filter->dropping_frame = layer > g_atomic_int_get(&filter->max_layer);
+    if (filter->dropping_frame)
+    {
+      filter->dropped_frames++;
+      filter->dropped_pictures++;
+    }
+  }
+
+  if (filter->dropping_frame)
+  {
+    if (filter->rewrite_rtp)
+      filter->dropped_packets++;
+    return FALSE;
+  }
+
+  if (filter->rewrite_rtp && (filter->dropped_packets != 0 || filter->dropped_pictures != 0))
+  {
+    *buffer = gst_buffer_make_writable(*buffer);
+    rtp_close_dropped_gap(*buffer, filter->dropped_packets, filter->dropped_pictures,
+                          map->codec == TEMPORAL_CODEC_VP8);
+  }
+  return TRUE;
+}
+
+#endif // TEMPORAL_LAYERS_H
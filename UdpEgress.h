@@ -0,0 +1,407 @@
+#ifndef UDP_EGRESS_H
+#define UDP_EGRESS_H
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+
+// Video egress for the plain UDP client (--udp-egress).
+//
+// udpsink costs one syscall per RTP packet unless it gets buffer lists, and the payloaders only
+// push lists for the fragments of one NAL unit. The batched modes replace udpsink with an appsink
+// and send from its callback:
+//   sendmmsg  every list, plus whatever the appsink already has queued, in one sendmmsg()
+//   gso       the same, with each run of equal-sized packets as one UDP GSO message
+//             (UDP_SEGMENT, Linux 4.18+), so the kernel also builds the packets in one pass
+// Nothing waits for more packets to arrive, so batching adds no latency, which keeps slice
+// output (--slices) worth it. If the kernel refuses GSO, egress falls back to sendmmsg.
+//
+// Every UDP_EGRESS_REPORT_SECONDS the packet rate, syscalls per second and the process CPU time
+// are printed, the same for all three modes, so runs can be compared on the same source.
+
+#define UDP_EGRESS_NAME "udpegress"
+#define UDP_EGRESS_BATCH 64          // packets per send, also the GSO segment limit
+#define UDP_EGRESS_MEMORIES 4        // per packet, larger buffers are merged
+#define UDP_EGRESS_GSO_BYTES 65000   // one GSO message must stay below 64 KiB
+#define UDP_EGRESS_REPORT_SECONDS 10
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103 // linux/udp.h
+#endif
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+
+typedef enum
+{
+  UDP_EGRESS_UDPSINK = 0,
+  UDP_EGRESS_SENDMMSG,
+  UDP_EGRESS_GSO,
+  UDP_EGRESS_COUNT
+} UdpEgressMode;
+
+static const gchar *udp_egress_names[UDP_EGRESS_COUNT] = {"udpsink", "sendmmsg", "gso"};
+
+typedef struct
+{
+  GstMemory *memory[UDP_EGRESS_MEMORIES];
+  GstMapInfo map[UDP_EGRESS_MEMORIES];
+  guint memories;
+  gsize size;
+} UdpEgressPacket;
+
+typedef struct
+{
+  std::atomic<UdpEgressMode> mode; // drops from GSO to sendmmsg if the kernel refuses it
+  int fd;                          // connected to the client, batched modes only
+
+  // Streaming thread only
+  UdpEgressPacket packets[UDP_EGRESS_BATCH];
+  guint count;
+  struct iovec iov[UDP_EGRESS_BATCH * UDP_EGRESS_MEMORIES];
+  struct mmsghdr messages[UDP_EGRESS_BATCH];
+  union
+  {
+    char buffer[CMSG_SPACE(sizeof(guint16))];
+    struct cmsghdr align;
+  } control[UDP_EGRESS_BATCH];
+
+  // Read by the report
+  std::atomic<guint64> sent_packets;
+  std::atomic<guint64> syscalls;
+  std::atomic<guint64> send_errors;
+
+  guint64 last_packets;
+  guint64 last_syscalls;
+  gint64 last_report_us;
+  struct rusage last_usage;
+} UdpEgress;
+
+static gboolean
+udp_egress_from_string(const gchar *name, UdpEgressMode *mode)
+{
+  if (name == NULL || name[0] == '\0')
+  {
+    *mode = UDP_EGRESS_UDPSINK;
+    return TRUE;
+  }
+
+  for (guint i = 0; i < UDP_EGRESS_COUNT; i++)
+  {
+    if (g_ascii_strcasecmp(name, udp_egress_names[i]) == 0)
+    {
+      *mode = (UdpEgressMode)i;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+// Sink element for the UDP client. Free with g_free().
+static gchar *
+build_udp_egress_string(UdpEgressMode mode, const gchar *host, gint port)
+{
+  if (mode == UDP_EGRESS_UDPSINK)
+    return g_strdup_printf("udpsink name=" UDP_EGRESS_NAME " clients=%s:%d auto-multicast=false", host, port);
+  // The callback sends, so the sink must not throttle or preroll on its own
+  return g_strdup("appsink name=" UDP_EGRESS_NAME " sync=false async=false buffer-list=true "
+                  "max-buffers=64 emit-signals=false");
+}
+
+static int
+udp_egress_connect(const gchar *host, gint port)
+{
+  struct addrinfo hints = {};
+  struct addrinfo *result = NULL;
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_NUMERICSERV;
+
+  gchar *service = g_strdup_printf("%d", port);
+  int status = getaddrinfo(host, service, &hints, &result);
+  g_free(service);
+  if (status != 0)
+  {
+    g_print("⚠ UDP egress: cannot resolve %s: %s\n", host, gai_strerror(status));
+    return -1;
+  }
+
+  int fd = -1;
+  for (struct addrinfo *address = result; address != NULL && fd < 0; address = address->ai_next)
+  {
+    fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+    if (fd >= 0 && connect(fd, address->ai_addr, address->ai_addrlen) != 0)
+    {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(result);
+  return fd;
+}
+
+static void
+udp_egress_release(UdpEgress *egress)
+{
+  for (guint i = 0; i < egress->count; i++)
+  {
+    UdpEgressPacket *packet = &egress->packets[i];
+    for (guint m = 0; m < packet->memories; m++)
+    {
+      gst_memory_unmap(packet->memory[m], &packet->map[m]);
+      gst_memory_unref(packet->memory[m]);
+    }
+    packet->memories = 0;
+  }
+  egress->count = 0;
+}
+
+// Fills messages from packets, one per packet or, with GSO, one per run of equal-sized packets
+// (the last one of a run may be shorter). Returns the number of messages.
+static guint
+udp_egress_build_messages(UdpEgress *egress)
+{
+  guint messages = 0;
+  guint iov = 0;
+
+  for (guint i = 0; i < egress->count;)
+  {
+    struct mmsghdr *message = &egress->messages[messages];
+    memset(message, 0, sizeof(*message));
+    message->msg_hdr.msg_iov = &egress->iov[iov];
+
+    gsize segment = egress->packets[i].size;
+    gsize total = 0;
+    guint segments = 0;
+    do
+    {
+      UdpEgressPacket *packet = &egress->packets[i];
+      for (guint m = 0; m < packet->memories; m++)
+      {
+        egress->iov[iov].iov_base = packet->map[m].data;
+        egress->iov[iov].iov_len = packet->map[m].size;
+        iov++;
+        message->msg_hdr.msg_iovlen++;
+      }
+      total += packet->size;
+      segments++;
+      i++;
+    } while (egress->mode == UDP_EGRESS_GSO && i < egress->count && egress->packets[i - 1].size == segment &&
+             egress->packets[i].size <= segment && total + egress->packets[i].size <= UDP_EGRESS_GSO_BYTES);
+
+    if (segments > 1)
+    {
+      message->msg_hdr.msg_control = egress->control[messages].buffer;
+      message->msg_hdr.msg_controllen = CMSG_SPACE(sizeof(guint16));
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message->msg_hdr);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(guint16));
+      guint16 segment_size = (guint16)segment;
+      memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+    }
+    messages++;
+  }
+  return messages;
+}
+
+static void
+udp_egress_flush(UdpEgress *egress)
+{
+  if (egress->count == 0)
+    return;
+
+  guint messages = udp_egress_build_messages(egress);
+  guint sent = 0;
+  while (sent < messages)
+  {
+    int result = sendmmsg(egress->fd, &egress->messages[sent], messages - sent, 0);
+    egress->syscalls.fetch_add(1, std::memory_order_relaxed);
+    if (result > 0)
+    {
+      sent += result;
+      continue;
+    }
+    if (result < 0 && errno == EINTR)
+      continue;
+
+    // EIO/EINVAL: no GSO on this kernel or device; resend this batch packet by packet
+    if (egress->mode == UDP_EGRESS_GSO && sent == 0 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT))
+    {
+      g_print("⚠ UDP egress: GSO refused (%s), falling back to sendmmsg\n", g_strerror(errno));
+      egress->mode = UDP_EGRESS_SENDMMSG;
+      messages = udp_egress_build_messages(egress);
+      sent = 0;
+      continue;
+    }
+    // Client unreachable (ICMP) or buffer full: drop the rest like udpsink does
+    egress->send_errors.fetch_add(1, std::memory_order_relaxed);
+    break;
+  }
+
+  egress->sent_packets.fetch_add(egress->count, std::memory_order_relaxed);
+  udp_egress_release(egress);
+}
+
+static void
+udp_egress_add(UdpEgress *egress, GstBuffer *buffer)
+{
+  if (egress->count == UDP_EGRESS_BATCH)
+    udp_egress_flush(egress);
+
+  UdpEgressPacket *packet = &egress->packets[egress->count];
+  guint memories = gst_buffer_n_memory(buffer);
+  packet->memories = 0;
+  packet->size = 0;
+
+  for (guint m = 0; m < (memories <= UDP_EGRESS_MEMORIES ? memories : 1); m++)
+  {
+    GstMemory *memory = memories <= UDP_EGRESS_MEMORIES ? gst_buffer_get_memory(buffer, m)
+                                                        : gst_buffer_get_all_memory(buffer);
+    if (!gst_memory_map(memory, &packet->map[packet->memories], GST_MAP_READ))
+    {
+      gst_memory_unref(memory);
+      continue;
+    }
+    packet->memory[packet->memories] = memory;
+    packet->size += packet->map[packet->memories].size;
+    packet->memories++;
+  }
+
+  if (packet->size > 0)
+  {
+    egress->count++;
+    return;
+  }
+  for (guint m = 0; m < packet->memories; m++)
+  {
+    gst_memory_unmap(packet->memory[m], &packet->map[m]);
+    gst_memory_unref(packet->memory[m]);
+  }
+  packet->memories = 0;
+}
+
+static GstFlowReturn
+udp_egress_new_sample_cb(GstAppSink *sink, gpointer user_data)
+{
+  UdpEgress *egress = (UdpEgress *)user_data;
+
+  // Take what is queued right now, never wait for more
+  GstSample *sample = gst_app_sink_pull_sample(sink);
+  while (sample != NULL)
+  {
+    GstBufferList *list = gst_sample_get_buffer_list(sample);
+    if (list != NULL)
+    {
+      for (guint i = 0; i < gst_buffer_list_length(list); i++)
+        udp_egress_add(egress, gst_buffer_list_get(list, i));
+    }
+    else if (gst_sample_get_buffer(sample) != NULL)
+      udp_egress_add(egress, gst_sample_get_buffer(sample));
+    gst_sample_unref(sample);
+
+    sample = gst_app_sink_try_pull_sample(sink, 0);
+  }
+  udp_egress_flush(egress);
+
+  return GST_FLOW_OK;
+}
+
+// udpsink: one send per buffer, one sendmmsg per list
+static GstPadProbeReturn
+udp_egress_count_probe_cb(G_GNUC_UNUSED GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  UdpEgress *egress = (UdpEgress *)user_data;
+  guint packets = GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST
+                      ? gst_buffer_list_length(GST_PAD_PROBE_INFO_BUFFER_LIST(info))
+                      : 1;
+  egress->sent_packets.fetch_add(packets, std::memory_order_relaxed);
+  egress->syscalls.fetch_add(1, std::memory_order_relaxed);
+  return GST_PAD_PROBE_OK;
+}
+
+static gboolean
+udp_egress_report_cb(gpointer user_data)
+{
+  UdpEgress *egress = (UdpEgress *)user_data;
+  gint64 now = g_get_monotonic_time();
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  gdouble seconds = (now - egress->last_report_us) / (gdouble)G_USEC_PER_SEC;
+  guint64 packets = egress->sent_packets.load(std::memory_order_relaxed);
+  guint64 syscalls = egress->syscalls.load(std::memory_order_relaxed);
+  guint64 delta_packets = packets - egress->last_packets;
+  guint64 delta_syscalls = syscalls - egress->last_syscalls;
+  gdouble user_s = (usage.ru_utime.tv_sec - egress->last_usage.ru_utime.tv_sec) +
+                   (usage.ru_utime.tv_usec - egress->last_usage.ru_utime.tv_usec) / 1e6;
+  gdouble sys_s = (usage.ru_stime.tv_sec - egress->last_usage.ru_stime.tv_sec) +
+                  (usage.ru_stime.tv_usec - egress->last_usage.ru_stime.tv_usec) / 1e6;
+
+  if (delta_packets > 0)
+    g_print("📤 UDP egress [%s]: %.0f pkt/s, %.0f syscalls/s (%.1f pkt/syscall), "
+            "process CPU user %.1f%% sys %.1f%%, %" G_GUINT64_FORMAT " send errors\n",
+            udp_egress_names[egress->mode], delta_packets / seconds, delta_syscalls / seconds,
+            delta_syscalls ? (gdouble)delta_packets / delta_syscalls : 0.0,
+            100.0 * user_s / seconds, 100.0 * sys_s / seconds,
+            egress->send_errors.load(std::memory_order_relaxed));
+
+  egress->last_packets = packets;
+  egress->last_syscalls = syscalls;
+  egress->last_report_us = now;
+  egress->last_usage = usage;
+  return G_SOURCE_CONTINUE;
+}
+
+// Hooks up the sink built by build_udp_egress_string() and starts the report. Lives until exit,
+// like the pipeline. Returns FALSE if the client socket can't be set up.
+static gboolean
+attach_udp_egress(GstElement *pipeline, UdpEgressMode mode, const gchar *host, gint port)
+{
+  GstElement *sink = gst_bin_get_by_name(GST_BIN(pipeline), UDP_EGRESS_NAME);
+  if (sink == NULL)
+    return FALSE;
+
+  UdpEgress *egress = new UdpEgress();
+  egress->mode = mode;
+  egress->fd = -1;
+  egress->last_report_us = g_get_monotonic_time();
+  getrusage(RUSAGE_SELF, &egress->last_usage);
+
+  if (mode == UDP_EGRESS_UDPSINK)
+  {
+    GstPad *sink_pad = gst_element_get_static_pad(sink, "sink");
+    gst_pad_add_probe(sink_pad, (GstPadProbeType)(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                      udp_egress_count_probe_cb, egress, NULL);
+    gst_object_unref(sink_pad);
+  }
+  else
+  {
+    egress->fd = udp_egress_connect(host, port);
+    if (egress->fd < 0)
+    {
+      g_print("⚠ UDP egress: cannot open a socket to %s:%d\n", host, port);
+      gst_object_unref(sink);
+      delete egress;
+      return FALSE;
+    }
+    GstAppSinkCallbacks callbacks = {};
+    callbacks.new_sample = udp_egress_new_sample_cb;
+    gst_app_sink_set_callbacks(GST_APP_SINK(sink), &callbacks, egress, NULL);
+  }
+  gst_object_unref(sink);
+
+  g_timeout_add_seconds(UDP_EGRESS_REPORT_SECONDS, udp_egress_report_cb, egress);
+  return TRUE;
+}
+
+#endif // UDP_EGRESS_H
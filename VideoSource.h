@@ -0,0 +1,141 @@
+#ifndef VIDEO_SOURCE_H
+#define VIDEO_SOURCE_H
+
+#include <glib.h>
+
+// Capture head of the streaming pipeline, shared by StreamingProgram.cpp and retran.cpp.
+//
+// Every source produces the same caps (NV12 at the capture resolution, 60/1) so the rest of
+// the pipeline (videorate, encoder, tee) is identical no matter where frames come from.
+// Only v4l2 needs the board; the others let latency/throughput runs be reproduced on a
+// dev box or build server.
+
+#define VIDEO_SOURCE_CAPTURE_FPS 60
+#define VIDEO_SOURCE_DEFAULT_DEVICE "/dev/video0"
+#define VIDEO_SOURCE_DEFAULT_PATTERN "smpte"
+#define VIDEO_SOURCE_DEFAULT_SHM_SOCKET "/tmp/webrtc-video-shm"
+
+typedef enum
+{
+  VIDEO_SOURCE_V4L2 = 0, // camera / HDMI capture (default)
+  VIDEO_SOURCE_TEST,     // videotestsrc, deterministic frame-counted animation
+  VIDEO_SOURCE_FILE,     // raw NV12 file replayed in real time
+  VIDEO_SOURCE_SHM       // frames from another process through shmsink
+} VideoSourceKind;
+
+typedef struct
+{
+  VideoSourceKind kind;
+  const gchar *device;   // v4l2: device node
+  const gchar *pattern;  // test: videotestsrc pattern name (smpte, ball, snow, ...)
+  gint motion;           // test: horizontal scroll in pixels per frame (0 = static)
+  const gchar *location; // file: path of the raw NV12 file, shm: socket path
+  gint width;
+  gint height;
+} VideoSourceConfig;
+
+static const gchar *video_source_kind_names[] = {"v4l2", "test", "file", "shm"};
+
+static gboolean
+video_source_kind_from_string(const gchar *name, VideoSourceKind *kind)
+{
+  if (name == NULL || name[0] == '\0')
+  {
+    *kind = VIDEO_SOURCE_V4L2;
+    return TRUE;
+  }
+
+  for (guint i = 0; i < G_N_ELEMENTS(video_source_kind_names); i++)
+  {
+    if (g_ascii_strcasecmp(name, video_source_kind_names[i]) == 0)
+    {
+      *kind = (VideoSourceKind)i;
+      return TRUE;
+    }
+  }
+
+  // Accept the element name as an alias, e.g. --source=videotestsrc
+  if (g_ascii_strcasecmp(name, "videotestsrc") == 0)
+  {
+    *kind = VIDEO_SOURCE_TEST;
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+static const gchar *
+video_source_kind_to_string(VideoSourceKind kind)
+{
+  return video_source_kind_names[kind];
+}
+
+// Returns a newly allocated gst_parse_launch fragment ending in the raw video caps,
+// ready to be followed by "! videorate ...". Free with g_free().
+static gchar *
+build_video_source_string(const VideoSourceConfig *config)
+{
+  gchar *head = NULL;
+  gchar *caps = g_strdup_printf("video/x-raw,format=NV12,width=%d,height=%d,framerate=%d/1",
+                                config->width, config->height, VIDEO_SOURCE_CAPTURE_FPS);
+
+  switch (config->kind)
+  {
+  case VIDEO_SOURCE_TEST:
+    // animation-mode=frames makes the content a function of the frame number only,
+    // so two runs encode exactly the same pictures regardless of scheduling jitter.
+    head = g_strdup_printf("videotestsrc is-live=true animation-mode=frames pattern=%s horizontal-speed=%d ! %s",
+                           config->pattern ? config->pattern : VIDEO_SOURCE_DEFAULT_PATTERN,
+                           config->motion, caps);
+    break;
+
+  case VIDEO_SOURCE_FILE:
+    // rawvideoparse timestamps each frame, identity sync=true paces them at capture rate.
+    head = g_strdup_printf("filesrc location=\"%s\" ! "
+                           "rawvideoparse format=nv12 width=%d height=%d framerate=%d/1 ! "
+                           "identity sync=true ! %s",
+                           config->location, config->width, config->height,
+                           VIDEO_SOURCE_CAPTURE_FPS, caps);
+    break;
+
+  case VIDEO_SOURCE_SHM:
+    head = g_strdup_printf("shmsrc socket-path=\"%s\" is-live=true do-timestamp=true ! %s",
+                           config->location ? config->location : VIDEO_SOURCE_DEFAULT_SHM_SOCKET,
+                           caps);
+    break;
+
+  case VIDEO_SOURCE_V4L2:
+  default:
+    head = g_strdup_printf("v4l2src device=%s do-timestamp=false io-mode=4 ! %s",
+                           config->device ? config->device : VIDEO_SOURCE_DEFAULT_DEVICE,
+                           caps);
+    break;
+  }
+
+  g_free(caps);
+  return head;
+}
+
+static void
+print_video_source(const VideoSourceConfig *config)
+{
+  g_print(" Video source: %s", video_source_kind_to_string(config->kind));
+  switch (config->kind)
+  {
+  case VIDEO_SOURCE_TEST:
+    g_print(" (pattern=%s, motion=%d px/frame)\n",
+            config->pattern ? config->pattern : VIDEO_SOURCE_DEFAULT_PATTERN, config->motion);
+    break;
+  case VIDEO_SOURCE_FILE:
+    g_print(" (%s)\n", config->location);
+    break;
+  case VIDEO_SOURCE_SHM:
+    g_print(" (%s)\n", config->location ? config->location : VIDEO_SOURCE_DEFAULT_SHM_SOCKET);
+    break;
+  default:
+    g_print(" (%s)\n", config->device ? config->device : VIDEO_SOURCE_DEFAULT_DEVICE);
+    break;
+  }
+}
+
+#endif // VIDEO_SOURCE_H
@@ -0,0 +1,326 @@
+#ifndef VIEWER_LIMIT_H
+#define VIEWER_LIMIT_H
+
+#include <glib.h>
+#include <json-glib/json-glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+// How many WebRTC viewers fit, worked out at runtime instead of a fixed constant.
+//
+// The limit is the smallest of:
+//   max_viewers  --max-viewers, a hard cap;
+//   egress       uplink capacity over what one viewer is sent at the current bitrate, after the
+//                UDP client. Capacity is --uplink-kbps if given, otherwise measured from the
+//                viewers' bandwidth estimates (transport-wide-cc or receiver reports): when most
+//                of them are congested at once, by loss or an estimate below what they are sent,
+//                the bottleneck is ours, and what their estimates add up to is what the uplink
+//                carries. The default route interface's link speed (sysfs) only caps that; it is
+//                the LAN rate, or unknown on wireless and mobile links;
+//   cpu          cores left (VIEWER_LIMIT_CPU_SHARE of them) over the CPU one viewer costs. The
+//                process' CPU time beyond what it used with no viewers is what the viewers' SRTP,
+//                webrtcbin and queue threads take; shared by the viewers connected;
+//   memory       VIEWER_LIMIT_MEMORY_SHARE of the available memory over the resident memory one
+//                viewer adds, measured the same way.
+// The CPU and memory terms need a viewer to measure, until then they don't limit.
+//
+// A measured capacity is a ceiling that goes stale: it holds for VIEWER_LIMIT_CEILING_HOLD_S after
+// the congestion was last seen, then rises VIEWER_LIMIT_RECOVERY a second, and is forgotten after
+// VIEWER_LIMIT_CEILING_FORGET_S or once it passes the link speed. A ceiling that turned away every
+// viewer, so nobody is left to report, can't lock new ones out for good.
+//
+// Sampled once a second on the main loop, and recomputed for every join, so it follows bitrate
+// changes right away. Each change is printed with its reason, which also goes to rejected clients.
+
+#define VIEWER_LIMIT_DEFAULT_MAX 64
+#define VIEWER_LIMIT_INTERVAL_MS 1000
+#define VIEWER_LIMIT_EGRESS_SHARE 0.9    // of the uplink, the rest for RTX, RTCP and bursts
+#define VIEWER_LIMIT_CPU_SHARE 0.8       // of all cores
+#define VIEWER_LIMIT_MEMORY_SHARE 0.5    // of MemAvailable
+#define VIEWER_LIMIT_LOSS 0.05           // a viewer this lossy counts as congested
+#define VIEWER_LIMIT_SMOOTHING 0.2       // weight of a new CPU/memory sample
+#define VIEWER_LIMIT_RECOVERY 1.05       // growth per second of a stale measured capacity
+#define VIEWER_LIMIT_CEILING_HOLD_S 10
+#define VIEWER_LIMIT_CEILING_FORGET_S 300
+
+typedef enum
+{
+  VIEWER_LIMIT_CAP = 0,
+  VIEWER_LIMIT_EGRESS,
+  VIEWER_LIMIT_CPU,
+  VIEWER_LIMIT_MEMORY,
+  VIEWER_LIMIT_REASONS
+} ViewerLimitReason;
+
+static const gchar *viewer_limit_reasons[VIEWER_LIMIT_REASONS] = {"max_viewers", "egress", "cpu", "memory"};
+
+typedef struct
+{
+  gint max_viewers;
+  gint uplink_kbps;          // --uplink-kbps, 0 to measure
+  gchar *interface;          // default route, NULL if not found
+  gint link_kbps;            // its link speed, 0 if unknown (wireless, virtual)
+  gdouble congested_kbps;    // measured capacity, 0 while there is none
+  gint64 congested_us;       // when the congestion was last seen
+
+  guint processors;
+  gint64 last_sample_us;
+  gdouble last_cpu_s;
+  gdouble cpu_cores;         // smoothed cores in use by the process
+  gdouble idle_cpu_cores;    // the same with no viewers
+  gdouble rss_kb;
+  gdouble idle_rss_kb;
+  gdouble available_kb;      // MemAvailable
+
+  gint limit;
+  ViewerLimitReason reason;
+  gchar *detail;
+} ViewerLimit;
+
+// The interface of the default route, from /proc/net/route.
+static gchar *
+viewer_limit_default_interface()
+{
+  FILE *file = fopen("/proc/net/route", "r");
+  if (file == NULL)
+    return NULL;
+
+  gchar line[256], name[64];
+  gchar *found = NULL;
+  unsigned long destination;
+  while (found == NULL && fgets(line, sizeof(line), file) != NULL)
+    if (sscanf(line, "%63s %lx", name, &destination) == 2 && destination == 0)
+      found = g_strdup(name);
+  fclose(file);
+  return found;
+}
+
+// Link speed in kbps, 0 if the driver doesn't tell (it reports -1 for wireless and virtual links).
+static gint
+viewer_limit_link_kbps(const gchar *interface)
+{
+  if (interface == NULL)
+    return 0;
+
+  gchar *path = g_strdup_printf("/sys/class/net/%s/speed", interface);
+  gchar *contents = NULL;
+  gint mbps = 0;
+  if (g_file_get_contents(path, &contents, NULL, NULL))
+    mbps = atoi(contents);
+  g_free(contents);
+  g_free(path);
+  return mbps > 0 ? mbps * 1000 : 0;
+}
+
+static gdouble
+viewer_limit_cpu_seconds()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static gdouble
+viewer_limit_rss_kb()
+{
+  long pages = 0, resident = 0;
+  FILE *file = fopen("/proc/self/statm", "r");
+  if (file == NULL)
+    return 0;
+  if (fscanf(file, "%ld %ld", &pages, &resident) != 2)
+    resident = 0;
+  fclose(file);
+  return resident * (sysconf(_SC_PAGESIZE) / 1024.0);
+}
+
+static gdouble
+viewer_limit_available_kb()
+{
+  FILE *file = fopen("/proc/meminfo", "r");
+  if (file == NULL)
+    return 0;
+
+  gchar line[256];
+  long kb = 0;
+  while (fgets(line, sizeof(line), file) != NULL)
+    if (sscanf(line, "MemAvailable: %ld kB", &kb) == 1)
+      break;
+  fclose(file);
+  return kb;
+}
+
+static ViewerLimit *
+viewer_limit_new(gint max_viewers, gint uplink_kbps)
+{
+  ViewerLimit *limit = g_new0(ViewerLimit, 1);
+  limit->max_viewers = max_viewers;
+  limit->uplink_kbps = uplink_kbps;
+  limit->interface = viewer_limit_default_interface();
+  limit->link_kbps = viewer_limit_link_kbps(limit->interface);
+  limit->processors = MAX(g_get_num_processors(), 1u);
+  limit->last_sample_us = g_get_monotonic_time();
+  limit->last_cpu_s = viewer_limit_cpu_seconds();
+  limit->rss_kb = limit->idle_rss_kb = viewer_limit_rss_kb();
+  limit->available_kb = viewer_limit_available_kb();
+  limit->limit = max_viewers;
+  limit->detail = g_strdup_printf("--max-viewers %d", max_viewers);
+  return limit;
+}
+
+// Measures CPU and memory. viewers connected right now, the baselines are kept while there are none.
+static void
+viewer_limit_sample(ViewerLimit *limit, gint viewers)
+{
+  gint64 now = g_get_monotonic_time();
+  gdouble cpu_s = viewer_limit_cpu_seconds();
+  gdouble seconds = (now - limit->last_sample_us) / (gdouble)G_USEC_PER_SEC;
+  if (seconds <= 0)
+    return;
+
+  gdouble cores = (cpu_s - limit->last_cpu_s) / seconds;
+  limit->cpu_cores += VIEWER_LIMIT_SMOOTHING * (cores - limit->cpu_cores);
+  limit->rss_kb = viewer_limit_rss_kb();
+  limit->available_kb = viewer_limit_available_kb();
+  limit->last_sample_us = now;
+  limit->last_cpu_s = cpu_s;
+
+  if (viewers == 0)
+  {
+    limit->idle_cpu_cores = limit->cpu_cores;
+    limit->idle_rss_kb = limit->rss_kb;
+  }
+}
+
+// Once a second: how many viewers report, how many of them are congested, and what the uplink
+// carries by their estimates (the UDP client included). Most of them congested at once measures
+// the capacity; otherwise an older measurement ages.
+static void
+viewer_limit_observe_egress(ViewerLimit *limit, gdouble capacity_kbps, guint reporting, guint congested)
+{
+  gint64 now = g_get_monotonic_time();
+
+  if (reporting >= 2 && capacity_kbps > 0 && congested * 3 >= reporting * 2)
+  {
+    limit->congested_kbps = capacity_kbps;
+    limit->congested_us = now;
+    return;
+  }
+  if (limit->congested_kbps == 0)
+    return;
+
+  gint64 since_us = now - limit->congested_us;
+  if (since_us >= VIEWER_LIMIT_CEILING_FORGET_S * G_USEC_PER_SEC ||
+      (limit->link_kbps > 0 && limit->congested_kbps >= limit->link_kbps))
+    limit->congested_kbps = 0;
+  else if (since_us >= VIEWER_LIMIT_CEILING_HOLD_S * G_USEC_PER_SEC)
+    limit->congested_kbps *= VIEWER_LIMIT_RECOVERY;
+}
+
+static gdouble
+viewer_limit_uplink_kbps(const ViewerLimit *limit)
+{
+  if (limit->uplink_kbps > 0)
+    return limit->uplink_kbps;
+  if (limit->link_kbps > 0 && limit->congested_kbps > 0)
+    return MIN(limit->link_kbps, limit->congested_kbps);
+  return limit->link_kbps > 0 ? limit->link_kbps : limit->congested_kbps;
+}
+
+static const gchar *
+viewer_limit_uplink_source(const ViewerLimit *limit)
+{
+  if (limit->uplink_kbps > 0)
+    return "--uplink-kbps";
+  if (limit->congested_kbps > 0 && (limit->link_kbps == 0 || limit->congested_kbps < limit->link_kbps))
+    return "viewers' estimates";
+  return "link speed";
+}
+
+static void
+viewer_limit_consider(ViewerLimit *limit, gdouble fits, ViewerLimitReason reason, gchar *detail)
+{
+  gint count = (gint)CLAMP(fits, 0, G_MAXINT);
+  if (count < limit->limit)
+  {
+    limit->limit = count;
+    limit->reason = reason;
+    g_free(limit->detail);
+    limit->detail = detail;
+  }
+  else
+  {
+    g_free(detail);
+  }
+}
+
+// Recomputes the limit for viewers connected, one more costing viewer_kbps on the wire and
+// other_kbps going out anyway (the UDP client). Returns it.
+static gint
+viewer_limit_update(ViewerLimit *limit, gint viewers, gint viewer_kbps, gint other_kbps)
+{
+  gint previous = limit->limit;
+  ViewerLimitReason previous_reason = limit->reason;
+
+  limit->limit = limit->max_viewers;
+  limit->reason = VIEWER_LIMIT_CAP;
+  g_free(limit->detail);
+  limit->detail = g_strdup_printf("--max-viewers %d", limit->max_viewers);
+
+  gdouble uplink_kbps = viewer_limit_uplink_kbps(limit);
+  if (uplink_kbps > 0 && viewer_kbps > 0)
+    viewer_limit_consider(limit, (uplink_kbps * VIEWER_LIMIT_EGRESS_SHARE - other_kbps) / viewer_kbps,
+                          VIEWER_LIMIT_EGRESS,
+                          g_strdup_printf("uplink %.0f kbps (%s), %d kbps per viewer, %d kbps UDP client",
+                                          uplink_kbps, viewer_limit_uplink_source(limit), viewer_kbps, other_kbps));
+
+  if (viewers > 0)
+  {
+    gdouble per_viewer_cores = (limit->cpu_cores - limit->idle_cpu_cores) / viewers;
+    if (per_viewer_cores > 0.001)
+      viewer_limit_consider(limit,
+                            viewers + (limit->processors * VIEWER_LIMIT_CPU_SHARE - limit->cpu_cores) / per_viewer_cores,
+                            VIEWER_LIMIT_CPU,
+                            g_strdup_printf("%.0f%% of a core per viewer, %.1f of %u cores in use",
+                                            per_viewer_cores * 100.0, limit->cpu_cores, limit->processors));
+
+    gdouble per_viewer_kb = (limit->rss_kb - limit->idle_rss_kb) / viewers;
+    if (per_viewer_kb > 0 && limit->available_kb > 0)
+      viewer_limit_consider(limit, viewers + limit->available_kb * VIEWER_LIMIT_MEMORY_SHARE / per_viewer_kb,
+                            VIEWER_LIMIT_MEMORY,
+                            g_strdup_printf("%.1f MB per viewer, %.0f MB available", per_viewer_kb / 1024.0,
+                                            limit->available_kb / 1024.0));
+  }
+
+  if (limit->limit != previous || limit->reason != previous_reason)
+    g_print("👥 Viewer limit %d (%s: %s)\n", limit->limit, viewer_limit_reasons[limit->reason], limit->detail);
+  return limit->limit;
+}
+
+static void
+viewer_limit_add_member(JsonBuilder *builder, const ViewerLimit *limit)
+{
+  json_builder_set_member_name(builder, "viewer_limit");
+  json_builder_begin_object(builder);
+  json_builder_set_member_name(builder, "limit");
+  json_builder_add_int_value(builder, limit->limit);
+  json_builder_set_member_name(builder, "reason");
+  json_builder_add_string_value(builder, viewer_limit_reasons[limit->reason]);
+  json_builder_set_member_name(builder, "detail");
+  json_builder_add_string_value(builder, limit->detail);
+  json_builder_set_member_name(builder, "uplink_kbps");
+  json_builder_add_double_value(builder, viewer_limit_uplink_kbps(limit));
+  json_builder_set_member_name(builder, "cpu_cores");
+  json_builder_add_double_value(builder, limit->cpu_cores);
+  json_builder_set_member_name(builder, "idle_cpu_cores");
+  json_builder_add_double_value(builder, limit->idle_cpu_cores);
+  json_builder_set_member_name(builder, "rss_kb");
+  json_builder_add_double_value(builder, limit->rss_kb);
+  json_builder_set_member_name(builder, "idle_rss_kb");
+  json_builder_add_double_value(builder, limit->idle_rss_kb);
+  json_builder_end_object(builder);
+}
+
+#endif // VIEWER_LIMIT_H
@@ -0,0 +1,114 @@
+#ifndef VIEWER_POOL_H
+#define VIEWER_POOL_H
+
+#include <glib.h>
+
+// Pre-warmed viewers (--viewer-pool).
+//
+// Building a viewer takes a webrtcbin with its transceivers, NACK/RTX and FEC set up, a TURN
+// reachability check and a wait for the bin to reach PLAYING, all before the first offer can be
+// created. The pool keeps that many viewers built ahead of time, idle in the pipeline and not
+// linked to the tee. A new connection takes one and only links it, the pool builds a
+// replacement on its own thread. With the pool empty, the connection builds one as before.
+//
+// The build function comes from the application; what it returns is opaque here.
+//
+// To see the difference, the time from accepting the websocket to sending the offer is kept for
+// pooled and for freshly built viewers and printed with each offer.
+
+typedef gpointer (*ViewerPoolBuildFunc)(void);
+
+typedef struct
+{
+  guint size;
+  ViewerPoolBuildFunc build;
+  GAsyncQueue *ready;
+  GThread *thread;
+
+  GMutex lock;
+  GCond refill;
+
+  // Only the main loop
+  guint hits;
+  guint misses;
+  gdouble offer_ms[2];  // total, freshly built and pooled
+  guint offers[2];
+} ViewerPool;
+
+static gpointer
+viewer_pool_run(gpointer data)
+{
+  ViewerPool *pool = (ViewerPool *)data;
+
+  while (TRUE)
+  {
+    g_mutex_lock(&pool->lock);
+    while ((guint)g_async_queue_length(pool->ready) >= pool->size)
+      g_cond_wait(&pool->refill, &pool->lock);
+    g_mutex_unlock(&pool->lock);
+
+    gpointer viewer = pool->build();
+    if (viewer != NULL)
+      g_async_queue_push(pool->ready, viewer);
+    else
+      g_usleep(G_USEC_PER_SEC); // don't spin on a broken setup
+  }
+  return NULL;
+}
+
+// Starts filling the pool. Lives until exit, like the pipeline the viewers are in.
+static ViewerPool *
+viewer_pool_new(guint size, ViewerPoolBuildFunc build)
+{
+  ViewerPool *pool = g_new0(ViewerPool, 1);
+  pool->size = size;
+  pool->build = build;
+  pool->ready = g_async_queue_new();
+  g_mutex_init(&pool->lock);
+  g_cond_init(&pool->refill);
+  pool->thread = g_thread_new("viewer-pool", viewer_pool_run, pool);
+  return pool;
+}
+
+// A pre-built viewer, or NULL if the pool is empty (or NULL). Either way a replacement is started.
+static gpointer
+viewer_pool_take(ViewerPool *pool)
+{
+  if (pool == NULL)
+    return NULL;
+
+  gpointer viewer = g_async_queue_try_pop(pool->ready);
+  if (viewer != NULL)
+    pool->hits++;
+  else
+    pool->misses++;
+
+  g_mutex_lock(&pool->lock);
+  g_cond_signal(&pool->refill);
+  g_mutex_unlock(&pool->lock);
+  return viewer;
+}
+
+// Prints how long the viewer waited for its offer, and the means so far.
+static void
+viewer_pool_record_offer(ViewerPool *pool, const gchar *label, gboolean pooled, gint64 offer_us)
+{
+  gdouble ms = offer_us / 1000.0;
+
+  if (pool == NULL)
+  {
+    g_print("⏱ %s: offer sent %.1f ms after connecting\n", label, ms);
+    return;
+  }
+
+  pool->offer_ms[pooled ? 1 : 0] += ms;
+  pool->offers[pooled ? 1 : 0]++;
+  g_print("⏱ %s: offer sent %.1f ms after connecting (%s); mean %.1f ms pre-warmed (%u), %.1f ms built (%u), "
+          "pool %u/%u ready\n",
+          label, ms, pooled ? "pre-warmed" : "built on connect",
+          pool->offers[1] ? pool->offer_ms[1] / pool->offers[1] : 0.0, pool->offers[1],
+          pool->offers[0] ? pool->offer_ms[0] / pool->offers[0] : 0.0, pool->offers[0],
+          (guint)MAX(g_async_queue_length(pool->ready), 0), pool->size);
+}
+
+#endif // VIEWER_POOL_H
@@ -0,0 +1,287 @@
+#ifndef VIEWER_QUEUE_H
+#define VIEWER_QUEUE_H
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <gst/rtp/gstrtpbuffer.h>
+#include <json-glib/json-glib.h>
+
+#include "KeyframeControl.h"
+#include "TemporalLayers.h"
+
+// What a slow viewer loses (--viewer-queue-ms, --viewer-queue-kb).
+//
+// A leaky queue drops single packets from the middle of frames. The decoder stays broken until
+// the next IDR, and meanwhile the browser NACKs every hole. Instead, a probe in front of the
+// viewer's queue watches how much the queue holds: the PTS span between what went in and what
+// came out, and the bytes. When either is over its limit at the start of a frame, the viewer
+// skips whole frames until a keyframe, and asks the encoder for one. On RTP the sequence numbers
+// (and VP8 picture IDs) are renumbered across the dropped frames, like the temporal layer filter
+// does, so the browser sees a short freeze instead of losses.
+//
+// Packets that never reached the probe (a ring fan-out consumer that was lapped) show up as a
+// gap in the incoming sequence numbers and are treated the same way.
+//
+// The queue element keeps a leaky limit of twice the policy's as a backstop, so the tee never
+// blocks on one viewer.
+//
+// With the ring fan-out there is no queue (the viewer's element is an identity pushed by a
+// fan-out worker), so the limits don't apply: the ring itself bounds how far a viewer falls
+// behind, and a lapped viewer skips to a keyframe through the sequence number gap above.
+
+#define VIEWER_QUEUE_DEFAULT_MS 250
+#define VIEWER_QUEUE_DEFAULT_KB 1024
+
+typedef struct
+{
+  guint max_ms;
+  guint max_bytes;
+  gboolean rtp;                // packets (single encoder) rather than encoded frames (simulcast)
+  gboolean vp8;
+  KeyframeControl *keyframes;  // of the encoder feeding the viewer, changes on rendition switch
+
+  // Queue level, the in side written by the sink probe, the out side by the queue's thread.
+  // Unsigned differences, so wrapping doesn't matter.
+  guint in_bytes;
+  guint out_bytes;
+  guint in_pts_ms;
+  guint out_pts_ms;
+
+  // Only the sink probe
+  GstClockTime frame_pts;
+  gboolean dropping_frame;
+  gboolean skipping;           // until a keyframe fits
+  gboolean have_seq;
+  guint16 next_seq;            // incoming
+  guint16 dropped_packets;     // seqnum offset
+  guint16 dropped_pictures;    // VP8 picture-id offset
+
+  // Counted by the sink probe, read by the reports
+  guint skips;                 // times the viewer fell behind
+  guint dropped_frames;
+  guint dropped_total;         // packets (or frames on encoded video)
+  guint lost_upstream;         // packets missing before the probe
+} ViewerQueue;
+
+static void
+viewer_queue_release(gpointer queue)
+{
+  g_atomic_rc_box_release(queue);
+}
+
+static ViewerQueue *
+viewer_queue_new(guint max_ms, guint max_kb, gboolean rtp, gboolean vp8, KeyframeControl *keyframes)
+{
+  ViewerQueue *queue = g_atomic_rc_box_new0(ViewerQueue);
+  queue->max_ms = max_ms;
+  queue->max_bytes = max_kb * 1024;
+  queue->rtp = rtp;
+  queue->vp8 = vp8;
+  queue->keyframes = keyframes;
+  queue->frame_pts = GST_CLOCK_TIME_NONE;
+  return queue;
+}
+
+static void
+viewer_queue_set_keyframes(ViewerQueue *queue, KeyframeControl *keyframes)
+{
+  if (queue != NULL)
+    g_atomic_pointer_set(&queue->keyframes, keyframes);
+}
+
+static void
+viewer_queue_start_skipping(ViewerQueue *queue)
+{
+  if (!queue->skipping)
+    g_atomic_int_inc(&queue->skips);
+  queue->skipping = TRUE;
+  keyframe_control_request_async((KeyframeControl *)g_atomic_pointer_get(&queue->keyframes));
+}
+
+// Decided once per frame, so a frame is forwarded or dropped as a whole.
+static void
+viewer_queue_frame_start(ViewerQueue *queue, GstBuffer *buffer)
+{
+  guint level_ms = g_atomic_int_get(&queue->in_pts_ms) - g_atomic_int_get(&queue->out_pts_ms);
+  guint level_bytes = g_atomic_int_get(&queue->in_bytes) - g_atomic_int_get(&queue->out_bytes);
+  gboolean over = level_ms > queue->max_ms || level_bytes > queue->max_bytes;
+
+  if (queue->skipping)
+  {
+    // Set on RTP packets too, by the keyframe marker on the payloader
+    if (!GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+    {
+      if (over)
+        viewer_queue_start_skipping(queue); // this one doesn't fit either, ask for the next
+      else
+        queue->skipping = FALSE;
+    }
+  }
+  else if (over)
+  {
+    viewer_queue_start_skipping(queue);
+  }
+
+  queue->dropping_frame = queue->skipping;
+  if (queue->dropping_frame)
+  {
+    g_atomic_int_inc(&queue->dropped_frames);
+    queue->dropped_pictures++;
+  }
+}
+
+// Returns FALSE to drop buffer; may replace *buffer with a renumbered copy.
+static gboolean
+viewer_queue_filter_buffer(ViewerQueue *queue, GstBuffer **buffer)
+{
+  if (queue->rtp)
+  {
+    GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+    if (gst_rtp_buffer_map(*buffer, GST_MAP_READ, &rtp))
+    {
+      guint16 seq = gst_rtp_buffer_get_seq(&rtp);
+      gst_rtp_buffer_unmap(&rtp);
+
+      guint16 missing = seq - queue->next_seq;
+      if (queue->have_seq && missing != 0 && missing < 0x8000)
+      {
+        // The rest of this frame is useless without them
+        g_atomic_int_add(&queue->lost_upstream, missing);
+        queue->dropped_packets += missing;
+        queue->dropping_frame = TRUE;
+        viewer_queue_start_skipping(queue);
+      }
+      queue->next_seq = seq + 1;
+      queue->have_seq = TRUE;
+    }
+  }
+
+  GstClockTime pts = GST_BUFFER_PTS(*buffer);
+  if (pts != queue->frame_pts)
+  {
+    queue->frame_pts = pts;
+    viewer_queue_frame_start(queue, *buffer);
+  }
+
+  if (queue->dropping_frame)
+  {
+    if (queue->rtp)
+      queue->dropped_packets++;
+    g_atomic_int_inc(&queue->dropped_total);
+    return FALSE;
+  }
+
+  if (queue->rtp && (queue->dropped_packets != 0 || queue->dropped_pictures != 0))
+  {
+    *buffer = gst_buffer_make_writable(*buffer);
+    rtp_close_dropped_gap(*buffer, queue->dropped_packets, queue->dropped_pictures, queue->vp8);
+  }
+
+  g_atomic_int_add(&queue->in_bytes, (gint)gst_buffer_get_size(*buffer));
+  if (GST_CLOCK_TIME_IS_VALID(pts))
+    g_atomic_int_set(&queue->in_pts_ms, (guint)(pts / GST_MSECOND));
+  return TRUE;
+}
+
+static GstPadProbeReturn
+viewer_queue_sink_probe_cb(G_GNUC_UNUSED GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  ViewerQueue *queue = (ViewerQueue *)user_data;
+
+  if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+  {
+    GstBufferList *list = gst_buffer_list_make_writable(GST_PAD_PROBE_INFO_BUFFER_LIST(info));
+    for (guint i = 0; i < gst_buffer_list_length(list);)
+    {
+      GstBuffer *packet = gst_buffer_ref(gst_buffer_list_get(list, i));
+      gst_buffer_list_remove(list, i, 1);
+      if (viewer_queue_filter_buffer(queue, &packet))
+        gst_buffer_list_insert(list, i++, packet);
+      else
+        gst_buffer_unref(packet);
+    }
+    GST_PAD_PROBE_INFO_DATA(info) = list;
+    return gst_buffer_list_length(list) > 0 ? GST_PAD_PROBE_OK : GST_PAD_PROBE_DROP;
+  }
+
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+  if (!viewer_queue_filter_buffer(queue, &buffer))
+    return GST_PAD_PROBE_DROP;
+
+  GST_PAD_PROBE_INFO_DATA(info) = buffer;
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+viewer_queue_count_out(ViewerQueue *queue, GstBuffer *buffer)
+{
+  g_atomic_int_add(&queue->out_bytes, (gint)gst_buffer_get_size(buffer));
+  if (GST_BUFFER_PTS_IS_VALID(buffer))
+    g_atomic_int_set(&queue->out_pts_ms, (guint)(GST_BUFFER_PTS(buffer) / GST_MSECOND));
+}
+
+static GstPadProbeReturn
+viewer_queue_src_probe_cb(G_GNUC_UNUSED GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+  ViewerQueue *queue = (ViewerQueue *)user_data;
+
+  if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+  {
+    GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+    guint length = gst_buffer_list_length(list);
+    for (guint i = 0; i < length; i++)
+      viewer_queue_count_out(queue, gst_buffer_list_get(list, i));
+  }
+  else
+  {
+    viewer_queue_count_out(queue, GST_PAD_PROBE_INFO_BUFFER(info));
+  }
+  return GST_PAD_PROBE_OK;
+}
+
+// Filters what enters queue_element. Call after any other filter on its sink pad, so their drops
+// aren't mistaken for losses.
+static void
+attach_viewer_queue(ViewerQueue *queue, GstElement *queue_element)
+{
+  GstPadProbeType types = (GstPadProbeType)(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST);
+  GstPad *sink = gst_element_get_static_pad(queue_element, "sink");
+  GstPad *src = gst_element_get_static_pad(queue_element, "src");
+
+  gst_pad_add_probe(sink, types, viewer_queue_sink_probe_cb, g_atomic_rc_box_acquire(queue), viewer_queue_release);
+  gst_pad_add_probe(src, types, viewer_queue_src_probe_cb, g_atomic_rc_box_acquire(queue), viewer_queue_release);
+  gst_object_unref(sink);
+  gst_object_unref(src);
+}
+
+static void
+viewer_queue_add_members(JsonBuilder *builder, ViewerQueue *queue)
+{
+  json_builder_set_member_name(builder, "queue_ms");
+  json_builder_add_int_value(builder, (guint)(g_atomic_int_get(&queue->in_pts_ms) - g_atomic_int_get(&queue->out_pts_ms)));
+  json_builder_set_member_name(builder, "queue_bytes");
+  json_builder_add_int_value(builder, (guint)(g_atomic_int_get(&queue->in_bytes) - g_atomic_int_get(&queue->out_bytes)));
+  json_builder_set_member_name(builder, "queue_skips");
+  json_builder_add_int_value(builder, (guint)g_atomic_int_get(&queue->skips));
+  json_builder_set_member_name(builder, "queue_dropped_frames");
+  json_builder_add_int_value(builder, (guint)g_atomic_int_get(&queue->dropped_frames));
+  json_builder_set_member_name(builder, "queue_lost_upstream");
+  json_builder_add_int_value(builder, (guint)g_atomic_int_get(&queue->lost_upstream));
+}
+
+// One report line if the viewer dropped anything so far.
+static void
+viewer_queue_report(ViewerQueue *queue, const gchar *label)
+{
+  guint skips = g_atomic_int_get(&queue->skips);
+  if (skips == 0)
+    return;
+
+  g_print("🐢 %s: fell behind %u times, %u frames dropped to the next keyframe (%u %s)%s, queue now %u ms / %u KB\n",
+          label, skips, (guint)g_atomic_int_get(&queue->dropped_frames), (guint)g_atomic_int_get(&queue->dropped_total),
+          queue->rtp ? "packets" : "buffers", queue->skipping ? ", skipping" : "",
+          (guint)(g_atomic_int_get(&queue->in_pts_ms) - g_atomic_int_get(&queue->out_pts_ms)),
+          (guint)(g_atomic_int_get(&queue->in_bytes) - g_atomic_int_get(&queue->out_bytes)) / 1024);
+}
+
+#endif // VIEWER_QUEUE_H
@@ -15,6 +15,7 @@
 
 #define SOUP_HTTP_PORT 8082
 #define STREAMING_WEBSOCKET_PORT 8082  // StreamingProgram will use same port for /ws
+#define STREAMING_CONTROL_URL "http://127.0.0.1:8081/control"  // StreamingProgram live control endpoint
 
 // g++ WebControlServer.cpp -o WebControlServer `pkg-config --cflags --libs glib-2.0 libsoup-2.4 json-glib-1.0` -std=c++17
 
@@ -39,6 +40,12 @@ typedef struct {
     gchar *stun_url;
     gchar *client_ip;
     gint client_port;
+    gchar *source;        // Video source (optional: v4l2, test, file or shm)
+    gchar *device;        // v4l2 device node (optional, --source=v4l2)
+    gchar *source_pattern;  // videotestsrc pattern (optional, --source=test)
+    gchar *source_location; // Raw file or shm socket path (--source=file or shm)
+    gchar *encoder;       // Encoder backend (optional: auto, omx, x264, x265, openh264, vp8)
+    gchar *preset;        // Encoder preset (optional: ultra-low-latency, balanced, quality)
 } ServerState;
 
 ServerState server_state = {
@@ -56,7 +63,13 @@ ServerState server_state = {
     .turn_url = g_strdup("turn://ab:ab@192.168.25.90:3478"),
     .stun_url = g_strdup("stun:stun.l.google.com:19302"),
     .client_ip = g_strdup("192.168.25.90"),
-    .client_port = 5004
+    .client_port = 5004,
+    .source = NULL,       // NULL = StreamingProgram default (v4l2)
+    .device = NULL,       // NULL = StreamingProgram default (/dev/video0)
+    .source_pattern = NULL,
+    .source_location = NULL,
+    .encoder = NULL,      // NULL = auto (omx on the board, software elsewhere)
+    .preset = NULL        // NULL = ultra-low-latency
 };
 
 // Function to check if a process is running
@@ -206,6 +219,46 @@ gboolean start_streaming() {
         g_print("  Audio: Disabled\n");
     }
     
+    // Add video source if specified (defaults to v4l2 capture)
+    gchar *source_arg = NULL;
+    if (server_state.source != NULL && strlen(server_state.source) > 0) {
+        source_arg = g_strdup_printf("--source=%s", server_state.source);
+        g_ptr_array_add(argv_array, source_arg);
+        g_print("  Source: %s\n", server_state.source);
+    }
+    gchar *device_arg = NULL;
+    gchar *pattern_arg = NULL;
+    gchar *location_arg = NULL;
+    if (server_state.device != NULL && strlen(server_state.device) > 0) {
+        device_arg = g_strdup_printf("--device=%s", server_state.device);
+        g_ptr_array_add(argv_array, device_arg);
+        g_print("  Device: %s\n", server_state.device);
+    }
+    if (server_state.source_pattern != NULL && strlen(server_state.source_pattern) > 0) {
+        pattern_arg = g_strdup_printf("--source-pattern=%s", server_state.source_pattern);
+        g_ptr_array_add(argv_array, pattern_arg);
+        g_print("  Pattern: %s\n", server_state.source_pattern);
+    }
+    if (server_state.source_location != NULL && strlen(server_state.source_location) > 0) {
+        location_arg = g_strdup_printf("--source-location=%s", server_state.source_location);
+        g_ptr_array_add(argv_array, location_arg);
+        g_print("  Location: %s\n", server_state.source_location);
+    }
+    
+    // Add encoder backend and preset if specified
+    gchar *encoder_arg = NULL;
+    gchar *preset_arg = NULL;
+    if (server_state.encoder != NULL && strlen(server_state.encoder) > 0) {
+        encoder_arg = g_strdup_printf("--encoder=%s", server_state.encoder);
+        g_ptr_array_add(argv_array, encoder_arg);
+        g_print("  Encoder: %s\n", server_state.encoder);
+    }
+    if (server_state.preset != NULL && strlen(server_state.preset) > 0) {
+        preset_arg = g_strdup_printf("--preset=%s", server_state.preset);
+        g_ptr_array_add(argv_array, preset_arg);
+        g_print("  Preset: %s\n", server_state.preset);
+    }
+    
     g_ptr_array_add(argv_array, NULL);
     gchar **argv = (gchar**)argv_array->pdata;
     
@@ -233,6 +286,12 @@ gboolean start_streaming() {
     g_free(audio_device_arg);
     if (acodec_arg) g_free(acodec_arg);
     if (abitrate_arg) g_free(abitrate_arg);
+    if (source_arg) g_free(source_arg);
+    if (device_arg) g_free(device_arg);
+    if (pattern_arg) g_free(pattern_arg);
+    if (location_arg) g_free(location_arg);
+    if (encoder_arg) g_free(encoder_arg);
+    if (preset_arg) g_free(preset_arg);
     g_ptr_array_free(argv_array, FALSE);
     
     if (!success) {
@@ -278,6 +337,104 @@ gboolean stop_streaming() {
     return TRUE;
 }
 
+// Parameters that can only change by restarting StreamingProgram (everything but bitrate, fps
+// and resolution)
+gchar *restart_parameters_key() {
+    return g_strdup_printf("%s|%s|%d|%s|%s|%s|%d|%s|%s|%s|%s|%s|%s",
+                           server_state.codec,
+                           server_state.acodec ? server_state.acodec : "", server_state.abitrate,
+                           server_state.turn_url, server_state.stun_url,
+                           server_state.client_ip, server_state.client_port,
+                           server_state.source ? server_state.source : "",
+                           server_state.device ? server_state.device : "",
+                           server_state.source_pattern ? server_state.source_pattern : "",
+                           server_state.source_location ? server_state.source_location : "",
+                           server_state.encoder ? server_state.encoder : "",
+                           server_state.preset ? server_state.preset : "");
+}
+
+// A live update waiting for StreamingProgram's answer; the browser's request is paused meanwhile.
+typedef struct {
+    SoupServer *server;
+    SoupMessage *message;
+    gboolean resize;
+    gint old_bitrate;
+    gint old_fps;
+} LiveUpdateRequest;
+
+gboolean live_update_pending = FALSE;
+
+void send_start_reply(SoupMessage *message, gboolean success, gboolean live_update, gdouble apply_ms, gdouble gap_ms);
+
+// StreamingProgram answered (or the session timed out); runs on the main loop.
+void live_parameters_applied_cb(G_GNUC_UNUSED SoupSession *session, SoupMessage *msg, gpointer user_data) {
+    LiveUpdateRequest *request = (LiveUpdateRequest *)user_data;
+    gboolean success = FALSE;
+    gboolean live_update = TRUE;
+    gdouble apply_ms = -1;
+    gdouble gap_ms = -1;
+
+    if (msg->status_code == SOUP_STATUS_OK) {
+        JsonParser *parser = json_parser_new();
+        if (json_parser_load_from_data(parser, msg->response_body->data, msg->response_body->length, NULL) &&
+            JSON_NODE_HOLDS_OBJECT(json_parser_get_root(parser))) {
+            JsonObject *obj = json_node_get_object(json_parser_get_root(parser));
+            // A refusal carries only success and a message
+            if (json_object_has_member(obj, "success"))
+                success = json_object_get_boolean_member(obj, "success");
+            if (json_object_has_member(obj, "first_frame_ms"))
+                apply_ms = json_object_get_double_member(obj, "first_frame_ms");
+            if (json_object_has_member(obj, "switch_gap_ms"))
+                gap_ms = json_object_get_double_member(obj, "switch_gap_ms");
+        }
+        g_object_unref(parser);
+    } else {
+        g_printerr("Live update failed: HTTP %u from StreamingProgram\n", msg->status_code);
+    }
+
+    if (success) {
+        if (request->resize)
+            g_print("✓ Switched resolution live, %.2f ms video gap\n", gap_ms);
+        else
+            g_print("✓ Applied live in %.2f ms\n", apply_ms);
+    } else if (request->resize) {
+        // e.g. a file source or simulcast: the new resolution still needs a restart
+        g_print("Live resolution change refused, restarting streaming program\n");
+        live_update = FALSE;
+        stop_streaming();
+        success = start_streaming();
+    } else {
+        server_state.bitrate = request->old_bitrate;
+        server_state.fps = request->old_fps;
+    }
+
+    send_start_reply(request->message, success, live_update, apply_ms, gap_ms);
+    soup_server_unpause_message(request->server, request->message);
+    live_update_pending = FALSE;
+    g_free(request);
+}
+
+// Ask the running StreamingProgram to change bitrate/fps, and resolution if request->resize is
+// set, in place without dropping viewers. Doesn't wait: the answer, with the time until the first
+// frame encoded with the new settings and the video gap of a resolution switch, is sent to the
+// paused request from live_parameters_applied_cb, so the control panel stays responsive.
+void apply_live_parameters(LiveUpdateRequest *request, gint bitrate, gint fps, gint width, gint height) {
+    // A resolution switch may reopen the capture device; StreamingProgram gives up after 5 s
+    static SoupSession *session = NULL;
+    if (session == NULL)
+        session = soup_session_new_with_options(SOUP_SESSION_TIMEOUT, 8, NULL);
+
+    SoupMessage *msg = soup_message_new("POST", STREAMING_CONTROL_URL);
+    gchar *body = request->resize ? g_strdup_printf("{\"bitrate\": %d, \"fps\": %d, \"width\": %d, \"height\": %d}",
+                                                    bitrate, fps, width, height)
+                                  : g_strdup_printf("{\"bitrate\": %d, \"fps\": %d}", bitrate, fps);
+    soup_message_set_request(msg, "application/json", SOUP_MEMORY_TAKE, body, strlen(body));
+
+    live_update_pending = TRUE;
+    soup_server_pause_message(request->server, request->message);
+    soup_session_queue_message(session, msg, live_parameters_applied_cb, request);
+}
+
 // HTTP handler for serving the control panel HTML
 void soup_http_handler(G_GNUC_UNUSED SoupServer *soup_server,
                        SoupMessage *message, const char *path,
@@ -372,6 +529,24 @@ void api_status_handler(G_GNUC_UNUSED SoupServer *soup_server,
     json_builder_set_member_name(builder, "client_port");
     json_builder_add_int_value(builder, server_state.client_port);
     
+    json_builder_set_member_name(builder, "source");
+    json_builder_add_string_value(builder, server_state.source ? server_state.source : "v4l2");
+    
+    json_builder_set_member_name(builder, "device");
+    json_builder_add_string_value(builder, server_state.device ? server_state.device : "");
+    
+    json_builder_set_member_name(builder, "source_pattern");
+    json_builder_add_string_value(builder, server_state.source_pattern ? server_state.source_pattern : "");
+    
+    json_builder_set_member_name(builder, "source_location");
+    json_builder_add_string_value(builder, server_state.source_location ? server_state.source_location : "");
+    
+    json_builder_set_member_name(builder, "encoder");
+    json_builder_add_string_value(builder, server_state.encoder ? server_state.encoder : "auto");
+    
+    json_builder_set_member_name(builder, "preset");
+    json_builder_add_string_value(builder, server_state.preset ? server_state.preset : "ultra-low-latency");
+    
     json_builder_end_object(builder);
     json_builder_end_object(builder);
     
@@ -394,7 +569,7 @@ void api_status_handler(G_GNUC_UNUSED SoupServer *soup_server,
 }
 
 // REST API: Start streaming
-void api_start_handler(G_GNUC_UNUSED SoupServer *soup_server,
+void api_start_handler(SoupServer *soup_server,
                       SoupMessage *message, const char *path,
                       G_GNUC_UNUSED GHashTable *query,
                       G_GNUC_UNUSED SoupClientContext *client_context,
@@ -404,6 +579,19 @@ void api_start_handler(G_GNUC_UNUSED SoupServer *soup_server,
         soup_message_set_status(message, SOUP_STATUS_METHOD_NOT_ALLOWED);
         return;
     }
+    // One change at a time; the parameters below are what the pending one is applying
+    if (live_update_pending) {
+        soup_message_set_status(message, SOUP_STATUS_CONFLICT);
+        return;
+    }
+    
+    // Remember what is running now so a bitrate/fps-only change can be applied live
+    gboolean was_running = server_state.streaming_running && is_process_running(server_state.streaming_pid);
+    gint old_bitrate = server_state.bitrate;
+    gint old_fps = server_state.fps;
+    gint old_width = server_state.width;
+    gint old_height = server_state.height;
+    gchar *old_restart_key = restart_parameters_key();
     
     // Parse JSON body if present
     if (message->request_body->length > 0) {
@@ -453,19 +641,76 @@ void api_start_handler(G_GNUC_UNUSED SoupServer *soup_server,
             }
             if (json_object_has_member(obj, "client_port"))
                 server_state.client_port = json_object_get_int_member(obj, "client_port");
+            if (json_object_has_member(obj, "source")) {
+                g_free(server_state.source);
+                server_state.source = g_strdup(json_object_get_string_member(obj, "source"));
+            }
+            if (json_object_has_member(obj, "device")) {
+                g_free(server_state.device);
+                server_state.device = g_strdup(json_object_get_string_member(obj, "device"));
+            }
+            if (json_object_has_member(obj, "source_pattern")) {
+                g_free(server_state.source_pattern);
+                server_state.source_pattern = g_strdup(json_object_get_string_member(obj, "source_pattern"));
+            }
+            if (json_object_has_member(obj, "source_location")) {
+                g_free(server_state.source_location);
+                server_state.source_location = g_strdup(json_object_get_string_member(obj, "source_location"));
+            }
+            if (json_object_has_member(obj, "encoder")) {
+                g_free(server_state.encoder);
+                server_state.encoder = g_strdup(json_object_get_string_member(obj, "encoder"));
+            }
+            if (json_object_has_member(obj, "preset")) {
+                g_free(server_state.preset);
+                server_state.preset = g_strdup(json_object_get_string_member(obj, "preset"));
+            }
         }
         
         g_object_unref(parser);
     }
     
-    gboolean success = start_streaming();
-    
+    gchar *new_restart_key = restart_parameters_key();
+    gboolean resize = server_state.width != old_width || server_state.height != old_height;
+    gboolean live_update = was_running && g_strcmp0(old_restart_key, new_restart_key) == 0 &&
+                           (server_state.bitrate != old_bitrate || server_state.fps != old_fps || resize);
+    g_free(old_restart_key);
+    g_free(new_restart_key);
+    
+    if (live_update) {
+        g_print("Applying bitrate=%d kbps fps=%d resolution=%dx%d live...\n",
+                server_state.bitrate, server_state.fps, server_state.width, server_state.height);
+        LiveUpdateRequest *request = g_new0(LiveUpdateRequest, 1);
+        request->server = soup_server;
+        request->message = message;
+        request->resize = resize;
+        request->old_bitrate = old_bitrate;
+        request->old_fps = old_fps;
+        apply_live_parameters(request, server_state.bitrate, server_state.fps, server_state.width, server_state.height);
+        return;
+    }
+
+    send_start_reply(message, start_streaming(), FALSE, -1, -1);
+}
+
+void send_start_reply(SoupMessage *message, gboolean success, gboolean live_update, gdouble apply_ms, gdouble gap_ms)
+{
     JsonBuilder *builder = json_builder_new();
     json_builder_begin_object(builder);
     json_builder_set_member_name(builder, "success");
     json_builder_add_boolean_value(builder, success);
     json_builder_set_member_name(builder, "message");
-    json_builder_add_string_value(builder, success ? "Streaming started" : "Failed to start streaming");
+    if (live_update) {
+        json_builder_add_string_value(builder, success ? "Parameters applied live" : "Failed to apply parameters live");
+        json_builder_set_member_name(builder, "applied_live");
+        json_builder_add_boolean_value(builder, TRUE);
+        json_builder_set_member_name(builder, "apply_ms");
+        json_builder_add_double_value(builder, apply_ms);
+        json_builder_set_member_name(builder, "switch_gap_ms");
+        json_builder_add_double_value(builder, gap_ms);
+    } else {
+        json_builder_add_string_value(builder, success ? "Streaming started" : "Failed to start streaming");
+    }
     json_builder_end_object(builder);
     
     JsonGenerator *generator = json_generator_new();
@@ -714,6 +959,20 @@ void api_config_handler(G_GNUC_UNUSED SoupServer *soup_server,
                 config_file << "fps=" << json_object_get_int_member(root, "fps") << "\n";
             }
             
+            config_file << "\n# Video Source\n";
+            if (json_object_has_member(root, "source")) {
+                config_file << "source=" << json_object_get_string_member(root, "source") << "\n";
+            }
+            if (json_object_has_member(root, "device")) {
+                config_file << "device=" << json_object_get_string_member(root, "device") << "\n";
+            }
+            if (json_object_has_member(root, "source_pattern")) {
+                config_file << "source_pattern=" << json_object_get_string_member(root, "source_pattern") << "\n";
+            }
+            if (json_object_has_member(root, "source_location")) {
+                config_file << "source_location=" << json_object_get_string_member(root, "source_location") << "\n";
+            }
+            
             config_file << "\n# Audio Settings\n";
             if (json_object_has_member(root, "acodec")) {
                 config_file << "acodec=" << json_object_get_string_member(root, "acodec") << "\n";
@@ -897,6 +1156,12 @@ int main(int argc, char *argv[]) {
     g_free(server_state.turn_url);
     g_free(server_state.stun_url);
     g_free(server_state.client_ip);
+    g_free(server_state.source);
+    g_free(server_state.device);
+    g_free(server_state.source_pattern);
+    g_free(server_state.source_location);
+    g_free(server_state.encoder);
+    g_free(server_state.preset);
     
     g_print("Goodbye!\n");
     return 0;